@@ -0,0 +1,278 @@
+#pragma once
+
+#include <iostream>
+#include <string>
+#include <cstdint>
+#include <cstring>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <unordered_map>
+#include <functional>
+#include "MappedImage.h"
+#include "Compress.h"
+using namespace std;
+
+
+// 128-bit content hash identifying a chunk. Wide enough that distinct chunks are not
+// expected to collide, so saved images refer to chunks by id alone.
+struct ChunkId {
+    uint64_t low = 0;
+    uint64_t high = 0;
+
+    bool operator==(const ChunkId& other) const { return low == other.low && high == other.high; }
+    bool operator!=(const ChunkId& other) const { return !(*this == other); }
+};
+
+struct ChunkIdHash {
+    size_t operator()(const ChunkId& id) const { return size_t(id.low); }
+};
+
+// MurmurHash3 (x64, 128-bit variant) of data[0, len)
+inline ChunkId chunkId(const char* data, size_t len) {
+    const uint64_t c1 = 0x87c37b91114253d5ull, c2 = 0x4cf5ad432745937full;
+    auto rotl = [](uint64_t x, int r) { return (x << r) | (x >> (64 - r)); };
+    auto fmix = [](uint64_t k) {
+        k ^= k >> 33;
+        k *= 0xff51afd7ed558ccdull;
+        k ^= k >> 33;
+        k *= 0xc4ceb9fe1a85ec53ull;
+        k ^= k >> 33;
+        return k;
+    };
+    const unsigned char* bytes = reinterpret_cast<const unsigned char*>(data);
+    uint64_t h1 = 0, h2 = 0;
+    size_t blocks = len / 16;
+    for (size_t i = 0; i < blocks; i++) {
+        uint64_t k1, k2;
+        memcpy(&k1, bytes + i * 16, 8); // Little-endian hosts, like the image format
+        memcpy(&k2, bytes + i * 16 + 8, 8);
+        k1 *= c1; k1 = rotl(k1, 31); k1 *= c2; h1 ^= k1;
+        h1 = rotl(h1, 27); h1 += h2; h1 = h1 * 5 + 0x52dce729;
+        k2 *= c2; k2 = rotl(k2, 33); k2 *= c1; h2 ^= k2;
+        h2 = rotl(h2, 31); h2 += h1; h2 = h2 * 5 + 0x38495ab5;
+    }
+    const unsigned char* tail = bytes + blocks * 16;
+    uint64_t k1 = 0, k2 = 0;
+    for (size_t i = len & 15; i > 8; i--) k2 = (k2 << 8) | tail[i - 1];
+    for (size_t i = min<size_t>(len & 15, 8); i > 0; i--) k1 = (k1 << 8) | tail[i - 1];
+    k2 *= c2; k2 = rotl(k2, 33); k2 *= c1; h2 ^= k2;
+    k1 *= c1; k1 = rotl(k1, 31); k1 *= c2; h1 ^= k1;
+    h1 ^= len;
+    h2 ^= len;
+    h1 += h2;
+    h2 += h1;
+    h1 = fmix(h1);
+    h2 = fmix(h2);
+    h1 += h2;
+    h2 += h1;
+    return {h1, h2};
+}
+
+class ChunkStore;
+
+// One block of file content. A chunk is either private to the rope node holding it,
+// which may change it in place, or shared: interned in a ChunkStore, referred to from
+// more than one node, a view of a saved image, or compressed. Shared chunks never
+// change; a rope copies one before writing to it.
+//
+// A compressed chunk keeps the block packed by lzCompress and unpacks it whenever it
+// is read, so the block costs memory at its compressed size.
+struct Chunk {
+    atomic<uint32_t> refs; // Nodes and other holders referring to this chunk
+    bool compressed; // The stored bytes are the block packed by lzCompress
+    bool hashed; // id is set: always once the chunk is interned or compressed
+    uint32_t rawLength; // Length of the block, if compressed
+    ChunkStore* store; // Set once the chunk is interned
+    ChunkId id; // Content hash of the block (not of the stored bytes)
+    string bytes; // The stored bytes, unless the chunk is a view
+    shared_ptr<const MappedImage> image; // Image a view points into, kept mapped while the chunk lives
+    const char* view;
+    size_t viewLength;
+
+    Chunk(string bytes) : refs(1), compressed(false), hashed(false), rawLength(0), store(nullptr), bytes(move(bytes)),
+                          view(nullptr), viewLength(0) {}
+    // View of len bytes at data inside image, copied instead if image is null
+    Chunk(shared_ptr<const MappedImage> image, const char* data, size_t len)
+        : refs(1), compressed(false), hashed(false), rawLength(0), store(nullptr), bytes(image ? string() : string(data, len)),
+          image(move(image)), view(this->image ? data : nullptr), viewLength(this->image ? len : 0) {}
+    Chunk(const Chunk&) = delete;
+    Chunk& operator=(const Chunk&) = delete;
+
+    // The stored bytes: the block itself, or the packed block if compressed
+    const char* data() const { return view ? view : bytes.data(); }
+    size_t storedSize() const { return view ? viewLength : bytes.size(); }
+    size_t size() const { return compressed ? rawLength : storedSize(); } // Length of the block
+    bool shared() const { return store || view || compressed || refs.load(memory_order_acquire) > 1; }
+
+    // The block's bytes: data() itself, or the block unpacked into scratch. A
+    // compressed block that does not unpack (a damaged image) reads as zeros.
+    const char* raw(string& scratch) const {
+        if (!compressed) return data();
+        scratch.resize(rawLength);
+        if (!lzDecompress(data(), storedSize(), &scratch[0], rawLength)) scratch.assign(rawLength, '\0');
+        return scratch.data();
+    }
+
+    ChunkId hash() const {
+        if (hashed) return id;
+        string scratch;
+        return chunkId(raw(scratch), size());
+    }
+
+    // Same block, stored the same way
+    bool sameAs(const Chunk& other) const {
+        return compressed == other.compressed && size() == other.size() && storedSize() == other.storedSize() &&
+               memcmp(data(), other.data(), storedSize()) == 0;
+    }
+
+    // A chunk of its own with the same stored bytes, viewing the same image if this one is a view
+    Chunk* copy() const {
+        Chunk* chunk = new Chunk(image, data(), storedSize());
+        chunk->compressed = compressed;
+        chunk->hashed = hashed;
+        chunk->rawLength = rawLength;
+        chunk->id = id;
+        return chunk;
+    }
+
+    // Compressed copy of the block, or nullptr if packing it saves less than
+    // minSavingPercent of its length
+    Chunk* compress(uint32_t minSavingPercent) const {
+        string scratch, packed;
+        const char* block = raw(scratch);
+        if (!lzCompress(block, size(), packed) || packed.size() * 100 > size() * (100 - min<uint32_t>(minSavingPercent, 100))) {
+            return nullptr;
+        }
+        packed.shrink_to_fit(); // lzCompress reserved room for the whole block
+        Chunk* chunk = new Chunk(move(packed));
+        chunk->compressed = true;
+        chunk->rawLength = uint32_t(size());
+        chunk->id = hashed ? id : chunkId(block, size());
+        chunk->hashed = true;
+        return chunk;
+    }
+};
+
+// What Rope::pack does with the blocks a write handle leaves behind
+struct PackPolicy {
+    ChunkStore* store = nullptr; // Intern blocks here, if set
+    bool compress = false; // Compress blocks of large enough ropes
+    uint64_t minFileSize = 64 << 10; // Ropes shorter than this stay uncompressed
+    uint32_t minSavingPercent = 25; // Keep a block compressed only if it shrinks by at least this much
+};
+
+// Counted reference to a chunk; the last one to let go frees it and takes it out of
+// its store
+class ChunkRef {
+    public:
+        ChunkRef() : chunk(nullptr) {}
+        explicit ChunkRef(Chunk* chunk) : chunk(chunk) {} // Adopts a new chunk, or one whose count the caller raised
+        ChunkRef(const ChunkRef& other) : chunk(other.chunk) {
+            if (chunk) chunk->refs.fetch_add(1, memory_order_relaxed);
+        }
+        ChunkRef(ChunkRef&& other) noexcept : chunk(other.chunk) { other.chunk = nullptr; }
+        ChunkRef& operator=(ChunkRef other) noexcept {
+            swap(chunk, other.chunk);
+            return *this;
+        }
+        ~ChunkRef() { release(); }
+
+        Chunk* get() const { return chunk; }
+        Chunk* operator->() const { return chunk; }
+        explicit operator bool() const { return chunk != nullptr; }
+
+    private:
+        Chunk* chunk;
+
+        inline void release();
+};
+
+// Content-addressed set of chunks shared by every file of a FileSystem, so identical
+// blocks are held once however many files contain them. The store does not own its
+// chunks: each one leaves the store when the last reference to it goes away. Split
+// into shards with their own lock, like PathCache.
+class ChunkStore {
+    public:
+        ChunkStore() : chunkCount(0), byteCount(0) {}
+        ChunkStore(const ChunkStore&) = delete;
+        ChunkStore& operator=(const ChunkStore&) = delete;
+
+        // Point ref at the stored chunk with the same content, storing ref's chunk first
+        // if there is none. Blocks only match chunks stored the same way (both
+        // compressed or both not). Call with the only node holding ref locked for writing.
+        void intern(ChunkRef& ref) {
+            if (ref->store) return;
+            ChunkId id = ref->hash();
+            Shard& shard = shardFor(id);
+            unique_lock<shared_mutex> guard(shard.lock);
+            if (Chunk* found = findLocked(shard, id, *ref.get())) {
+                guard.unlock();
+                ref = ChunkRef(found);
+                return;
+            }
+            // A chunk other holders can see must not change, so those get a stored copy
+            if (ref->refs.load(memory_order_acquire) > 1) ref = ChunkRef(ref->copy());
+            ref->id = id;
+            ref->hashed = true;
+            ref->store = this;
+            shard.chunks.emplace(id, ref.get());
+            chunkCount++;
+            byteCount += ref->storedSize();
+        }
+
+        size_t size() const { return chunkCount.load(memory_order_relaxed); } // Chunks stored
+        uint64_t bytes() const { return byteCount.load(memory_order_relaxed); } // Their total stored size
+
+    private:
+        friend class ChunkRef;
+
+        static const size_t SHARD_COUNT = 16;
+
+        struct Shard {
+            mutable shared_mutex lock;
+            unordered_multimap<ChunkId, Chunk*, ChunkIdHash> chunks; // Multi in case ids ever collide
+        };
+
+        Shard shards[SHARD_COUNT];
+        atomic<size_t> chunkCount;
+        atomic<uint64_t> byteCount;
+
+        Shard& shardFor(const ChunkId& id) { return shards[id.high % SHARD_COUNT]; }
+
+        // A live chunk with this content, its count raised for the caller. Chunks whose
+        // count already reached zero are on their way out and cannot be revived.
+        static Chunk* findLocked(Shard& shard, const ChunkId& id, const Chunk& like) {
+            auto range = shard.chunks.equal_range(id);
+            for (auto it = range.first; it != range.second; ++it) {
+                Chunk* chunk = it->second;
+                if (!chunk->sameAs(like)) continue;
+                uint32_t refs = chunk->refs.load(memory_order_relaxed);
+                while (refs > 0 && !chunk->refs.compare_exchange_weak(refs, refs + 1, memory_order_acq_rel)) {}
+                if (refs > 0) return chunk;
+            }
+            return nullptr;
+        }
+
+        // Called by the last reference to a stored chunk, which is then deleted
+        void erase(Chunk* chunk) {
+            Shard& shard = shardFor(chunk->id);
+            unique_lock<shared_mutex> guard(shard.lock);
+            auto range = shard.chunks.equal_range(chunk->id);
+            for (auto it = range.first; it != range.second; ++it) {
+                if (it->second == chunk) {
+                    shard.chunks.erase(it);
+                    break;
+                }
+            }
+            chunkCount--;
+            byteCount -= chunk->storedSize();
+        }
+};
+
+inline void ChunkRef::release() {
+    if (!chunk || chunk->refs.fetch_sub(1, memory_order_acq_rel) != 1) return;
+    if (chunk->store) chunk->store->erase(chunk);
+    delete chunk;
+}
@@ -0,0 +1,252 @@
+#pragma once
+
+#include <iostream>
+#include <string>
+#include <cstdint>
+#include <cstring>
+#include <cctype>
+#include <charconv>
+#include <algorithm>
+using namespace std;
+
+
+// Every command CommandHandler understands
+enum class Opcode : uint8_t {
+    Create,
+    Delete,
+    Mkdir,
+    Chdir,
+    Ls,
+    Move,
+    Open,
+    Close,
+    Write,
+    WriteAt,
+    Read,
+    ReadFrom,
+    MoveWithin,
+    Truncate,
+    MemoryMap,
+    Help,
+    Exit,
+    Begin,
+    Commit,
+    Abort,
+    Dedup,
+    Stats,
+    Find,
+    Du,
+    Grep,
+    Sync,
+    Reserve,
+    Unknown
+};
+
+struct CommandInfo {
+    const char* name;
+    Opcode op;
+    const char* usage;
+};
+
+// Indexed by Opcode
+const CommandInfo COMMAND_TABLE[] = {
+    {"create", Opcode::Create, "create <filename>"},
+    {"delete", Opcode::Delete, "delete <filename>"},
+    {"mkdir", Opcode::Mkdir, "mkdir <dirname>"},
+    {"chdir", Opcode::Chdir, "chdir <dirname>"},
+    {"ls", Opcode::Ls, "ls"},
+    {"move", Opcode::Move, "move <source> <target>"},
+    {"open", Opcode::Open, "open <filename>"},
+    {"close", Opcode::Close, "close <filename>"},
+    {"write", Opcode::Write, "write <filename> <text>"},
+    {"write_at", Opcode::WriteAt, "write_at <filename> <pos> <text>"},
+    {"read", Opcode::Read, "read <filename>"},
+    {"read_from", Opcode::ReadFrom, "read_from <filename> <start> <size>"},
+    {"move_within", Opcode::MoveWithin, "move_within <filename> <start> <size> <target>"},
+    {"truncate", Opcode::Truncate, "truncate <filename> <size>"},
+    {"memory_map", Opcode::MemoryMap, "memory_map"},
+    {"help", Opcode::Help, "help"},
+    {"exit", Opcode::Exit, "exit"},
+    {"begin", Opcode::Begin, "begin"},
+    {"commit", Opcode::Commit, "commit"},
+    {"abort", Opcode::Abort, "abort"},
+    {"dedup", Opcode::Dedup, "dedup"},
+    {"stats", Opcode::Stats, "stats"},
+    {"find", Opcode::Find, "find <pattern>"},
+    {"du", Opcode::Du, "du [dirname]"},
+    {"grep", Opcode::Grep, "grep <pattern> [dirname]"},
+    {"sync", Opcode::Sync, "sync"},
+    {"reserve", Opcode::Reserve, "reserve <filename> <size>"}
+};
+
+// One parsed command line. Arguments are stored by role rather than by position:
+//   name    file or directory the command names, the move source, the find
+//           pattern, or the unrecognized word for Opcode::Unknown
+//   target  move target
+//   text    rest of the line for write, write_at and help (the help topic), or
+//           the grep pattern
+//   a, b, c numeric arguments in command order (pos / start, size, target)
+// Missing or malformed numbers are 0.
+struct Command {
+    Opcode op;
+    string name;
+    string target;
+    string text;
+    int a, b, c;
+
+    Command() : op(Opcode::Unknown), a(0), b(0), c(0) {}
+};
+
+// Opcode for a command word. Candidates are picked by length and first letter, so
+// a lookup costs at most one string comparison.
+inline Opcode lookupOpcode(const char* word, size_t len) {
+    auto is = [&](Opcode op) {
+        return memcmp(word, COMMAND_TABLE[size_t(op)].name, len) == 0 ? op : Opcode::Unknown;
+    };
+    switch (len) {
+        case 2: return word[0] == 'l' ? is(Opcode::Ls) : is(Opcode::Du);
+        case 4:
+            switch (word[0]) {
+                case 'm': return is(Opcode::Move);
+                case 'o': return is(Opcode::Open);
+                case 'r': return is(Opcode::Read);
+                case 'h': return is(Opcode::Help);
+                case 'e': return is(Opcode::Exit);
+                case 'f': return is(Opcode::Find);
+                case 'g': return is(Opcode::Grep);
+                case 's': return is(Opcode::Sync);
+            }
+            break;
+        case 5:
+            switch (word[0]) {
+                case 'm': return is(Opcode::Mkdir);
+                case 'c': return word[1] == 'h' ? is(Opcode::Chdir) : is(Opcode::Close);
+                case 'w': return is(Opcode::Write);
+                case 'b': return is(Opcode::Begin);
+                case 'a': return is(Opcode::Abort);
+                case 'd': return is(Opcode::Dedup);
+                case 's': return is(Opcode::Stats);
+            }
+            break;
+        case 6:
+            if (word[0] == 'c') return word[1] == 'r' ? is(Opcode::Create) : is(Opcode::Commit);
+            return is(Opcode::Delete);
+        case 7: return is(Opcode::Reserve);
+        case 8: return word[0] == 'w' ? is(Opcode::WriteAt) : is(Opcode::Truncate);
+        case 9: return is(Opcode::ReadFrom);
+        case 10: return is(Opcode::MemoryMap);
+        case 11: return is(Opcode::MoveWithin);
+    }
+    return Opcode::Unknown;
+}
+
+// Splits a command line in place, without copying it into a stream
+class CommandScanner {
+    public:
+        CommandScanner(const string& line) : line(line), pos(0) {}
+
+        // Next whitespace-separated word, as a pointer and length into the line
+        const char* word(size_t& len) {
+            while (pos < line.size() && isspace((unsigned char)line[pos])) pos++;
+            size_t start = pos;
+            while (pos < line.size() && !isspace((unsigned char)line[pos])) pos++;
+            len = pos - start;
+            return line.data() + start;
+        }
+
+        string str() {
+            size_t len;
+            const char* start = word(len);
+            return string(start, len);
+        }
+
+        int number() {
+            size_t len;
+            const char* start = word(len);
+            int value = 0;
+            from_chars(start, start + len, value);
+            return value;
+        }
+
+        // Everything after the current position, minus the separating space
+        string rest() {
+            size_t start = pos < line.size() && line[pos] == ' ' ? pos + 1 : pos;
+            pos = line.size();
+            return line.substr(min(start, line.size()));
+        }
+
+    private:
+        const string& line;
+        size_t pos;
+};
+
+inline Command parseCommand(const string& line) {
+    CommandScanner scanner(line);
+    Command command;
+    size_t len;
+    const char* word = scanner.word(len);
+    command.op = lookupOpcode(word, len);
+    switch (command.op) {
+        case Opcode::Create:
+        case Opcode::Delete:
+        case Opcode::Mkdir:
+        case Opcode::Chdir:
+        case Opcode::Open:
+        case Opcode::Close:
+        case Opcode::Read:
+        case Opcode::Find:
+        case Opcode::Du:
+            command.name = scanner.str();
+            break;
+        case Opcode::Move:
+            command.name = scanner.str();
+            command.target = scanner.str();
+            break;
+        case Opcode::Write:
+            command.name = scanner.str();
+            command.text = scanner.rest();
+            break;
+        case Opcode::WriteAt:
+            command.name = scanner.str();
+            command.a = scanner.number();
+            command.text = scanner.rest();
+            break;
+        case Opcode::ReadFrom:
+            command.name = scanner.str();
+            command.a = scanner.number();
+            command.b = scanner.number();
+            break;
+        case Opcode::MoveWithin:
+            command.name = scanner.str();
+            command.a = scanner.number();
+            command.b = scanner.number();
+            command.c = scanner.number();
+            break;
+        case Opcode::Truncate:
+        case Opcode::Reserve:
+            command.name = scanner.str();
+            command.a = scanner.number();
+            break;
+        case Opcode::Help:
+            command.text = scanner.rest();
+            break;
+        case Opcode::Grep:
+            command.text = scanner.str();
+            command.name = scanner.str();
+            break;
+        case Opcode::Unknown:
+            command.name = string(word, len);
+            break;
+        case Opcode::Ls:
+        case Opcode::MemoryMap:
+        case Opcode::Exit:
+        case Opcode::Begin:
+        case Opcode::Commit:
+        case Opcode::Abort:
+        case Opcode::Dedup:
+        case Opcode::Stats:
+        case Opcode::Sync:
+            break;
+    }
+    return command;
+}
@@ -1,116 +1,232 @@
 #pragma once
 #include "FileSystem.h"
 #include "CommandUtils.h"
+#include "Command.h"
 #include <sstream>
+#include <set>
 
 class CommandHandler {
 private:
     FileSystem& fs;
+    Session session; // This handler's own working directory
+    ostream& out; // Where read and read_from write file contents
     std::stringstream output;
+    bool batching; // Between begin and commit/abort
+    vector<Command> batch; // Commands queued since begin
 
 public:
-    CommandHandler(FileSystem& fileSystem) : fs(fileSystem) {}
+    // Status and error messages go to messages, file contents to out
+    CommandHandler(FileSystem& fileSystem, ostream& out = cout, ostream& messages = cout)
+        : fs(fileSystem), session(fileSystem.newSession()), out(out), batching(false) {
+        session.output = &messages;
+    }
 
+    // Run one command line and return its result; the time it takes is recorded in Stats
     string processCommand(const string& cmdLine) {
-        stringstream ss(cmdLine);
-        string cmd;
-        ss >> cmd;
+        Stats::Clock::time_point start = Stats::Clock::now();
+        Command command = parseCommand(cmdLine);  // Opcode and arguments in one pass over the line
+        Opcode op = command.op;
+        string result = dispatch(command, cmdLine);
+        Stats::command(op, Stats::since(start));
+        return result;
+    }
+
+    // Run a parsed command; returns false if it failed
+    bool execute(const Command& command) {
+        const string& fname = command.name;
+        switch (command.op) {
+            case Opcode::Create:
+                return fs.createFile(session, fname);  // Create new file
+            case Opcode::Delete:
+                return fs.deleteFile(session, fname);  // Delete specified file
+            case Opcode::Help:
+                if (command.text.empty()) {
+                    fs.showHelp(session.messages());  // Show general help if no specific command is provided
+                } else {
+                    fs.showSpecificHelp(command.text, session.messages());  // Show help for the specific command
+                }
+                break;
+            case Opcode::Mkdir:
+                return fs.mkdir(session, command.name);  // Create new directory
+            case Opcode::Chdir:
+                return fs.chDir(session, command.name);  // Change current directory
+            case Opcode::Ls:
+                fs.listFiles(session);  // Lists all files and directories in the current directory
+                break;
+            case Opcode::Move:
+                return fs.moveFile(session, command.name, command.target);  // Move file from source to target
+            case Opcode::Open:
+                return bool(fs.openFile(session, fname));  // Open specified file
+            case Opcode::Close:
+                return fs.closeFile(session, fname);  // Close specified file
+            case Opcode::Write:
+                if (!fs.appendFile(session, fname, command.text)) return false;  // Append text if file exists
+                Stats::written(command.text.size());
+                break;
+            case Opcode::WriteAt: {
+                FileRef file = fs.openFile(session, fname);  // Get locked file handle
+                if (!file) return false;
+                File* target = file.get();
+                size_t oldSize = file->size();
+                string overwritten;  // Bytes the write replaces, kept only for a rollback
+                if (session.transaction && command.a >= 0) {
+                    file->load();
+                    overwritten = file->content.substr(command.a, command.text.size());
+                }
+                if (!file->write_at(command.a, command.text)) return false;  // Write at position if file exists
+                Stats::written(command.text.size());
+                fs.record(session, file.directory(), JournalRecord(JournalOp::WriteAt, file->name(), command.text, command.a));
+                FileSystem::onRollback(session, [target, oldSize, pos = command.a, overwritten] {
+                    target->content.overwrite(pos, overwritten);
+                    target->content.truncate(oldSize);  // Drop padding and anything written past the old end
+                });
+                break;
+            }
+            case Opcode::Read: {
+                FileView file = fs.viewFile(session, fname);  // Shared view; takes no file lock and leaves the file closed
+                if (!file) return false;
+                size_t sent = 0;
+                file->stream([this, &sent](string_view piece) {
+                    out.write(piece.data(), piece.size());  // Blocks go out as they are
+                    sent += piece.size();
+                });
+                out << '\n';
+                Stats::read(sent);
+                break;
+            }
+            case Opcode::ReadFrom: {
+                FileView file = fs.viewFile(session, fname);
+                if (!file) return false;
+                size_t sent = 0;
+                file->stream_from(command.a, command.b, [this, &sent](string_view piece) {
+                    out.write(piece.data(), piece.size());
+                    sent += piece.size();
+                }, session.messages());
+                out << '\n';  // Output portion of file
+                Stats::read(sent);
+                break;
+            }
+            case Opcode::MoveWithin: {
+                FileRef file = fs.openFile(session, fname);  // Get locked file handle
+                if (!file) return false;
+                File* target = file.get();
+                size_t oldSize = file->size();
+                if (!file->move_within_file(command.a, command.b, command.c, session.messages())) return false;  // Move data within file
+                fs.record(session, file.directory(), JournalRecord(JournalOp::MoveWithin, file->name(), "", command.a, command.b, command.c));
+                // The moved bytes landed at min(target, size without them); moving them back undoes it
+                size_t landed = min<size_t>(command.c, oldSize - command.b);
+                FileSystem::onRollback(session, [target, landed, start = command.a, length = command.b] {
+                    Rope moved = target->content.extract(landed, length);
+                    target->content.splice(start, move(moved));
+                });
+                break;
+            }
+            case Opcode::Truncate: {
+                FileRef file = fs.openFile(session, fname);  // Get locked file handle
+                if (!file) return false;
+                File* target = file.get();
+                string tail;  // Bytes the truncation removes, kept only for a rollback
+                if (session.transaction && command.a >= 0) {
+                    file->load();
+                    tail = file->content.substr(command.a, file->content.size());
+                }
+                if (!file->truncate_file(command.a, session.messages())) return false;  // Truncate file to specified size
+                fs.record(session, file.directory(), JournalRecord(JournalOp::Truncate, file->name(), "", command.a));
+                FileSystem::onRollback(session, [target, tail] { target->content.append(tail); });
+                break;
+            }
+            case Opcode::Reserve:
+                return fs.reserveFile(session, fname, command.a);  // Get the file ready for appends
+            case Opcode::MemoryMap:
+                fs.showMemoryMap(session.messages());  // Display memory map of file system
+                break;
+            case Opcode::Dedup:
+                fs.showDedupStats(session.messages());  // Report memory and disk space saved by shared chunks
+                break;
+            case Opcode::Stats:
+                fs.showStats(session.messages());  // Report latencies, lock waits, bytes moved and tree size
+                break;
+            case Opcode::Find:
+                return fs.findFiles(session, command.name);  // Search the tree below the current directory
+            case Opcode::Du:
+                return fs.diskUsage(session, command.name);  // Total sizes per directory
+            case Opcode::Grep:
+                return fs.grepFiles(session, command.text, command.name);  // Search file contents below a directory
+            case Opcode::Exit:
+                fs.saveInBackground("dil.dat");  // Save file system state without waiting for the disk
+                session.messages() << "File system saving in the background. Exiting...\n";
+                break;
+            case Opcode::Sync:
+                if (!fs.sync("dil.dat")) {  // Wait for the journal or a full save to reach the disk
+                    session.messages() << "Error: Failed to save the file system.\n";
+                    return false;
+                }
+                session.messages() << "File system synced.\n";
+                break;
+            case Opcode::Begin:
+                if (batching) {
+                    session.messages() << "Error: A transaction is already open.\n";
+                    return false;
+                }
+                batching = true;
+                batch.clear();
+                session.messages() << "Transaction started.\n";
+                break;
+            case Opcode::Commit:
+                if (!batching) {
+                    session.messages() << "Error: No transaction to commit.\n";
+                    return false;
+                }
+                return commitBatch();
+            case Opcode::Abort:
+                if (!batching) {
+                    session.messages() << "Error: No transaction to abort.\n";
+                    return false;
+                }
+                batching = false;
+                batch.clear();
+                session.messages() << "Transaction aborted.\n";
+                break;
+            case Opcode::Unknown:
+                suggestCommand(command.name, session.messages());  // Handle invalid commands by suggesting similar commands
+                return false;
+        }
+        return true;
+    }
 
+private:
+    // Queue the command if a transaction is open, otherwise run it and collect its result
+    string dispatch(Command& command, const string& cmdLine) {
         output.str("");  // Clear output buffer
 
-        if (cmd == "create") {
-            string fname;
-            ss >> fname;
-            fs.createFile(fname);  // Create new file
-        } else if (cmd == "delete") {
-            string fname;
-            ss >> fname;
-            fs.deleteFile(fname);  // Delete specified file
-        } else if (cmd == "help") {
-            string specificCmd;
-            getline(cin, specificCmd);  // Read the rest of the line after "help"
-        
-            // Trim leading spaces (if any)
-            if (!specificCmd.empty() && specificCmd[0] == ' ') {
-                specificCmd = specificCmd.substr(1);
-            }
-        
-            if (specificCmd.empty()) {
-                fs.showHelp();  // Show general help if no specific command is provided
-            } else {
-                fs.showSpecificHelp(specificCmd);  // Show help for the specific command
+        if (batching) {
+            switch (command.op) {
+                case Opcode::Begin:
+                case Opcode::Commit:
+                case Opcode::Abort:
+                    break;  // Handled by execute
+                case Opcode::Exit:
+                case Opcode::MemoryMap:  // Walks the whole tree, which a transaction does not lock
+                case Opcode::Dedup:
+                case Opcode::Stats:
+                case Opcode::Find:
+                case Opcode::Du:
+                case Opcode::Grep:
+                case Opcode::Sync:
+                case Opcode::Reserve:  // A hint about the file, not a change to undo
+                    session.messages() << "Error: '" << COMMAND_TABLE[size_t(command.op)].name << "' cannot be used inside a transaction.\n";
+                    return "Command rejected: " + cmdLine + "\n";
+                default:
+                    batch.push_back(move(command));
+                    return "Command queued: " + cmdLine + "\n";
             }
-        } else if (cmd == "mkdir") {
-            string dname;
-            ss >> dname;  
-            fs.mkdir(dname);  // Create new directory
-        } else if (cmd == "chdir") {
-            string dname;
-            ss >> dname;  
-            fs.chDir(dname);  // Change current directory
-        } else if (cmd == "ls") {
-            fs.listFiles();  // Lists all files and directories in the current directory
-        } else if (cmd == "move") {
-            string src, tgt;
-            ss >> src >> tgt;  // Read source and target paths
-            fs.moveFile(src, tgt);  // Move file from source to target
-        } else if (cmd == "open") {
-            string fname;
-            ss >> fname;           
-            fs.openFile(fname);  // Open specified file
-        } else if (cmd == "close") {
-            string fname;
-            ss >> fname;            
-            fs.closeFile(fname);  // Close specified file
-        } else if (cmd == "write") {
-            string fname, text;
-            ss >> fname;  
-            getline(cin, text);  // Read text to write (allows spaces)
-            if (text[0] == ' ') text = text.substr(1);  // Remove leading space if present
-            File* file = fs.openFile(fname);  // Get file pointer
-            if (file) file->write_to_file(text);  // Write text if file exists
-        } else if (cmd == "write_at") {
-            string fname;
-            int pos;
-            string text;
-            ss >> fname >> pos;  // Read filename and position
-            getline(cin, text);  // Read text to write
-            if (text[0] == ' ') text = text.substr(1);
-            File* file = fs.openFile(fname);  // Get file pointer
-            if (file) file->write_at(pos, text);  // Write at position if file exists
-        } else if (cmd == "read") {
-            string fname;
-            ss >> fname;  // Read filename
-            File* file = fs.openFile(fname);  // Get file pointer
-            if (file) cout << file->read_from_file() << endl;  // Output file contents
-        } else if (cmd == "read_from") {
-            string fname;
-            int start, size;
-            ss >> fname >> start >> size;  // Read filename, start position, and size
-            File* file = fs.openFile(fname);  // Get file pointer
-            if (file) cout << file->read_from(start, size) << endl;  // Output portion of file
-        } else if (cmd == "move_within") {
-            string fname;
-            int start, size, target;
-            ss >> fname >> start >> size >> target;  // Read filename and positions
-            File* file = fs.openFile(fname);  // Get file pointer
-            if (file) file->move_within_file(start, size, target);  // Move data within file
-        } else if (cmd == "truncate") {
-            string fname;
-            int size;
-            ss >> fname >> size;  // Read filename and new size
-            File* file = fs.openFile(fname);  // Get file pointer
-            if (file) file->truncate_file(size);  // Truncate file to specified size
-        } else if (cmd == "memory_map") {
-            fs.showMemoryMap();  // Display memory map of file system
-        } else if (cmd == "exit") {
-            fs.saveToFile("dil.dat");  // Save file system state
-            cout << "File system saved. Exiting...\n";
+        }
+
+        execute(command);
+        if (command.op == Opcode::Exit) {
             return output.str();  // Return immediately for exit command
-        } else {
-            suggestCommand(cmd);  // Handle invalid commands by suggesting similar commands
         }
-        
+        fs.commit(session);  // Wait for the journal if this command changed anything
 
         string result = output.str();
         if (result.empty()) {
@@ -118,4 +234,100 @@ public:
         }
         return result;
     }
+
+    // Run the queued commands under one set of locks. The first command that fails
+    // undoes everything the batch did.
+    bool commitBatch() {
+        batching = false;
+        vector<Command> commands;
+        commands.swap(batch);
+        size_t failed = 0;
+        bool committed = fs.transact(session, [&] { return planBatch(commands); }, [&] {
+            for (size_t i = 0; i < commands.size(); i++) {
+                if (!execute(commands[i])) {
+                    failed = i;
+                    return false;
+                }
+            }
+            return true;
+        });
+        if (committed) {
+            session.messages() << "Transaction committed (" << commands.size() << " commands).\n";
+        } else {
+            session.messages() << "Transaction rolled back: command " << failed + 1 << " ("
+                 << COMMAND_TABLE[size_t(commands[failed].op)].name << ") failed.\n";
+        }
+        return committed;
+    }
+
+    // Existing directories the commands will run in, following the paths they name and
+    // their chdir and mkdir commands from the session's directory. Directories the batch
+    // creates itself are left out: nobody else can reach them while their parent is
+    // locked. When the transaction's locks are already held, planning stops at the first
+    // directory they do not cover or that is busy, which is all FileSystem::transact
+    // needs to start over.
+    vector<Directory*> planBatch(const vector<Command>& commands) {
+        vector<string> cwd = fs.currentPath(session); // Where the batch stands, as its chdir commands move it
+        set<vector<string>> created; // Paths of directories the batch creates
+        vector<Directory*> dirs = {session.currentDir};
+        bool stop = false;
+
+        // Add the existing directory at path to dirs and return it
+        auto visit = [&](const vector<string>& path) -> Directory* {
+            if (created.count(path)) return nullptr;
+            bool busy = false;
+            Directory* dir = fs.lookupDir(session, path, &busy);
+            if (busy) {
+                dirs.push_back(nullptr);
+                stop = true;
+                return nullptr;
+            }
+            if (!dir) return nullptr;  // The command will fail
+            if (find(dirs.begin(), dirs.end(), dir) == dirs.end()) dirs.push_back(dir);
+            if (session.transaction && !session.transaction->holds(dir)) stop = true;  // Not locked, so the plan has changed
+            return dir;
+        };
+
+        string leaf;
+        for (size_t i = 0; i < commands.size() && !stop; i++) {
+            const Command& command = commands[i];
+            switch (command.op) {
+                case Opcode::Mkdir: {
+                    vector<string> path = FileSystem::parentPath(cwd, command.name, leaf);
+                    if (leaf.empty() || leaf == "root") break;  // mkdir will refuse these
+                    bool parentCreated = created.count(path) > 0;
+                    Directory* parent = visit(path);
+                    if (stop || (!parent && !parentCreated)) break;
+                    if (parent && fs.subdirectory(session, parent, leaf)) break;  // Already exists
+                    path.push_back(leaf);
+                    created.insert(move(path));
+                    break;
+                }
+                case Opcode::Chdir: {
+                    vector<string> path = FileSystem::splitPath(cwd, command.name);
+                    if (created.count(path) || visit(path)) cwd = move(path);  // Otherwise chdir fails and stays put
+                    break;
+                }
+                case Opcode::Move:
+                    visit(FileSystem::parentPath(cwd, command.target, leaf));
+                    visit(FileSystem::parentPath(cwd, command.name, leaf));
+                    break;
+                case Opcode::Create:
+                case Opcode::Delete:
+                case Opcode::Open:
+                case Opcode::Close:
+                case Opcode::Write:
+                case Opcode::WriteAt:
+                case Opcode::Read:
+                case Opcode::ReadFrom:
+                case Opcode::MoveWithin:
+                case Opcode::Truncate:
+                    visit(FileSystem::parentPath(cwd, command.name, leaf));
+                    break;
+                default:
+                    break;  // Works in no directory, or in the one it stands in
+            }
+        }
+        return dirs;
+    }
 };
@@ -2,65 +2,66 @@
 #include <iostream>
 #include <vector>
 #include <algorithm>
+#include <climits>
+#include <cstring>
+#include "Command.h"
 using namespace std;
 
 
-// Function to calculate Levenshtein distance
+// Levenshtein distance with a single DP row over the shorter string. The row lives
+// on the stack for strings up to LEVENSHTEIN_STACK_ROW characters, which covers
+// every command name, so suggestions never allocate.
+const size_t LEVENSHTEIN_STACK_ROW = 64;
+
 int levenshtein(const string &s1, const string &s2) {
-    int len1 = s1.length(), len2 = s2.length();
-    vector<vector<int>> dist(len1 + 1, vector<int>(len2 + 1));
+    const string& longer = s1.length() >= s2.length() ? s1 : s2;
+    const string& shorter = s1.length() >= s2.length() ? s2 : s1;
+    size_t cols = shorter.length();
 
-    for (int i = 0; i <= len1; i++) dist[i][0] = i;
-    for (int j = 0; j <= len2; j++) dist[0][j] = j;
+    int stackRow[LEVENSHTEIN_STACK_ROW + 1];
+    vector<int> heapRow;
+    int* row = stackRow;
+    if (cols > LEVENSHTEIN_STACK_ROW) {
+        heapRow.resize(cols + 1);
+        row = heapRow.data();
+    }
 
-    for (int i = 1; i <= len1; i++) {
-        for (int j = 1; j <= len2; j++) {
-            int cost = (s1[i - 1] == s2[j - 1]) ? 0 : 1;
-            dist[i][j] = min({dist[i - 1][j] + 1, dist[i][j - 1] + 1, dist[i - 1][j - 1] + cost});
+    for (size_t j = 0; j <= cols; j++) row[j] = int(j);
+    for (size_t i = 1; i <= longer.length(); i++) {
+        int diagonal = row[0]; // dist[i - 1][j - 1]
+        row[0] = int(i);
+        for (size_t j = 1; j <= cols; j++) {
+            int above = row[j]; // dist[i - 1][j]
+            int cost = (longer[i - 1] == shorter[j - 1]) ? 0 : 1;
+            row[j] = min({above + 1, row[j - 1] + 1, diagonal + cost});
+            diagonal = above;
         }
     }
 
-    return dist[len1][len2];
+    return row[cols];
 }
 
-vector<string> commands = {
-    "create <filename>",
-    "delete <filename>",
-    "mkdir <dirname>",
-    "chdir <dirname>",
-    "ls",
-    "move <source> <target>",
-    "open <filename>",
-    "close <filename>",
-    "write <filename> <text>",
-    "write_at <filename> <pos> <text>",
-    "read <filename>",
-    "read_from <filename> <start> <size>",
-    "move_within <filename> <start> <size> <target>",
-    "truncate <filename> <size>",
-    "memory_map",
-    "help",
-    "exit"
-};
-
-void suggestCommand(const string& userCommand) {
+void suggestCommand(const string& userCommand, ostream& out = cout) {
     int minDist = INT_MAX;
-    string closestCommand;
+    const CommandInfo* closestCommand = nullptr;
 
-    // Check each command and calculate Levenshtein distance
-    for (const string& command : commands) {
-        int dist = levenshtein(userCommand, command);
+    // Compare against each command name; longer words cannot be within the threshold
+    for (const CommandInfo& command : COMMAND_TABLE) {
+        size_t nameLength = strlen(command.name);
+        size_t gap = max(nameLength, userCommand.length()) - min(nameLength, userCommand.length());
+        if (int(gap) >= minDist || gap > 3) continue;
+        int dist = levenshtein(userCommand, command.name);
         if (dist < minDist) {
             minDist = dist;
-            closestCommand = command;
+            closestCommand = &command;
         }
     }
 
     // Suggest the closest command
     if (minDist > 3) {  // Only suggest if the command is reasonably close (optional threshold)
-        cout << "Unknown command. No similar command found.\n";
+        out << "Unknown command. No similar command found.\n";
     } else {
-        cout << "Did you mean: '" << closestCommand << "'?\n";
+        out << "Did you mean: '" << closestCommand->usage << "'?\n";
     }
 }
 
@@ -82,5 +83,15 @@ void menu() {
          << "14. memory_map\n"
          << "15. help\n"
          << "16. ls\n"
-         << "17. exit\n";
+         << "17. exit\n"
+         << "18. begin\n"
+         << "19. commit\n"
+         << "20. abort\n"
+         << "21. dedup\n"
+         << "22. stats\n"
+         << "23. find <pattern>\n"
+         << "24. du [dirname]\n"
+         << "25. grep <pattern> [dirname]\n"
+         << "26. sync\n"
+         << "27. reserve <filename> <size>\n";
 }
\ No newline at end of file
@@ -0,0 +1,105 @@
+#pragma once
+
+#include <string>
+#include <cstdint>
+#include <cstring>
+using namespace std;
+
+
+// Byte-oriented LZ77 block codec in the style of LZ4, fast enough to run on every
+// block a write changes. A compressed block is a series of sequences:
+//
+//   token      u8: literal count in the high nibble, match length - 4 in the low one
+//              (15 means more: add following bytes until one is below 255)
+//   literals   copied as they are
+//   offset     u16, how far back the match starts
+//
+// The last sequence has literals only and ends the block. Matches may overlap the
+// bytes they produce, so runs compress to a few bytes.
+const size_t LZ_MIN_MATCH = 4;
+const size_t LZ_HASH_BITS = 12;
+
+inline uint32_t lzRead32(const char* p) {
+    uint32_t value;
+    memcpy(&value, p, 4);
+    return value;
+}
+
+inline void lzLength(string& out, size_t length) {
+    for (; length >= 255; length -= 255) out += char(255);
+    out += char(length);
+}
+
+inline void lzSequence(string& out, const char* literals, size_t literalCount, size_t offset, size_t matchLength) {
+    size_t extra = matchLength ? matchLength - LZ_MIN_MATCH : 0;
+    out += char((min<size_t>(literalCount, 15) << 4) | min<size_t>(extra, 15));
+    if (literalCount >= 15) lzLength(out, literalCount - 15);
+    out.append(literals, literalCount);
+    if (!matchLength) return;
+    out += char(offset & 0xff);
+    out += char(offset >> 8);
+    if (extra >= 15) lzLength(out, extra - 15);
+}
+
+// Compress len bytes at src into out. Returns false, leaving out unspecified, if the
+// result would not be smaller than the input.
+inline bool lzCompress(const char* src, size_t len, string& out) {
+    out.clear();
+    out.reserve(len);
+    uint32_t table[1 << LZ_HASH_BITS]; // Last position each 4-byte hash was seen at, plus one
+    memset(table, 0, sizeof(table));
+    size_t anchor = 0, pos = 0;
+    while (len >= LZ_MIN_MATCH && pos + LZ_MIN_MATCH <= len) {
+        uint32_t word = lzRead32(src + pos);
+        uint32_t& slot = table[(word * 2654435761u) >> (32 - LZ_HASH_BITS)];
+        size_t candidate = slot;
+        slot = uint32_t(pos + 1);
+        if (candidate == 0 || pos - (candidate - 1) > 0xffff || lzRead32(src + candidate - 1) != word) {
+            pos++;
+            continue;
+        }
+        size_t from = candidate - 1, length = LZ_MIN_MATCH;
+        while (pos + length < len && src[from + length] == src[pos + length]) length++;
+        lzSequence(out, src + anchor, pos - anchor, pos - from, length);
+        pos += length;
+        anchor = pos;
+        if (out.size() >= len) return false;
+    }
+    lzSequence(out, src + anchor, len - anchor, 0, 0);
+    return out.size() < len;
+}
+
+// Decompress a block made by lzCompress into exactly rawLength bytes at dst. Returns
+// false if the block is malformed or does not decode to rawLength bytes.
+inline bool lzDecompress(const char* src, size_t len, char* dst, size_t rawLength) {
+    const unsigned char* in = reinterpret_cast<const unsigned char*>(src);
+    size_t ip = 0, op = 0;
+    auto length = [&](size_t& value) {
+        unsigned char byte;
+        do {
+            if (ip >= len) return false;
+            byte = in[ip++];
+            value += byte;
+        } while (byte == 255);
+        return true;
+    };
+    while (ip < len) {
+        unsigned char token = in[ip++];
+        size_t literalCount = token >> 4;
+        if (literalCount == 15 && !length(literalCount)) return false;
+        if (literalCount > len - ip || literalCount > rawLength - op) return false;
+        memcpy(dst + op, in + ip, literalCount);
+        ip += literalCount;
+        op += literalCount;
+        if (ip == len) break; // The last sequence has no match
+        if (len - ip < 2) return false;
+        size_t offset = in[ip] | (size_t(in[ip + 1]) << 8);
+        ip += 2;
+        size_t matchLength = token & 15;
+        if (matchLength == 15 && !length(matchLength)) return false;
+        matchLength += LZ_MIN_MATCH;
+        if (offset == 0 || offset > op || matchLength > rawLength - op) return false;
+        for (size_t i = 0; i < matchLength; i++, op++) dst[op] = dst[op - offset]; // May overlap
+    }
+    return op == rawLength;
+}
@@ -2,16 +2,82 @@
 
 #include <iostream>
 #include <map>
+#include <unordered_map>
+#include <shared_mutex>
+#include <atomic>
+#include <cstdint>
 #include "File.h"
+#include "NodePool.h"
 using namespace std;
 
 
+// Allocator for the nodes of the child maps. Nodes come from slab pools (NodePool.h)
+// unless the build defines FS_NO_NODE_POOL, which is kept for comparison.
+#ifdef FS_NO_NODE_POOL
+template <typename T> using NodeAllocator = allocator<pair<const string, T>>;
+#else
+template <typename T> using NodeAllocator = PoolAllocator<pair<const string, T>>;
+#endif
+
+// Container for a directory's children. Ordered by default, so listings and saved
+// images come out sorted by name; build with -DFS_HASHED_CHILDREN for hash maps,
+// which make lookups in very wide directories O(1) at the cost of unordered listings.
+// Both keep element addresses stable, which FileRef and Session rely on.
+#ifdef FS_HASHED_CHILDREN
+template <typename T> using ChildMap = unordered_map<string, T, hash<string>, equal_to<string>, NodeAllocator<T>>;
+#else
+template <typename T> using ChildMap = map<string, T, less<string>, NodeAllocator<T>>;
+#endif
+
 class Directory {
     public:
-        string name; // Name of the directory
-        map<string, File> files; // Map of files in the directory
-        map<string, Directory> subdirectories; // Map of subdirectories
+        ChildMap<File> files; // Map of files in the directory
+        ChildMap<Directory> subdirectories; // Map of subdirectories
         Directory* parent; // Pointer to the parent directory
+        mutable shared_mutex lock; // Guards files and subdirectories; shared for lookups, exclusive for changes
+
+        // Where this directory's record sits in the last saved image, so a save can copy
+        // an unchanged subtree instead of encoding it again. The offset is relative to the
+        // start of the parent's record (for root, to the start of the image), which keeps
+        // it valid when a whole subtree is copied to a new position.
+        uint64_t imageOffset;
+        uint64_t imageLength; // 0 if the directory is not in the last image
+        atomic<bool> dirty; // Set when this subtree differs from its record in the last image
     
-        Directory(string name = "", Directory* parent = nullptr) : name(name), parent(parent) {} // Constructor with default name as "" and parent as nullptr
+        Directory(Directory* parent = nullptr) : parent(parent), imageOffset(0), imageLength(0), dirty(true), key(nullptr) {} // Constructor with parent as nullptr for the root
+        Directory(const Directory&) = delete; // Directories own a lock, so they live in place inside their parent
+        Directory& operator=(const Directory&) = delete;
+
+        // Name of the directory: the key it is stored under in its parent, "root" for the root
+        const string& name() const { return key ? *key : ROOT_NAME; }
+
+        // Add a file called name and return it, or nullptr if there already is one. Hinted
+        // at the end, so names arriving in order (as when loading an image) insert in O(1).
+        // Call with the directory locked exclusively.
+        File* addFile(const string& name) {
+            size_t count = files.size();
+            auto it = files.try_emplace(files.end(), name);
+            if (files.size() == count) return nullptr;
+            it->second.key = &it->first;
+            return &it->second;
+        }
+
+        // Add a subdirectory called name and return it, or nullptr if there already is one
+        Directory* addSubdirectory(const string& name) {
+            size_t count = subdirectories.size();
+            auto it = subdirectories.try_emplace(subdirectories.end(), name, this);
+            if (subdirectories.size() == count) return nullptr;
+            it->second.key = &it->first;
+            return &it->second;
+        }
+
+        // Flag this directory and its ancestors for re-encoding on the next save. Call
+        // after changing the directory or the content of one of its files.
+        void markDirty() {
+            for (Directory* dir = this; dir && !dir->dirty.exchange(true); dir = dir->parent) {}
+        }
+
+    private:
+        inline static const string ROOT_NAME = "root";
+        const string* key;
 };
\ No newline at end of file
@@ -0,0 +1,161 @@
+#pragma once
+
+#include <vector>
+#include <algorithm>
+#include <mutex>
+#include <atomic>
+#include <thread>
+#include <cstdint>
+using namespace std;
+
+
+// Epoch-based reclamation, for data that readers use without taking a lock. A
+// reader holds an EpochGuard while it uses such data. A writer that unlinks an object
+// retires it instead of freeing it, and it is freed once every reader that could
+// still see it has left its guard. Entering and leaving a guard only write to the
+// reader's own slot, so readers sharing an object never write to a shared cache line.
+//
+// retire() takes a ticket from the global epoch counter, and a guard records the
+// counter when it is entered. An object retired with ticket r is safe to free once
+// every active guard records more than r: such a guard read the counter after the
+// object was unlinked, so it cannot have found it.
+class Epoch {
+    public:
+        using Deleter = void (*)(const void*);
+
+        // Free object with deleter once no guard can still be using it
+        static void retire(const void* object, Deleter deleter) {
+            Slot& slot = local();
+            uint64_t ticket = instance().epoch.fetch_add(1);
+            slot.limbo.push_back({object, deleter, ticket});
+            if (slot.limbo.size() >= RECLAIM_BATCH) reclaim(slot);
+        }
+
+        // Free everything the calling thread and threads that have exited retired, waiting
+        // for guards that may still be using some of it. Call when the data's owner goes
+        // away, with no guard held and no other thread retiring any more of its objects.
+        static void drain() {
+            Slot& slot = local();
+            Registry& registry = instance();
+            while (true) {
+                reclaim(slot);
+                {
+                    lock_guard<mutex> guard(registry.lock);
+                    if (slot.limbo.empty() && registry.orphans.empty()) return;
+                }
+                this_thread::yield();
+            }
+        }
+
+    private:
+        friend class EpochGuard;
+
+        static const size_t RECLAIM_BATCH = 64; // Retired objects a thread collects before trying to free them
+
+        struct Retired {
+            const void* object;
+            Deleter deleter;
+            uint64_t ticket;
+        };
+
+        struct Slot {
+            atomic<uint64_t> active; // Counter value the thread's guards entered at, 0 outside them
+            size_t depth; // Nested guards on the thread
+            vector<Retired> limbo; // Retired by the thread, not freed yet
+
+            Slot() : active(0), depth(0) {}
+        };
+
+        struct Registry {
+            atomic<uint64_t> epoch;
+            mutex lock;
+            vector<Slot*> slots; // One per live thread that has used a guard or retired anything
+            vector<Retired> orphans; // Left behind by threads that have exited
+
+            Registry() : epoch(1) {}
+        };
+
+        // Registers the calling thread's slot on first use and hands its limbo on at thread exit
+        struct Owner {
+            Slot* slot;
+
+            Owner() : slot(new Slot()) {
+                Registry& registry = instance();
+                lock_guard<mutex> guard(registry.lock);
+                registry.slots.push_back(slot);
+            }
+
+            ~Owner() {
+                reclaim(*slot);
+                Registry& registry = instance();
+                lock_guard<mutex> guard(registry.lock);
+                registry.orphans.insert(registry.orphans.end(), slot->limbo.begin(), slot->limbo.end());
+                registry.slots.erase(find(registry.slots.begin(), registry.slots.end(), slot));
+                delete slot;
+            }
+        };
+
+        // Outlives every thread's Owner, including the main thread's
+        static Registry& instance() {
+            static Registry* registry = new Registry();
+            return *registry;
+        }
+
+        static Slot& local() {
+            static thread_local Owner owner;
+            return *owner.slot;
+        }
+
+        static void enter() {
+            Slot& slot = local();
+            if (slot.depth++ == 0) slot.active.store(instance().epoch.load());
+        }
+
+        static void leave() {
+            Slot& slot = local();
+            if (--slot.depth == 0) slot.active.store(0, memory_order_release);
+        }
+
+        // Free whatever slot and exited threads retired that no guard can still be using
+        static void reclaim(Slot& slot) {
+            Registry& registry = instance();
+            vector<Retired> ready;
+            {
+                lock_guard<mutex> guard(registry.lock);
+                uint64_t oldest = UINT64_MAX; // Lowest counter value an active guard entered at
+                for (Slot* other : registry.slots) {
+                    uint64_t active = other->active.load();
+                    if (active != 0) oldest = min(oldest, active);
+                }
+                auto safe = [oldest](const Retired& retired) { return retired.ticket < oldest; };
+                for (vector<Retired>* list : {&slot.limbo, &registry.orphans}) {
+                    auto keep = stable_partition(list->begin(), list->end(), [&](const Retired& retired) { return !safe(retired); });
+                    ready.insert(ready.end(), keep, list->end());
+                    list->erase(keep, list->end());
+                }
+            }
+            for (const Retired& retired : ready) retired.deleter(retired.object);
+        }
+};
+
+// Keeps objects the calling thread reads from being freed by Epoch::retire until it
+// goes out of scope. Guards nest, and must be released on the thread that took them.
+class EpochGuard {
+    public:
+        EpochGuard() : held(true) { Epoch::enter(); }
+        EpochGuard(EpochGuard&& other) : held(other.held) { other.held = false; }
+        EpochGuard& operator=(EpochGuard&& other) {
+            if (this != &other) {
+                if (held) Epoch::leave();
+                held = other.held;
+                other.held = false;
+            }
+            return *this;
+        }
+        ~EpochGuard() {
+            if (held) Epoch::leave();
+        }
+
+    private:
+        bool held;
+};
@@ -0,0 +1,253 @@
+#pragma once
+
+#include <iostream>
+#include <deque>
+#include <vector>
+#include <memory>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+using namespace std;
+
+
+// Fixed pool of worker threads with one task queue per worker. A task submitted
+// from a worker goes to that worker's own queue; tasks from other threads are
+// dealt round-robin. A worker whose queue runs dry steals from the back of the
+// others' queues, so work spreads over every core no matter how it arrived.
+// Workers take their own tasks from the front, in submission order, which keeps
+// the interleaving of Strands on one worker fair.
+class Executor {
+    public:
+        explicit Executor(size_t workerCount) : queued(0), unfinished(0), nextQueue(0), stopping(false) {
+            if (workerCount == 0) workerCount = 1;
+            for (size_t i = 0; i < workerCount; i++) queues.emplace_back(new Queue());
+            for (size_t i = 0; i < workerCount; i++) workers.emplace_back(&Executor::workerLoop, this, i);
+        }
+
+        // Finishes every queued task, then stops the workers
+        ~Executor() {
+            wait();
+            {
+                lock_guard<mutex> guard(sleepLock);
+                stopping = true;
+            }
+            wake.notify_all();
+            for (auto& worker : workers) worker.join();
+        }
+
+        Executor(const Executor&) = delete;
+        Executor& operator=(const Executor&) = delete;
+
+        size_t workerCount() const { return workers.size(); }
+
+        void submit(function<void()> task) {
+            size_t target = currentExecutor == this ? currentWorker : nextQueue++ % queues.size();
+            unfinished++;
+            {
+                lock_guard<mutex> guard(queues[target]->lock);
+                queues[target]->tasks.push_back(move(task));
+            }
+            {
+                lock_guard<mutex> guard(sleepLock); // Ordered with the idle check in workerLoop
+                queued++;
+            }
+            wake.notify_one();
+        }
+
+        // Block until every submitted task, including tasks those tasks submit, has run.
+        // Must not be called from a worker.
+        void wait() {
+            unique_lock<mutex> guard(sleepLock);
+            idle.wait(guard, [&] { return unfinished == 0; });
+        }
+
+    private:
+        struct Queue {
+            mutex lock;
+            deque<function<void()>> tasks;
+        };
+
+        vector<unique_ptr<Queue>> queues; // One per worker
+        vector<thread> workers;
+        mutex sleepLock; // Guards sleeping and waking; queued only grows under it
+        condition_variable wake; // Signals idle workers that queued grew
+        condition_variable idle; // Signals wait() that unfinished reached 0
+        atomic<size_t> queued; // Tasks sitting in queues
+        atomic<size_t> unfinished; // Tasks submitted but not yet finished
+        atomic<size_t> nextQueue; // Round-robin position for outside submissions
+        bool stopping;
+
+        static thread_local Executor* currentExecutor; // Pool the calling thread works for
+        static thread_local size_t currentWorker; // Its queue index in that pool
+
+        bool take(size_t index, function<void()>& task, bool fromFront) {
+            Queue& queue = *queues[index];
+            lock_guard<mutex> guard(queue.lock);
+            if (queue.tasks.empty()) return false;
+            if (fromFront) {
+                task = move(queue.tasks.front());
+                queue.tasks.pop_front();
+            } else {
+                task = move(queue.tasks.back());
+                queue.tasks.pop_back();
+            }
+            queued--;
+            return true;
+        }
+
+        // Own queue first, then the other workers' queues starting with the next one
+        bool find(size_t index, function<void()>& task) {
+            if (take(index, task, true)) return true;
+            for (size_t i = 1; i < queues.size(); i++) {
+                if (take((index + i) % queues.size(), task, false)) return true;
+            }
+            return false;
+        }
+
+        void workerLoop(size_t index) {
+            currentExecutor = this;
+            currentWorker = index;
+            function<void()> task;
+            while (true) {
+                if (find(index, task)) {
+                    task();
+                    task = nullptr; // Release what the task captured before reporting it done
+                    if (--unfinished == 0) {
+                        lock_guard<mutex> guard(sleepLock);
+                        idle.notify_all();
+                    }
+                    continue;
+                }
+                unique_lock<mutex> guard(sleepLock);
+                wake.wait(guard, [&] { return stopping || queued > 0; });
+                if (stopping && queued == 0) return;
+            }
+        }
+};
+
+inline thread_local Executor* Executor::currentExecutor = nullptr;
+inline thread_local size_t Executor::currentWorker = 0;
+
+// Runs the tasks posted to it one at a time, in the order they were posted, on
+// whichever worker of an Executor is free. At most one task of a Strand is queued
+// at a time, so different Strands interleave freely while each one stays ordered.
+// A Strand must outlive its tasks; wait on the Executor before destroying it.
+class Strand {
+    public:
+        Strand(Executor& executor) : executor(executor), scheduled(false) {}
+
+        Strand(const Strand&) = delete;
+        Strand& operator=(const Strand&) = delete;
+
+        void post(function<void()> task) {
+            {
+                lock_guard<mutex> guard(lock);
+                tasks.push_back(move(task));
+                if (scheduled) return; // runNext picks it up
+                scheduled = true;
+            }
+            executor.submit([this] { runNext(); });
+        }
+
+    private:
+        Executor& executor;
+        mutex lock; // Guards tasks and scheduled
+        deque<function<void()>> tasks;
+        bool scheduled; // True while a runNext for this strand is queued or running
+
+        // Run one task, then requeue behind other strands' work if more are waiting
+        void runNext() {
+            function<void()> task;
+            {
+                lock_guard<mutex> guard(lock);
+                task = move(tasks.front());
+                tasks.pop_front();
+            }
+            task();
+            {
+                lock_guard<mutex> guard(lock);
+                if (tasks.empty()) {
+                    scheduled = false;
+                    return;
+                }
+            }
+            executor.submit([this] { runNext(); });
+        }
+};
+
+// Fork-join over an Executor. Tasks run on idle workers and on the thread that
+// waits for them; the waiting thread only ever runs the group's own tasks, never
+// unrelated work from the pool, so it may call wait() from inside a worker task.
+// Tasks may add more tasks to the group. Without an Executor, run() runs the task
+// on the spot.
+class TaskGroup {
+    public:
+        explicit TaskGroup(Executor* executor) : executor(executor), state(make_shared<State>()) {}
+        ~TaskGroup() { wait(); }
+
+        TaskGroup(const TaskGroup&) = delete;
+        TaskGroup& operator=(const TaskGroup&) = delete;
+
+        void run(function<void()> task) {
+            if (!executor || executor->workerCount() < 2) {
+                task();
+                return;
+            }
+            bool recruit;
+            {
+                lock_guard<mutex> guard(state->lock);
+                state->tasks.push_back(move(task));
+                state->pending++;
+                // Workers that are all busy elsewhere leave the tasks to the waiting thread
+                recruit = state->helpers < executor->workerCount();
+                if (recruit) state->helpers++;
+            }
+            state->changed.notify_one();
+            if (recruit) executor->submit([state = state] { state->help(); });
+        }
+
+        // Run queued tasks until every task of the group has finished
+        void wait() {
+            unique_lock<mutex> guard(state->lock);
+            while (state->pending > 0) {
+                if (state->tasks.empty()) {
+                    state->changed.wait(guard); // Tasks running elsewhere may still add more
+                    continue;
+                }
+                state->runOne(guard);
+            }
+        }
+
+    private:
+        // Shared with the helpers, which can outlive the group when they start late
+        struct State {
+            mutex lock;
+            condition_variable changed; // A task was queued, or the last one finished
+            deque<function<void()>> tasks;
+            size_t pending = 0; // Queued or running
+            size_t helpers = 0; // Workers recruited and not yet out of tasks
+
+            // Run the newest task with lock held on entry and on return. Newest first
+            // keeps a recursive fork-join depth first, and its queue short.
+            void runOne(unique_lock<mutex>& guard) {
+                function<void()> task = move(tasks.back());
+                tasks.pop_back();
+                guard.unlock();
+                task();
+                task = nullptr;
+                guard.lock();
+                if (--pending == 0) changed.notify_all();
+            }
+
+            void help() {
+                unique_lock<mutex> guard(lock);
+                while (!tasks.empty()) runOne(guard);
+                helpers--;
+            }
+        };
+
+        Executor* executor;
+        shared_ptr<State> state;
+};
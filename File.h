@@ -2,71 +2,286 @@
 
 using namespace std; // Use standard namespace
 #include <iostream> // Include iostream for input/output operations
+#include <atomic>
+#include <shared_mutex>
+#include <mutex>
+#include <condition_variable>
+#include <vector>
+#include <memory>
+#include <string_view>
+#include "Rope.h"
+#include "MappedImage.h"
+#include "Epoch.h"
 
 
+// Check a read of size bytes from start against a content length bytes long, as
+// read_from does: out of range starts fail, sizes running past the end are cut with
+// a warning and negative sizes read to the end. Sets len to the bytes to read.
+inline bool readRange(size_t length, int start, int size, size_t& len, ostream& messages) {
+    // Check for invalid start position
+    if (start < 0 || size_t(start) >= length) {
+        messages << "Error: Start position out of bounds." << endl;
+        return false;
+    }
+
+    // If requested size goes beyond content, adjust it
+    len = size < 0 ? length - start : size_t(size); // Negative sizes read to the end, as substr does
+    if (size >= 0 && size_t(start) + len > length) {
+        messages << "Warning: Requested size exceeds file content. Truncating read." << endl;
+        len = length - start;
+    }
+    return true;
+}
+
+
+// A file's content at one point in time: blocks shared with the file (see Rope), or
+// a range of a loaded image the file has not copied yet
+struct FileVersion {
+    Rope content;
+    shared_ptr<const MappedImage> image; // Set while the content is still in the image
+    uint64_t imageOffset = 0;
+    uint64_t imageLength = 0;
+
+    size_t size() const { return image ? imageLength : content.size(); }
+
+    void writeTo(ostream& out) const {
+        if (image) out.write(image->data() + imageOffset, imageLength);
+        else content.writeTo(out);
+    }
+
+    // Call visit(string_view) for each piece of the content, as File::stream_file does.
+    // Needs no lock: the version shares the file's blocks but never sees its changes.
+    template <typename Visit>
+    void stream(Visit visit) const {
+        if (image) visit(string_view(image->data() + imageOffset, imageLength));
+        else content.read(0, content.size(), visit);
+    }
+
+    // Stream part of the content, checking the range like File::stream_from
+    template <typename Visit>
+    void stream_from(int start, int size, Visit visit, ostream& messages = cerr) const {
+        size_t len;
+        if (!readRange(this->size(), start, size, len, messages)) return;
+        if (image) visit(string_view(image->data() + imageOffset + start, len));
+        else content.read(start, len, visit);
+    }
+};
+
+// Appends waiting for one file's lock (see FileSystem::appendFile). The first
+// appender to find nobody applying takes every waiting append as one batch and
+// applies it, in arrival order, under a single hold of the file lock and as a single
+// journal frame; the others wait for theirs to be done.
+struct AppendQueue {
+    struct Request {
+        const string* text;
+        uint64_t journalSeq; // Frame the append went out in
+        bool done;
+    };
+
+    mutex lock; // Guards everything below
+    condition_variable applied; // Signals waiters that a batch is done
+    vector<Request*> pending; // Not picked up by a batch yet, in arrival order
+    bool applying = false; // An appender is applying a batch
+};
+
 class File {
     public:
-        string name; // Name of the file
-        string content; // Content of the file
-        bool is_open; // Flag to check if the file is open
+        Rope content; // Content of the file, stored in blocks so edits in the middle stay cheap
+        mutable shared_mutex lock; // Guards content; shared for reads, exclusive for writes
+        atomic<bool> is_open; // Flag to check if the file is open
     
-        File(string name = "") : name(name), is_open(false) {} // Constructor to initialize file
+        File() : is_open(false), pending(false), appending(false), key(nullptr), readable(nullptr), appends(nullptr), imageOffset(0), imageLength(0) {} // Constructor to initialize file
+        ~File() {
+            retire(readable.load()); // Readers may still be streaming it
+            delete appends.load();
+        }
+        File(const File&) = delete; // Files own a lock, so they live in place inside their directory
+        File& operator=(const File&) = delete;
+
+        // Name of the file: the key it is stored under in its directory, which a rename
+        // changes in place, so the name is only stored once
+        const string& name() const { return *key; }
+
+        // Leave the content in a loaded image; it is copied into memory on first use
+        void setLazyContent(shared_ptr<const MappedImage> source, uint64_t offset, uint64_t length) {
+            image = move(source);
+            imageOffset = offset;
+            imageLength = length;
+            pending = true;
+        }
+
+        // Copy lazily loaded content into memory. Safe to call under the shared lock:
+        // concurrent readers wait for the first one to finish.
+        void load() {
+            if (!pending.load(memory_order_acquire)) return;
+            call_once(loadOnce, [this] {
+                content.append(image->data() + imageOffset, imageLength);
+                pending.store(false, memory_order_release);
+            });
+        }
+
+        size_t size() const {
+            return pending.load(memory_order_acquire) ? imageLength : content.size();
+        }
+
+        // The content as it is now, in O(1). Call with the lock held; shared is enough.
+        FileVersion version() const {
+            FileVersion current;
+            if (pending.load(memory_order_acquire)) {
+                current.image = image;
+                current.imageOffset = imageOffset;
+                current.imageLength = imageLength;
+            } else {
+                current.content = content;
+            }
+            return current;
+        }
+
+        // Version readers share without locking the file (see FileSystem::viewFile), or
+        // nullptr if none was published since the last write. Use it inside an EpochGuard,
+        // which keeps it from being freed.
+        const FileVersion* published() const { return readable.load(); }
+
+        // Share the content as it is now with readers. Call with the lock held; shared is
+        // enough, since it keeps writers out.
+        const FileVersion* publish() {
+            const FileVersion* current = new FileVersion(version());
+            retire(readable.exchange(current));
+            return current;
+        }
+
+        // Withdraw the published version. Call with the lock held exclusively before the
+        // content changes; readers already streaming the old version keep it.
+        void unpublish() {
+            if (readable.load(memory_order_relaxed)) retire(readable.exchange(nullptr));
+        }
+
+        // Write the content to out without loading it into memory
+        void writeContent(ostream& out) const {
+            if (pending.load(memory_order_acquire)) out.write(image->data() + imageOffset, imageLength);
+            else content.writeTo(out);
+        }
     
         void write_to_file(const string& text) {
-            content += text; // Append text to the file content
+            load();
+            content.append(text.data(), text.size(), appending); // Append text to the file content
+        }
+
+        // Whether the file is in append mode: its last block is kept with room for a
+        // whole block and left unpacked, so appends fill it in place
+        bool appendOptimized() const { return appending; }
+
+        // Switch to append mode, for a file that mostly grows by appends. Call with the
+        // lock held exclusively.
+        void optimizeForAppends() {
+            load();
+            appending = true;
+            content.reserveLast();
+        }
+
+        // Queue for appends that find the lock busy; made on first use
+        AppendQueue& appendQueue() {
+            AppendQueue* queue = appends.load(memory_order_acquire);
+            if (queue) return *queue;
+            AppendQueue* created = new AppendQueue();
+            if (appends.compare_exchange_strong(queue, created, memory_order_acq_rel)) return *created;
+            delete created; // Another appender made one first
+            return *queue;
         }
     
-        void write_at(int pos, const string& text) {
-            if (pos >= 0 && pos <= content.size()) {
-                content.replace(pos, text.size(), text); // Replace as normal
-            } else if (pos > content.size()) {
-                content += string(pos - content.size(), ' '); // Pad with spaces
-                content += text; // Append text after padding
+        bool write_at(int pos, const string& text) {
+            load();
+            if (pos >= 0 && size_t(pos) <= content.size()) {
+                content.overwrite(pos, text); // Replace as normal, extending past the end if needed
+            } else if (pos >= 0) {
+                content.append(string(size_t(pos) - content.size(), ' ')); // Pad with spaces
+                content.append(text); // Append text after padding
+            } else {
+                return false; // Negative position, nothing written
             }
+            return true;
         }
         
     
         string read_from_file() {
-            return content; // Return the entire file content
+            string result;
+            result.reserve(size());
+            stream_file([&result](string_view piece) { result.append(piece.data(), piece.size()); });
+            return result; // Return the entire file content
         }
     
-        string read_from(int start, int size) {
-            // Check for invalid start position
-            if (start < 0 || start >= content.size()) {
-                cerr << "Error: Start position out of bounds." << endl;
-                return "";
-            }
-        
-            // If requested size goes beyond content, adjust it
-            if (start + size > content.size()) {
-                cerr << "Warning: Requested size exceeds file content. Truncating read." << endl;
-                size = content.size() - start;
-            }
-        
-            // Return the valid substring
-            return content.substr(start, size);
+        string read_from(int start, int size, ostream& messages = cerr) {
+            string result;
+            stream_from(start, size, [&result](string_view piece) { result.append(piece.data(), piece.size()); }, messages);
+            return result; // Return the valid substring
+        }
+
+        // Call visit(string_view) for each piece of the content, in order. Nothing is
+        // copied, and content still in the image is read from there without loading it.
+        // A view is only valid until visit returns. Call with the lock held; shared is enough.
+        template <typename Visit>
+        void stream_file(Visit visit) const {
+            visitContent(0, size(), visit);
+        }
+
+        // Stream part of the content like stream_file, checking the range like read_from
+        template <typename Visit>
+        void stream_from(int start, int size, Visit visit, ostream& messages = cerr) const {
+            size_t len;
+            if (readRange(this->size(), start, size, len, messages)) visitContent(start, len, visit);
         }
         
     
-        void move_within_file(int start, int size, int target) {
-            if (start >= 0 && start + size <= content.size() && target >= 0 && target <= content.size()) {
-                string movingText = content.substr(start, size); // Extract the text to move
-                content.erase(start, size); // Remove the text from the original position
-                content.insert(target, movingText); // Insert the text at the target position
-            } else if (start < 0 || start + size > content.size()) {
-                cerr << "Error: Start position or size out of bounds." << endl; // Handle out of bounds error
-            } else if (target < 0 || target > content.size()) {
-                cerr << "Error: Target position out of bounds." << endl; // Handle out of bounds error
+        bool move_within_file(int start, int size, int target, ostream& messages = cerr) {
+            load();
+            if (start >= 0 && size >= 0 && size_t(start) + size_t(size) <= content.size() && target >= 0 && size_t(target) <= content.size()) {
+                Rope movingText = content.extract(start, size); // Detach the blocks to move
+                content.splice(min<size_t>(target, content.size()), move(movingText)); // Relink them at the target position
+                return true;
+            } else if (start < 0 || size < 0 || size_t(start) + size_t(size) > content.size()) {
+                messages << "Error: Start position or size out of bounds." << endl; // Handle out of bounds error
+            } else {
+                messages << "Error: Target position out of bounds." << endl; // Handle out of bounds error
             }
+            return false;
         }
     
-        void truncate_file(int maxSize) {
-            if (maxSize >= 0 && maxSize < content.size()) {
-                content = content.substr(0, maxSize); // Truncate the file content to the specified size
+        bool truncate_file(int maxSize, ostream& messages = cerr) {
+            load();
+            if (maxSize >= 0 && size_t(maxSize) < content.size()) {
+                content.truncate(maxSize); // Truncate the file content to the specified size
+                return true;
             } else if (maxSize < 0) {
-                cerr << "Error: Size cannot be negative." << endl; // Handle negative size error
+                messages << "Error: Size cannot be negative." << endl; // Handle negative size error
             } else {
-                cerr << "Warning: Size exceeds current content. No truncation performed." << endl; // Handle size exceeding content
+                messages << "Warning: Size exceeds current content. No truncation performed." << endl; // Handle size exceeding content
+            }
+            return false;
+        }
+
+    private:
+        friend class Directory; // Binds key when it adds the file
+        atomic<bool> pending; // True until the content has been copied out of image
+        bool appending; // Append mode; guarded by lock
+        once_flag loadOnce;
+        const string* key;
+        atomic<const FileVersion*> readable; // Published for lock-free readers; retired through Epoch
+        atomic<AppendQueue*> appends; // Made by the first append that waited for the lock
+        shared_ptr<const MappedImage> image; // Image holding the content while it is still pending
+        uint64_t imageOffset; // Where the content starts in image
+        uint64_t imageLength; // Content length in bytes
+
+        static void retire(const FileVersion* version) {
+            if (version) Epoch::retire(version, [](const void* old) { delete static_cast<const FileVersion*>(old); });
+        }
+
+        template <typename Visit>
+        void visitContent(size_t start, size_t len, Visit& visit) const {
+            if (pending.load(memory_order_acquire)) {
+                // image stays set once loaded, so a reader loading the file meanwhile does no harm
+                if (start < imageLength) visit(string_view(image->data() + imageOffset + start, min<uint64_t>(len, imageLength - start)));
+                return;
             }
+            content.read(start, len, visit);
         }
     };
\ No newline at end of file
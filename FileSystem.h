@@ -5,24 +5,209 @@
 #include <map>
 #include <vector>
 #include <algorithm>
+#include <sstream>
+#include <cstdio>
+#include <filesystem>
+#include <tuple>
+#include <atomic>
+#include <mutex>
+#include <shared_mutex>
+#include <functional>
+#include <memory>
+#include <iomanip>
 #include "Directory.h"
+#include "Session.h"
+#include "Image.h"
+#include "Journal.h"
+#include "PathCache.h"
+#include "Snapshot.h"
+#include "Stats.h"
+#include "TreeWalk.h"
+#include "Search.h"
+#include "Persister.h"
 
 using namespace std;
 
+// How worker threads synchronize access to the shared file system
+enum class LockMode {
+    Global,      // One mutex around every command (the original behavior)
+    FineGrained  // Per-directory and per-file reader/writer locks
+};
+
+// How loadFromFile brings file contents into memory
+enum class LoadMode {
+    Eager, // Copy every file's content while loading
+    Lazy   // Keep contents in the memory-mapped image until a file is first used
+};
+
+// Kind of access requested when opening a file
+enum class Access {
+    Read,  // Shared lock on the file content
+    Write  // Exclusive lock on the file content
+};
+
+// Handle to an opened file. Keeps the parent directory read-locked (so the file
+// cannot be deleted or renamed underneath us) and the file itself locked for the
+// requested access until the handle goes out of scope. Write handles also hold
+// off checkpoints, so a change and its journal record land on the same side of one.
+// With a PackPolicy, a write handle packs whatever its holder changed on release
+// (see Rope::pack).
+class FileRef {
+    public:
+        FileRef() : dir(nullptr), file(nullptr), policy(nullptr), openedSize(0) {}
+        FileRef(shared_lock<shared_mutex> checkpointLock, shared_lock<shared_mutex> dirLock, Directory* dir, File* file, Access access,
+                const PackPolicy* policy = nullptr)
+            : checkpointLock(move(checkpointLock)), dirLock(move(dirLock)), dir(dir), file(file), policy(policy), openedSize(0) {
+            if (access == Access::Write) writeLock = Stats::acquire<unique_lock<shared_mutex>>(file->lock, LockKind::File);
+            else readLock = Stats::acquire<shared_lock<shared_mutex>>(file->lock, LockKind::File);
+            if (policy && writeLock.owns_lock()) openedSize = file->size();
+        }
+        FileRef(FileRef&&) = default;
+        FileRef& operator=(FileRef&&) = default;
+        ~FileRef() {
+            if (!policy || !writeLock.owns_lock()) return;
+            // A file that just became long enough to compress has older blocks to catch up on
+            file->content.pack(*policy, policy->compress && openedSize < policy->minFileSize, file->appendOptimized());
+        }
+
+        File* operator->() const { return file; }
+        File* get() const { return file; }
+        Directory* directory() const { return dir; } // Where the file lives
+        explicit operator bool() const { return file != nullptr; }
+
+    private:
+        shared_lock<shared_mutex> checkpointLock; // Only taken for writes
+        shared_lock<shared_mutex> dirLock; // Held before the file lock, released after it
+        unique_lock<shared_mutex> writeLock;
+        shared_lock<shared_mutex> readLock;
+        Directory* dir;
+        File* file;
+        const PackPolicy* policy;
+        size_t openedSize; // Length when a write handle with a policy was opened
+};
+
+// Read-only view of a file's content, as it was when the view was taken. Holds no
+// lock: the version it points to is immutable and shared by every reader of the file
+// until a write replaces it, and the view's EpochGuard keeps it from being freed
+// meanwhile.
+class FileView {
+    public:
+        FileView() : version(nullptr) {}
+
+        const FileVersion* operator->() const { return version; }
+        explicit operator bool() const { return version != nullptr; }
+
+    private:
+        friend class FileSystem;
+        EpochGuard epoch;
+        const FileVersion* version;
+};
+
 class FileSystem {
+    public:
+        using FileNode = ChildMap<File>::node_type; // A file unlinked from its directory
+
     private:
+        ChunkStore chunkStore; // Blocks shared between files; outlives the tree that refers to it
+        bool dedup; // Set once by enableDedup, before worker threads start
+        PackPolicy packing; // What write handles do with changed blocks; set up before worker threads start
         Directory root; // Root directory of the file system
-        Directory* currentDir; // Pointer to the current working directory
-        vector<string> path;      // Tracks the current directory path (relative to root)
+
+        Journal journal; // Log of mutating commands since the last checkpoint
+        bool journaling; // Set once by enableJournal, before worker threads start
+        string journalImage; // Image the journal applies to
+        bool syncCommits; // Wait for each command's journal records to reach the disk
+        uint64_t generation; // Checkpoint count of the image the tree was loaded from
+        uint64_t journalValidLength; // Intact prefix of the journal found by loadFromFile
+        uint64_t checkpointBytes; // Journal size that triggers a checkpoint
+        atomic<bool> checkpointing; // A checkpoint is queued or running
+        // Mutations hold this shared; a save takes it exclusively while it starts and
+        // ends, so its snapshot captures a state between whole commands. Acquired before
+        // any directory lock.
+        // Directory moves take it exclusively as well, so a mutation always sees the
+        // tree in one shape: the paths it journals and its lock order stay valid.
+        mutable shared_mutex checkpointLock;
+        // Held shared while a path is resolved or a directory's path is read without the
+        // checkpoint lock; directory moves take it exclusively, after checkpointLock and
+        // before any directory lock.
+        mutable shared_mutex layoutLock;
+        shared_ptr<const MappedImage> savedImage; // Last image saved or loaded; unchanged subtrees are copied from it
+        bool savedChunked; // savedImage stores contents as chunk lists
+        ChunkTable savedChunks; // Where savedImage keeps each chunk, if it is chunked
+        uint64_t imageContentBytes; // Length of all files in savedImage, if it is chunked
+        uint64_t imageChunkBytes; // Bytes of chunks savedImage stores them in
+        PathCache pathCache; // Absolute paths of directories resolved so far
+        // Held for the whole of a save, so saves run one at a time. Directory moves take
+        // it before checkpointLock, since a save expects every directory to stay in place.
+        mutex saveLock;
+        Snapshot* snapshot; // Snapshot of the save in progress, if any; set and read under checkpointLock
+        Executor* walkPool; // Workers tree walks fork onto, if any
+        // Runs saves asked for by exit, sync and the checkpoint threshold on a thread of
+        // its own. Declared after everything a save uses, so its thread finishes first.
+        Persister persister;
+
+        // Where saveDir put a directory's record, applied once the image is in place
+        struct ImagePlacement {
+            Directory* dir;
+            uint64_t offset; // Relative to the parent's record, like Directory::imageOffset
+            uint64_t length;
+            bool encoded; // False if the record was copied from savedImage
+        };
+
+        // Chunks a chunked save refers to, gathered while the directories are written
+        // and stored once each after the root directory
+        struct ImageChunks {
+            struct Entry {
+                ChunkId id;
+                ChunkRef chunk; // Keeps the bytes alive when they are in memory
+                shared_ptr<const MappedImage> image; // Or when they are in an earlier image
+                const char* bytes; // As stored, so packed if compressed
+                uint32_t length;
+                uint32_t storedLength;
+                bool compressed;
+            };
+            vector<Entry> entries;
+            unordered_map<ChunkId, size_t, ChunkIdHash> index;
+            uint64_t contentBytes = 0; // Length of every file in the image
+            uint64_t chunkBytes = 0;
+            ChunkTable table; // Where writeImage put each chunk
+
+            void add(const ChunkId& id, ChunkRef chunk, shared_ptr<const MappedImage> image, const char* bytes, uint32_t length,
+                     uint32_t storedLength, bool compressed) {
+                auto found = index.emplace(id, entries.size());
+                if (found.second) {
+                    entries.push_back({id, move(chunk), move(image), bytes, length, storedLength, compressed});
+                    chunkBytes += storedLength;
+                } else if (compressed && !entries[found.first->second].compressed) {
+                    // The same block held compressed elsewhere; store it that way
+                    Entry& entry = entries[found.first->second];
+                    chunkBytes -= entry.storedLength;
+                    entry = {id, move(chunk), move(image), bytes, length, storedLength, compressed};
+                    chunkBytes += storedLength;
+                }
+            }
+
+            // Add a chunk held in memory, stored the way it is held
+            void add(const ChunkId& id, const ChunkRef& chunk) {
+                add(id, chunk, nullptr, chunk->data(), uint32_t(chunk->size()), uint32_t(chunk->storedSize()), chunk->compressed);
+            }
+        };
+
+        // Chunks of a chunked image being loaded, each created once however many files use it
+        struct ChunkLoader {
+            shared_ptr<const MappedImage> image;
+            bool view; // Leave chunk bytes in the image instead of copying them
+            unordered_map<ChunkId, ChunkRef, ChunkIdHash> loaded;
+        };
     
         // Help map for command descriptions
         vector<pair<string, string>> helpMap = {
             {"create", "01. create <filename>                    - Create a new file in current directory"},
             {"delete", "02. delete <filename>                    - Delete a file from current directory"},
             {"mkdir", "03. mkdir <dirname>                      - Create a new directory"},
-            {"chdir", "04. chdir <dirname>                      - Change to specified directory (use '..' to go up)"},
+            {"chdir", "04. chdir <dirname>                      - Change to specified directory or path (use '..' to go up)"},
             {"ls", "05. ls                                   - Lists all files and directories in the current directory"},
-            {"move", "06. move <source> <target>               - Rename/move a file"},
+            {"move", "06. move <source> <target>               - Rename/move a file or directory (target ending in '/' keeps the name)"},
             {"open", "07. open <filename>                      - Open a file for writing"},
             {"close", "08. close <filename>                     - Close an opened file"},
             {"write", "09. write <filename> <text>              - Write text at the end of file"},
@@ -33,234 +218,1553 @@ class FileSystem {
             {"truncate", "14. truncate <filename> <size>           - Cut file size to specified length"},
             {"memory_map", "15. memory_map                           - Show current directory and files tree"},
             {"help", "16. help                                 - To show work of available commands"},
-            {"exit", "17. exit                                 - Exit the program"}
+            {"exit", "17. exit                                 - Exit the program"},
+            {"begin", "18. begin                                - Queue the following commands as one transaction"},
+            {"commit", "19. commit                               - Run the queued commands atomically; any failure undoes them all"},
+            {"abort", "20. abort                                - Discard the queued commands"},
+            {"dedup", "21. dedup                                - Show how much memory and disk space shared and compressed chunks save"},
+            {"stats", "22. stats                                - Show command latencies, lock waits, bytes read and written, and tree size"},
+            {"find", "23. find <pattern>                       - List files and directories below the current one matching a pattern (* and ?)"},
+            {"du", "24. du [dirname]                         - Show bytes and file counts of a directory and every directory below it"},
+            {"grep", "25. grep <pattern> [dirname]             - List files below a directory whose content holds a string, with offsets"},
+            {"sync", "26. sync                                 - Wait until every change so far is on disk"},
+            {"reserve", "27. reserve <filename> <size>            - Switch a file expected to grow to size bytes by appends to append mode (not saved)"}
         };
     public:
-    FileSystem() : root("root", nullptr), currentDir(&root) {
-        // Initialize the path as empty, meaning we're at the root
-        path.push_back(""); // Root is the starting point but not shown in the path
-    }
+    FileSystem() : dedup(false), root(nullptr), journaling(false), syncCommits(true), generation(0), journalValidLength(0),
+                   checkpointBytes(4 << 20), checkpointing(false), savedChunked(false), imageContentBytes(0), imageChunkBytes(0),
+                   snapshot(nullptr), walkPool(nullptr), persister([this](const string& filename) { return backgroundSave(filename); }) {}
+
+        // Versions published for readers are freed through Epoch and still refer to
+        // chunkStore, so they go before it does
+        ~FileSystem() {
+            persister.stop();
+            clearTree();
+            Epoch::drain();
+        }
+
+        // Store file contents as content-addressed chunks from now on: identical blocks
+        // of any files share memory, and saves write every distinct block once. Call
+        // before loadFromFile and before worker threads start.
+        void enableDedup() {
+            dedup = true;
+            packing.store = &chunkStore;
+        }
+
+        // Keep the blocks of files at least minFileSize long compressed, in memory and in
+        // saved images, where each block is written as it is held. A block stays
+        // uncompressed unless compressing saves minSavingPercent of it. Blocks are
+        // compressed when a write leaves them changed, or when a save writes content
+        // not loaded yet. Call before loadFromFile and before worker threads start.
+        void enableCompression(uint64_t minFileSize, uint32_t minSavingPercent = 25) {
+            packing.compress = true;
+            packing.minFileSize = minFileSize;
+            packing.minSavingPercent = minSavingPercent;
+        }
+
+        // Saves write chunked images, which can share and hold compressed blocks
+        bool chunkedImages() const { return dedup || packing.compress; }
+
+        // Start a new command stream at the root directory
+        Session newSession() {
+            return Session(&root);
+        }
     
         // Function to display the current path (excluding root)
-        void displayPath() {
+        void displayPath(const Session& session) {
+            vector<string> path = currentPath(session);
             if (path.size() == 1 && path[0] == "") {
-                cout << "> "; // Just root, so no path
+                session.messages() << "> "; // Just root, so no path
                 return;
             }
         
             for (size_t i = 1; i < path.size(); ++i) { // Skip the root marker ""
-                if (i > 1) cout << ">";
-                cout << path[i];
+                if (i > 1) session.messages() << ">";
+                session.messages() << path[i];
             }
-            cout << "> ";
+            session.messages() << "> ";
         }
         
     
     
-        void showHelp() {
-            cout << "Available Commands:\n";
+        void showHelp(ostream& out = cout) {
+            out << "Available Commands:\n";
             for (const auto& entry : helpMap) {
-                cout << entry.second << endl;
+                out << entry.second << endl;
             }
         }
     
         // Function to show specific help
-        void showSpecificHelp(const string& command) {
+        void showSpecificHelp(const string& command, ostream& out = cout) {
             for (const auto& entry : helpMap) {
                 if (entry.first == command) {
-                    cout << entry.second << endl;
+                    out << entry.second << endl;
                     return;
                 }
             }
-            cout << "Unknown command. Use 'help' to see the list of available commands.\n";
+            out << "Unknown command. Use 'help' to see the list of available commands.\n";
         }
         
     
-        void createFile(const string& filename) {
-            if (currentDir->files.find(filename) == currentDir->files.end()) {
-                currentDir->files[filename] = File(filename); // Create a new file in the current directory
-                cout << "File created: " << filename << endl;
+        bool createFile(Session& session, const string& path) {
+            string filename;
+            Directory* dir = parentDirectory(session, path, filename);
+            if (!dir) return false;
+            shared_lock<shared_mutex> checkpoint = lockCheckpoint(session);
+            unique_lock<shared_mutex> guard = lockExclusive(session, dir);
+            if (dir->files.find(filename) == dir->files.end()) {
+                preserve(dir);
+                dir->addFile(filename); // Create a new file in the current directory
+                dir->markDirty();
+                record(session, dir, JournalRecord(JournalOp::Create, filename));
+                onRollback(session, [dir, filename] { dir->files.erase(filename); });
+                session.messages() << "File created: " << filename << endl;
+                return true;
             } else {
-                cout << "File already exists.\n"; // File with the same name already exists
+                session.messages() << "File already exists.\n"; // File with the same name already exists
+                return false;
             }
         }
     
-        void deleteFile(const string& filename) {
-            if (currentDir->files.erase(filename)) {
-                cout << "File deleted: " << filename << endl; // Delete the file if it exists
+        bool deleteFile(Session& session, const string& path) {
+            string filename;
+            Directory* dir = parentDirectory(session, path, filename);
+            if (!dir) return false;
+            shared_lock<shared_mutex> checkpoint = lockCheckpoint(session);
+            unique_lock<shared_mutex> guard = lockExclusive(session, dir);
+            preserve(dir);
+            FileNode node = dir->files.extract(filename); // Unlinked, so a transaction can put it back
+            if (!node.empty()) {
+                dir->markDirty();
+                record(session, dir, JournalRecord(JournalOp::Delete, filename));
+                if (session.transaction) {
+                    shared_ptr<FileNode> saved = make_shared<FileNode>(move(node));
+                    session.transaction->onRollback([dir, saved] { dir->files.insert(move(*saved)); });
+                }
+                session.messages() << "File deleted: " << filename << endl; // Delete the file if it exists
+                return true;
             } else {
-                cout << "File not found.\n"; // File not found in the current directory
+                session.messages() << "File not found.\n"; // File not found in the current directory
+                return false;
             }
         }
     
-        void mkdir(const string& dname) {
+        bool mkdir(Session& session, const string& path) {
+            string dname;
+            Directory* dir = parentDirectory(session, path, dname);
+            if (!dir) return false;
             if (dname.empty()) {
-                cout << "Directory name cannot be empty.\n";
-                return;
+                session.messages() << "Directory name cannot be empty.\n";
+                return false;
             }
             if (dname == "root") {
-                cout << "Cannot create another 'root' directory.\n";
-                return;
+                session.messages() << "Cannot create another 'root' directory.\n";
+                return false;
             }
-            if (currentDir->subdirectories.find(dname) != currentDir->subdirectories.end()) {
-                cout << "Directory already exists.\n";
-                return;
+            shared_lock<shared_mutex> checkpoint = lockCheckpoint(session);
+            unique_lock<shared_mutex> guard = lockExclusive(session, dir);
+            preserve(dir);
+            Directory* child = dir->addSubdirectory(dname); // Construct the directory in place
+            if (!child) {
+                session.messages() << "Directory already exists.\n";
+                return false;
             }
-            Directory newDir;
-            newDir.name = dname;
-            newDir.parent = currentDir;
-            currentDir->subdirectories[dname] = newDir;
-            cout << "Directory created: " << dname << endl;
+            dir->markDirty();
+            record(session, dir, JournalRecord(JournalOp::Mkdir, dname));
+            if (session.transaction) session.transaction->adopt(child);
+            onRollback(session, [dir, dname] { dir->subdirectories.erase(dname); });
+            session.messages() << "Directory created: " << dname << endl;
+            return true;
         }
         
     
-        void chDir(const string& dirname) {
+        bool chDir(Session& session, const string& dirname) {
+            Directory* dir = session.currentDir;
             if (dirname == "..") {
-                if (currentDir->parent != nullptr) {
-                    currentDir = currentDir->parent;  // Move to the parent directory
-                    path.pop_back();  // Remove the last directory from the path
+                shared_lock<shared_mutex> layout = lockLayout(session);  // The parent changes if the directory is moved
+                if (dir->parent != nullptr) {
+                    session.currentDir = dir->parent;  // Move to the parent directory
+                } else {
+                    session.messages() << "Already at root directory.\n";  // Already at the root directory
+                    return false;
+                }
+            } else if (dirname.find('/') == string::npos) {
+                Directory* child = subdirectory(session, dir, dirname);
+                if (child) {
+                    session.currentDir = child;  // Change to the specified subdirectory
                 } else {
-                    cout << "Already at root directory.\n";  // Already at the root directory
+                    session.messages() << "Directory not found.\n";  // Subdirectory not found
+                    return false;
                 }
-            } else if (currentDir->subdirectories.find(dirname) != currentDir->subdirectories.end()) {
-                currentDir = &currentDir->subdirectories[dirname];  // Change to the specified subdirectory
-                path.push_back(dirname);  // Add the subdirectory name to the path
             } else {
-                cout << "Directory not found.\n";  // Subdirectory not found
+                Directory* target = lookupDir(session, dirname);
+                if (target) {
+                    session.currentDir = target;  // Jump straight to the directory the path names
+                } else {
+                    session.messages() << "Directory not found.\n";
+                    return false;
+                }
+            }
+            return true;
+        }
+
+        // Subdirectory of dir called name, or nullptr. Inside a transaction, a directory
+        // the transaction does not hold is only try-locked: waiting for it while holding
+        // locks out of order could deadlock, so busy is set instead.
+        Directory* subdirectory(const Session& session, Directory* dir, const string& name, bool* busy = nullptr) {
+            shared_lock<shared_mutex> guard;
+            if (!session.transaction) {
+                guard = Stats::acquire<shared_lock<shared_mutex>>(dir->lock, LockKind::Directory);
+            } else if (!session.transaction->holds(dir)) {
+                guard = shared_lock<shared_mutex>(dir->lock, try_to_lock);
+                if (!guard.owns_lock()) {
+                    if (busy) *busy = true;
+                    return nullptr;
+                }
+            }
+            auto it = dir->subdirectories.find(name);
+            return it != dir->subdirectories.end() ? &it->second : nullptr;
+        }
+
+        // Absolute form of path as a list of names, root marker "" first (the layout
+        // JournalRecord::dir uses). Relative paths start from base; "." is skipped and ".." stops at the root.
+        static vector<string> splitPath(const vector<string>& base, const string& path) {
+            vector<string> parts;
+            if (path.empty() || path[0] != '/') parts = base;
+            else parts.push_back("");
+            size_t start = 0;
+            while (start <= path.size()) {
+                size_t end = path.find('/', start);
+                if (end == string::npos) end = path.size();
+                string part = path.substr(start, end - start);
+                if (part == "..") {
+                    if (parts.size() > 1) parts.pop_back();
+                } else if (!part.empty() && part != ".") {
+                    parts.push_back(move(part));
+                }
+                start = end + 1;
             }
+            return parts;
+        }
+
+        // Directory at path, or nullptr. A path without empty, "." or ".." components is
+        // already in the form the cache uses, so a hit costs no splitting at all.
+        Directory* lookupDir(const Session& session, const string& path, bool* busy = nullptr) {
+            shared_lock<shared_mutex> layout = lockLayout(session);
+            if (isCanonical(path)) {
+                string key = path[0] == '/' ? path : pathKey(session.currentDir) + "/" + path;
+                if (Directory* dir = pathCache.find(key)) return dir;
+            }
+            return findDir(session, splitPath(pathOf(session.currentDir), path), busy);
+        }
+
+        // Directory at path (as returned by splitPath), or nullptr
+        Directory* lookupDir(const Session& session, const vector<string>& path, bool* busy = nullptr) {
+            shared_lock<shared_mutex> layout = lockLayout(session);
+            return findDir(session, path, busy);
+        }
+
+        // Path of the session's directory, as returned by splitPath
+        vector<string> currentPath(const Session& session) const {
+            shared_lock<shared_mutex> layout = lockLayout(session);
+            return pathOf(session.currentDir);
+        }
+
+        // True if path has no empty, "." or ".." components, so that it names its
+        // directory the same way the path cache does
+        static bool isCanonical(const string& path) {
+            if (path.empty() || path.back() == '/') return false;
+            for (size_t start = path[0] == '/' ? 1 : 0; start <= path.size();) {
+                size_t end = path.find('/', start);
+                if (end == string::npos) end = path.size();
+                size_t length = end - start;
+                if (length == 0 || (path[start] == '.' && (length == 1 || (length == 2 && path[start + 1] == '.')))) return false;
+                start = end + 1;
+            }
+            return true;
+        }
+
+        // Absolute path of the directory holding the last component of path, which is
+        // returned in leaf
+        static vector<string> parentPath(const vector<string>& base, const string& path, string& leaf) {
+            size_t slash = path.rfind('/');
+            if (slash == string::npos) {
+                leaf = path;
+                return base;
+            }
+            leaf = path.substr(slash + 1);
+            return splitPath(base, slash == 0 ? "/" : path.substr(0, slash));
+        }
+
+        // Directory that holds the last component of path, which is returned in leaf.
+        // A plain name stays in the session's directory without any lookup.
+        Directory* parentDirectory(const Session& session, const string& path, string& leaf) {
+            if (path.find('/') == string::npos) {
+                leaf = path;
+                return session.currentDir;
+            }
+            size_t slash = path.rfind('/');
+            leaf = path.substr(slash + 1);
+            Directory* dir = slash == 0 ? &root : lookupDir(session, path.substr(0, slash));
+            if (!dir) session.messages() << "Directory not found.\n";
+            return dir;
+        }
+
+        // Path of dir as returned by splitPath. Call with layoutLock or checkpointLock
+        // held, either of which keeps directories from moving.
+        static vector<string> pathOf(const Directory* dir) {
+            vector<string> path;
+            for (; dir->parent; dir = dir->parent) path.push_back(dir->name());
+            path.push_back("");
+            reverse(path.begin(), path.end());
+            return path;
+        }
+
+        // Path of dir as the path cache spells it: "/a/b", or "" for the root. Same
+        // locking as pathOf.
+        static string pathKey(const Directory* dir) {
+            string key;
+            for (; dir->parent; dir = dir->parent) key.insert(0, "/" + dir->name());
+            return key;
         }
         
-        void listFiles() {
-            if (currentDir->files.empty() && currentDir->subdirectories.empty()) {
-                cout << "Directory is empty.\n";
+        void listFiles(const Session& session) {
+            Directory* dir = session.currentDir;
+            shared_lock<shared_mutex> layout = lockLayout(session); // The directory's name changes if it is moved
+            shared_lock<shared_mutex> guard = lockShared(session, dir);
+            if (dir->files.empty() && dir->subdirectories.empty()) {
+                session.messages() << "Directory is empty.\n";
             } else {
-                cout << "\nContents of directory '" << currentDir->name << "':\n";
+                session.messages() << "\nContents of directory '" << dir->name() << "':\n";
         
                 // List subdirectories
-                for (const auto& dirEntry : currentDir->subdirectories) {
-                    cout << "[DIR]  " << dirEntry.second.name << endl;
+                for (const auto& dirEntry : dir->subdirectories) {
+                    session.messages() << "[DIR]  " << dirEntry.second.name() << endl;
                 }
         
                 // List files
-                for (const auto& fileEntry : currentDir->files) {
-                    cout << "[FILE]  " << fileEntry.second.name << endl;
+                for (const auto& fileEntry : dir->files) {
+                    session.messages() << "[FILE]  " << fileEntry.second.name() << endl;
                 }
             }
         }
         
     
-        void moveFile(const string& source, const string& target) {
-            if (currentDir->files.find(source) != currentDir->files.end()) {
-                File f = currentDir->files[source]; // Get the source file
-                f.name = target; // Rename the file
-                currentDir->files[target] = f; // Add the renamed file to the map
-                currentDir->files.erase(source); // Remove the original file
-                cout << "Moved file: " << source << " -> " << target << endl;
-            } else {
-                cout << "Source file not found.\n"; // Source file not found
+        // Move or rename a file or a directory. targetPath names the new location; if it
+        // ends in '/' the source keeps its name. Both are relinked by their map node, so
+        // nothing is copied, whatever the size of the file or subtree.
+        bool moveFile(Session& session, const string& sourcePath, const string& targetPath) {
+            string source, target;
+            Directory* from = parentDirectory(session, sourcePath, source);
+            if (!from) return false;
+            Directory* to = parentDirectory(session, targetPath, target);
+            if (!to) return false;
+            if (target.empty()) target = source;
+            {
+                shared_lock<shared_mutex> checkpoint = lockCheckpoint(session);
+                auto guards = lockExclusive(session, from, to);
+                FileNode replaced;
+                preserve(from);
+                preserve(to);
+                if (relinkFile(from, source, to, target, &replaced)) {
+                    from->markDirty();
+                    to->markDirty();
+                    JournalRecord entry(JournalOp::Move, source);
+                    entry.target = from == to ? target : pathKey(to) + "/" + target;
+                    record(session, from, entry);
+                    if (session.transaction) {
+                        shared_ptr<FileNode> saved = make_shared<FileNode>(move(replaced));
+                        session.transaction->onRollback([from, source, to, target, saved] {
+                            relinkFile(to, target, from, source);
+                            if (!saved->empty()) to->files.insert(move(*saved)); // Bring back the file it replaced
+                        });
+                    }
+                    session.messages() << "Moved file: " << sourcePath << " -> " << targetPath << endl;
+                    return true;
+                }
+            }
+            return moveDirectory(session, from, source, to, target, sourcePath, targetPath);
+        }
+
+        // Second half of moveFile, for a source that is not a file. Stops every mutation
+        // and path lookup while the subtree changes place, so no path journaled or cached
+        // elsewhere can refer to the old shape of the tree.
+        bool moveDirectory(Session& session, Directory* from, const string& source, Directory* to, const string& target,
+                           const string& sourcePath, const string& targetPath) {
+            if (session.transaction) {
+                shared_lock<shared_mutex> guard = lockShared(session, from);
+                if (from->subdirectories.count(source)) {
+                    session.messages() << "Error: Directories cannot be moved inside a transaction.\n"; // It holds the checkpoint lock shared
+                } else {
+                    session.messages() << "Source not found.\n";
+                }
+                return false;
+            }
+            lock_guard<mutex> saving(saveLock);
+            unique_lock<shared_mutex> checkpoint(checkpointLock);
+            unique_lock<shared_mutex> layout(layoutLock);
+            auto guards = lockExclusive(session, from, to);
+            auto it = from->subdirectories.find(source);
+            if (it == from->subdirectories.end()) {
+                session.messages() << "Source not found.\n"; // Neither a file nor a directory
+                return false;
+            }
+            for (Directory* dir = to; dir; dir = dir->parent) {
+                if (dir == &it->second) {
+                    session.messages() << "Error: Cannot move a directory into itself.\n";
+                    return false;
+                }
+            }
+            if (to->subdirectories.count(target)) {
+                session.messages() << "Target directory already exists.\n";
+                return false;
             }
+            relinkDirectory(from, source, to, target);
+            JournalRecord entry(JournalOp::MoveDir, source);
+            entry.target = from == to ? target : pathKey(to) + "/" + target;
+            record(session, from, entry);
+            session.messages() << "Moved directory: " << sourcePath << " -> " << targetPath << endl;
+            return true;
         }
     
-        File* openFile(const string& filename) {
-            if (currentDir->files.find(filename) != currentDir->files.end()) {
-                File* file = &currentDir->files[filename];
-                if (file->is_open) {
-                    cout << "Error: File is already open.\n";
-                    return nullptr;  // Return nullptr if file is already open
+        FileRef openFile(const Session& session, const string& path, Access access = Access::Write) {
+            string filename;
+            Directory* dir = parentDirectory(session, path, filename);
+            if (!dir) return FileRef();
+            shared_lock<shared_mutex> checkpoint;
+            if (access == Access::Write) checkpoint = lockCheckpoint(session);
+            shared_lock<shared_mutex> guard = lockShared(session, dir);
+            auto it = dir->files.find(filename);
+            if (it != dir->files.end()) {
+                File* file = &it->second;
+                if (file->is_open.exchange(true)) {
+                    session.messages() << "Error: File is already open.\n";
+                    return FileRef();  // Return an empty handle if file is already open
                 } else {
-                    file->is_open = true;
-                    return file;    // Return pointer only if successfully opened
+                    onRollback(session, [file] { file->is_open = false; });
+                    FileRef ref(move(checkpoint), move(guard), dir, file, access, packing.store || packing.compress ? &packing : nullptr);
+                    if (access == Access::Write) {
+                        preserve(file); // Assume the handle is used to change the file
+                        file->unpublish(); // Readers publish the changed content again
+                        dir->markDirty();
+                    }
+                    return ref;    // Return handle only if successfully opened
                 }
             } else {
-                cout << "File not found.\n";
-                return nullptr;
+                session.messages() << "File not found.\n";
+                return FileRef();
             }
         }
     
-        void closeFile(const string& filename) {
-            if (currentDir->files.find(filename) != currentDir->files.end()) {
-                currentDir->files[filename].is_open = false; // Mark the file as closed
-                cout << "File closed.\n";
+        // Take a view of path's content for read and read_from. Unlike openFile, this
+        // neither locks the file nor marks it open, so any number of readers share it
+        // with each other and with a writer. The first reader after a write publishes
+        // the content (see File::publish), taking the file's lock shared for as long as
+        // that takes, O(1); later readers use what it published without locking. The
+        // directory is only read-locked while the file is looked up.
+        FileView viewFile(const Session& session, const string& path) {
+            string filename;
+            Directory* dir = parentDirectory(session, path, filename);
+            if (!dir) return FileView();
+            FileView view; // Entered before the version is loaded, so it stays alive
+            shared_lock<shared_mutex> guard = lockShared(session, dir);
+            auto it = dir->files.find(filename);
+            if (it == dir->files.end()) {
+                session.messages() << "File not found.\n";
+                return FileView();
+            }
+            File* file = &it->second;
+            view.version = file->published();
+            if (!view.version) {
+                shared_lock<shared_mutex> reading = Stats::acquire<shared_lock<shared_mutex>>(file->lock, LockKind::File);
+                view.version = file->publish();
+                // A rollback changes the content without a write handle
+                onRollback(session, [file] { file->unpublish(); });
+            }
+            return view;
+        }
+
+        // Append text to path's file, for write. Unlike openFile this does not mark the
+        // file open, so any number of sessions can append to one file at once; a file
+        // opened with open still refuses them. An append that finds the file's lock free
+        // applies itself. One that finds it busy joins the file's AppendQueue, and the
+        // first appender waiting there applies everything queued in one batch: one hold
+        // of the lock and one journal frame for the lot, instead of every appender
+        // taking the lock and writing a frame in turn. Appends from one session stay in
+        // order, since each returns only once it is applied.
+        bool appendFile(Session& session, const string& path, const string& text) {
+            string filename;
+            Directory* dir = parentDirectory(session, path, filename);
+            if (!dir) return false;
+            shared_lock<shared_mutex> checkpoint = lockCheckpoint(session);
+            shared_lock<shared_mutex> guard = lockShared(session, dir);
+            auto it = dir->files.find(filename);
+            if (it == dir->files.end()) {
+                session.messages() << "File not found.\n";
+                return false;
+            }
+            File* file = &it->second;
+            if (file->is_open.load()) {
+                session.messages() << "Error: File is already open.\n";
+                return false;
+            }
+
+            unique_lock<shared_mutex> writing = Stats::tryAcquire<unique_lock<shared_mutex>>(file->lock, LockKind::File);
+            if (writing.owns_lock() || session.transaction) {
+                // A transaction's appends are undone one by one, so they skip the queue
+                if (!writing.owns_lock()) writing = Stats::acquire<unique_lock<shared_mutex>>(file->lock, LockKind::File);
+                size_t oldSize = file->size();
+                preserve(file);
+                file->unpublish();
+                dir->markDirty();
+                file->write_to_file(text);
+                record(session, dir, JournalRecord(JournalOp::Write, filename, text));
+                onRollback(session, [file, oldSize] { file->content.truncate(oldSize); });
+                packAppended(file, oldSize);
+                return true;
+            }
+
+            AppendQueue& queue = file->appendQueue();
+            AppendQueue::Request request{&text, 0, false};
+            unique_lock<mutex> waiting(queue.lock);
+            queue.pending.push_back(&request);
+            queue.applied.wait(waiting, [&] { return request.done || !queue.applying; });
+            if (!request.done) {
+                // Nobody is applying: apply everything queued so far, this append included
+                vector<AppendQueue::Request*> batch;
+                batch.swap(queue.pending);
+                queue.applying = true;
+                waiting.unlock();
+                uint64_t seq = applyAppends(dir, file, batch);
+                waiting.lock();
+                for (AppendQueue::Request* done : batch) {
+                    done->journalSeq = seq;
+                    done->done = true;
+                }
+                queue.applying = false;
+                queue.applied.notify_all();
+            }
+            if (request.journalSeq != 0) session.journalSeq = request.journalSeq;
+            return true;
+        }
+
+        // Put path's file in append mode (see File::optimizeForAppends) if it is expected
+        // to grow past its current length. size only decides that; nothing is allocated
+        // for it beyond the last block's room. Only a hint: it is neither journaled nor
+        // saved, so a reloaded file is back in normal mode.
+        bool reserveFile(const Session& session, const string& path, int size) {
+            if (size < 0) {
+                session.messages() << "Error: Size cannot be negative.\n";
+                return false;
+            }
+            string filename;
+            Directory* dir = parentDirectory(session, path, filename);
+            if (!dir) return false;
+            shared_lock<shared_mutex> checkpoint = lockCheckpoint(session);
+            shared_lock<shared_mutex> guard = lockShared(session, dir);
+            auto it = dir->files.find(filename);
+            if (it == dir->files.end()) {
+                session.messages() << "File not found.\n";
+                return false;
+            }
+            File* file = &it->second;
+            unique_lock<shared_mutex> writing = Stats::acquire<unique_lock<shared_mutex>>(file->lock, LockKind::File);
+            if (size_t(size) <= file->size()) {
+                session.messages() << "Warning: File is already " << file->size() << " bytes. Append mode not changed.\n";
+                return false;
+            }
+            file->optimizeForAppends();
+            session.messages() << "Append mode on for: " << filename << "\n";
+            return true;
+        }
+
+        bool closeFile(const Session& session, const string& path) {
+            string filename;
+            Directory* dir = parentDirectory(session, path, filename);
+            if (!dir) return false;
+            shared_lock<shared_mutex> guard = lockShared(session, dir);
+            auto it = dir->files.find(filename);
+            if (it != dir->files.end()) {
+                File* file = &it->second;
+                bool wasOpen = file->is_open.exchange(false); // Mark the file as closed
+                onRollback(session, [file, wasOpen] { file->is_open = wasOpen; });
+                session.messages() << "File closed.\n";
+                return true;
             } else {
-                cout << "File not found.\n"; // File not found
+                session.messages() << "File not found.\n"; // File not found
+                return false;
             }
         }
     
-        void showMemoryMap(Directory* dir = nullptr, int depth = 0) {
-            if (dir == nullptr) dir = &root; // Start from the root directory if no directory is specified
-            for (auto& d : dir->subdirectories) {
-                for (int i = 0; i < depth; i++) cout << "  "; // Indent based on depth
-                cout << "[DIR] " << d.first << endl; // Print directory name
-                showMemoryMap(&d.second, depth + 1); // Recursively show subdirectories
+        // Print the whole tree, subdirectories before files at every level. Each directory's
+        // lines are collected by a parallel walk and printed once it is over.
+        void showMemoryMap(ostream& out = cout) {
+            WalkNode<string> tree;
+            walkTree(walkPool, &root, tree, [](const Directory& dir, WalkNode<string>& node) {
+                for (auto& f : dir.files) {
+                    node.output.append(2 * node.depth, ' '); // Indent based on depth
+                    node.output += "[FILE] " + f.first + "\n";
+                }
+            });
+            printMap(out, tree);
+        }
+
+        // List the files and directories below the session's directory whose names match
+        // pattern ('*' and '?' wildcards), by absolute path, directories ending in '/'
+        bool findFiles(const Session& session, const string& pattern) {
+            if (pattern.empty()) {
+                session.messages() << "Usage: find <pattern>\n";
+                return false;
             }
-            for (auto& f : dir->files) {
-                for (int i = 0; i < depth; i++) cout << "  "; // Indent based on depth
-                cout << "[FILE] " << f.first << endl; // Print file name
+            WalkNode<Matches> tree;
+            {
+                shared_lock<shared_mutex> layout = lockLayout(session);
+                tree.path = pathKey(session.currentDir);
             }
+            walkTree(walkPool, session.currentDir, tree, [&pattern](const Directory& dir, WalkNode<Matches>& node) {
+                for (auto& d : dir.subdirectories) {
+                    if (!globMatch(pattern, d.first)) continue;
+                    node.output.lines += node.path + "/" + d.first + "/\n";
+                    node.output.count++;
+                }
+                for (auto& f : dir.files) {
+                    if (!globMatch(pattern, f.first)) continue;
+                    node.output.lines += node.path + "/" + f.first + "\n";
+                    node.output.count++;
+                }
+            });
+            size_t found = printMatches(session.messages(), tree);
+            if (found == 0) session.messages() << "No matches for '" << pattern << "'.\n";
+            return true;
+        }
+
+        // Bytes and files in path (the session's directory if empty) and in every directory
+        // below it, each line counting the whole subtree, subdirectories first like du
+        bool diskUsage(const Session& session, const string& path) {
+            Directory* dir = path.empty() ? session.currentDir : lookupDir(session, path);
+            if (!dir) {
+                session.messages() << "Directory not found.\n";
+                return false;
+            }
+            WalkNode<Usage> tree = usage(session, dir);
+            printUsage(session.messages(), tree);
+            return true;
+        }
+
+        // List the files below path (the session's directory if empty) whose content holds
+        // pattern, with the offsets where it starts. Each file is read-locked only while
+        // the walk takes its version; the versions are searched afterwards, in parallel
+        // batches and with no lock held, so the result is the content as the walk found it.
+        bool grepFiles(const Session& session, const string& pattern, const string& path) {
+            if (pattern.empty()) {
+                session.messages() << "Usage: grep <pattern> [dirname]\n";
+                return false;
+            }
+            Directory* dir = path.empty() ? session.currentDir : lookupDir(session, path);
+            if (!dir) {
+                session.messages() << "Directory not found.\n";
+                return false;
+            }
+            WalkNode<vector<GrepTarget>> tree;
+            {
+                shared_lock<shared_mutex> layout = lockLayout(session);
+                tree.path = pathKey(dir);
+            }
+            walkTree(walkPool, dir, tree, [](const Directory& dir, WalkNode<vector<GrepTarget>>& node) {
+                for (auto& f : dir.files) {
+                    shared_lock<shared_mutex> fileGuard = Stats::acquire<shared_lock<shared_mutex>>(f.second.lock, LockKind::File);
+                    node.output.push_back({node.path + "/" + f.first, f.second.version(), {}, 0}); // O(1)
+                }
+            });
+            vector<GrepTarget*> targets;
+            collectTargets(tree, targets);
+
+            // Batches of about GREP_BATCH_BYTES, so small files do not cost a task each
+            {
+                TaskGroup group(walkPool);
+                size_t first = 0, bytes = 0;
+                for (size_t i = 0; i < targets.size(); i++) {
+                    bytes += targets[i]->version.size();
+                    if (bytes < GREP_BATCH_BYTES && i + 1 < targets.size()) continue;
+                    group.run([&targets, &pattern, first, last = i + 1] {
+                        for (size_t j = first; j < last; j++) searchTarget(*targets[j], pattern);
+                    });
+                    first = i + 1;
+                    bytes = 0;
+                }
+                group.wait();
+            }
+
+            size_t matches = 0, files = 0;
+            for (GrepTarget* target : targets) {
+                if (target->count == 0) continue;
+                session.messages() << target->path << ":";
+                for (size_t offset : target->offsets) session.messages() << " " << offset;
+                if (target->count > target->offsets.size()) session.messages() << " ... (" << target->count << " matches)";
+                session.messages() << "\n";
+                matches += target->count;
+                files++;
+            }
+            if (files == 0) session.messages() << "No matches for '" << pattern << "'.\n";
+            else session.messages() << matches << " matches in " << files << " files.\n";
+            return true;
+        }
+
+        // Run tree walks (memory_map, find, du, grep, stats) on executor's workers. Call before
+        // worker threads start; the executor must outlive every walk.
+        void useExecutor(Executor* executor) {
+            walkPool = executor;
         }
     
-        // Save the file system
-        void saveToFile(const string& filename) {
-            ofstream fout(filename);
-            if (!fout) {
-                cout << "Failed to save.\n";
-                return;
+        // Report how much sharing and compressing chunks saves: in memory, over the files
+        // loaded so far, and on disk, for the last chunked image saved or loaded
+        void showDedupStats(ostream& out = cout) {
+            uint64_t contentBytes, chunkBytes;
+            {
+                shared_lock<shared_mutex> guard(checkpointLock); // Saves update these at their end
+                contentBytes = imageContentBytes;
+                chunkBytes = imageChunkBytes;
             }
-        
-            // Save files in root
-            for (auto& f : root.files) {
-                fout << "FILE " << f.second.name << " " << f.second.content << endl;
+            unordered_map<const Chunk*, ChunkRef> seen; // Held, so no address is reused during the walk
+            uint64_t files = 0, logical = 0, unique = 0, notLoaded = 0, compressed = 0;
+            countChunks(&root, seen, files, logical, unique, notLoaded, compressed);
+
+            auto ratio = [](uint64_t whole, uint64_t part) { return part ? double(whole) / part : 1.0; };
+            out << fixed << setprecision(2);
+            out << "Dedup " << (dedup ? "on" : "off") << ": " << chunkStore.size() << " chunks (" << chunkStore.bytes()
+                 << " bytes) in the store\n";
+            if (packing.compress) {
+                out << "Compression on for files of " << packing.minFileSize << " bytes and up: " << compressed
+                     << " chunks compressed\n";
             }
-        
-            // Save subdirectories in root
-            for (auto& d : root.subdirectories) {
-                saveDir(fout, d.second);
+            out << "Memory: " << files << " files hold " << logical << " bytes in " << unique << " bytes of chunks (ratio "
+                 << ratio(logical, unique) << ", " << logical - unique << " bytes saved)\n";
+            if (notLoaded > 0) out << "Not loaded yet: " << notLoaded << " bytes\n";
+            if (contentBytes > 0) {
+                out << "Image: " << contentBytes << " bytes of content in " << chunkBytes << " bytes of chunks (ratio "
+                     << ratio(contentBytes, chunkBytes) << ", " << contentBytes - chunkBytes << " bytes saved)\n";
             }
-        
-            fout.close();
-        }    
-        
+            out << defaultfloat;
+        }
+
+        // Report command latencies, lock waits and bytes moved, merged over every thread
+        // (see Stats), and how big the tree and its files have grown
+        void showStats(ostream& out = cout) {
+            Stats::print(out, Stats::snapshot());
+            Session session = newSession();
+            Usage total = addUsage(usage(session, &root));
+            out << "Tree: " << total.dirs << " directories, " << total.files << " files, " << total.bytes
+                << " bytes (largest file " << total.largest << " bytes)\n";
+        }
+
+        // Save the file system as a binary image (format described in Image.h). The image
+        // is written next to filename and renamed over it, so a lazily loaded image that is
+        // still mapped is never modified in place.
+        // The image holds the tree as it was when the save started. Other threads only
+        // wait for the commands in flight at the start and at the end; while the image is
+        // written they keep going, and a Snapshot keeps the old version of whatever they
+        // change.
+        // Saving the journaled image is a checkpoint and starts a new generation. Records
+        // journaled while it runs go to a second log, which replaces the journal once the
+        // image is in place (see Journal::rotate).
+        // Saves are incremental: subtrees not marked dirty since the previous save are
+        // copied byte for byte from the previous image, so the cost follows the amount of
+        // changed data rather than the size of the tree.
+        // Returns false if the image could not be written; callers report it.
+        bool saveToFile(const string& filename) {
+            lock_guard<mutex> saving(saveLock);
+            bool checkpoint = journaling && filename == journalImage;
+            Snapshot current;
+            {
+                unique_lock<shared_mutex> barrier(checkpointLock); // Wait for in-flight mutations to finish
+                snapshot = &current;
+                if (checkpoint) journal.rotate(generation + 1);
+            }
+
+            vector<ImagePlacement> placed;
+            ImageChunks chunks;
+            bool saved = writeImage(filename, current, placed, chunkedImages() ? &chunks : nullptr);
+            shared_ptr<const MappedImage> image = saved ? MappedImage::open(filename) : nullptr;
+
+            unique_lock<shared_mutex> barrier(checkpointLock);
+            snapshot = nullptr;
+            if (checkpoint) journal.finishRotate(saved);
+            if (!saved) return false;
+            // Children come before their parents, so a parent sees its children's new flags
+            for (const ImagePlacement& place : placed) {
+                Directory* dir = place.dir;
+                dir->imageOffset = place.offset;
+                dir->imageLength = place.length;
+                if (place.encoded) {
+                    // Still dirty if it changed after the snapshot, since the image holds the old version
+                    bool dirty = current.changed(*dir);
+                    for (auto& d : dir->subdirectories) dirty = dirty || d.second.dirty;
+                    dir->dirty = dirty;
+                }
+            }
+            savedImage = image;
+            savedChunked = chunkedImages();
+            savedChunks = move(chunks.table);
+            imageContentBytes = chunks.contentBytes;
+            imageChunkBytes = chunks.chunkBytes;
+            if (checkpoint || !journaling) generation++; // A backup leaves the journal's generation alone
+            return true;
+        }
+
+        // Start saving to filename on the background thread and return at once, with a
+        // ticket for waitSaved. With a journal on filename there is nothing to start: the
+        // journal's writer already puts every change on disk, and checkpoints rewrite the
+        // image.
+        uint64_t saveInBackground(const string& filename) {
+            if (journaling && filename == journalImage) return persister.latest();
+            return persister.request(filename);
+        }
+
+        // Block until the background save with this ticket is over; false if it failed
+        bool waitSaved(uint64_t ticket) {
+            return persister.wait(ticket);
+        }
+
+        // Make everything done so far durable and wait for it. With a journal on filename
+        // that means flushing the log and letting queued checkpoints finish; otherwise the
+        // tree is saved, by a save queued now or one queued earlier that has not started.
+        bool sync(const string& filename) {
+            if (!journaling || filename != journalImage) return persister.wait(persister.request(filename));
+            journal.sync();
+            return persister.wait(persister.latest());
+        }
+
+        // Journal every mutating command to <imageName>.journal from now on. Call once,
+        // after loadFromFile(imageName) and before worker threads start. With waitForDisk,
+        // commit() blocks until a command's records are on disk. A journal that cannot be
+        // opened is reported to messages.
+        bool enableJournal(const string& imageName, bool waitForDisk = true, ostream& messages = cout) {
+            journalImage = imageName;
+            syncCommits = waitForDisk;
+            journaling = journal.open(imageName + ".journal", generation, journalValidLength);
+            if (!journaling) messages << "Failed to open journal. Changes will only be saved on exit.\n";
+            return journaling;
+        }
+
+        void setCheckpointThreshold(uint64_t bytes) {
+            checkpointBytes = bytes;
+        }
+
+        // Finishes queued saves first, since a checkpoint needs the journal
+        void closeJournal() {
+            persister.stop();
+            journal.close();
+        }
+
+        // Call after every command, with no locks held. Waits for the command's journal
+        // records when commits are synchronous, and queues a checkpoint on the background
+        // thread once the journal has grown past checkpointBytes.
+        void commit(Session& session) {
+            if (!journaling || session.journalSeq == 0) return;
+            if (syncCommits) journal.waitDurable(session.journalSeq);
+            session.journalSeq = 0;
+            if (journal.size() > checkpointBytes && !checkpointing.exchange(true)) persister.request(journalImage);
+        }
+
+        // Append a record for a mutation session made in dir. Call while still holding
+        // the locks that ordered the mutation, so the log has the same order.
+        void record(Session& session, Directory* dir, JournalRecord entry) {
+            if (!journaling) return;
+            entry.dir = pathOf(dir);
+            if (session.transaction) session.transaction->records.push_back(move(entry)); // Appended on commit
+            else session.journalSeq = journal.append(entry);
+        }
+
+        // Register the inverse of a change the session just made, if it is inside a transaction
+        template <typename Step>
+        static void onRollback(const Session& session, Step step) {
+            if (session.transaction) session.transaction->onRollback(move(step));
+        }
+
+        // Run body as one transaction over the directories plan returns: those are locked
+        // up front, and every command in body runs without taking them again. plan runs
+        // once more with the locks held and must name the same directories, otherwise the
+        // tree changed in between (or a directory it looks through is busy, reported as a
+        // nullptr) and both steps start over. If body fails, its changes are undone and the
+        // session goes back to its starting directory; if it succeeds, its journal records
+        // go to the log as one frame.
+        bool transact(Session& session, const function<vector<Directory*>()>& plan, const function<bool()>& body) {
+            while (true) {
+                Transaction transaction(checkpointLock, plan());
+                session.transaction = &transaction;
+                if (!transaction.covers(plan())) {
+                    session.transaction = nullptr;
+                    continue;
+                }
+
+                Directory* startDir = session.currentDir;
+                bool committed = body();
+                if (committed) {
+                    if (!transaction.records.empty()) session.journalSeq = journal.append(transaction.records);
+                } else {
+                    transaction.rollback();
+                    session.currentDir = startDir;
+                }
+                session.transaction = nullptr;
+                return committed;
+            }
+        }
     
-        void saveDir(ofstream& fout, Directory& dir) {
-            fout << "DIR " << dir.name << endl; // Write directory name
-            for (auto& f : dir.files) {
-                fout << "FILE " << f.second.name << " " << f.second.content << endl; // Write file name and content
+        // Body of the persister's thread
+        bool backgroundSave(const string& filename) {
+            bool saved = saveToFile(filename);
+            if (journaling && filename == journalImage) checkpointing = false; // Commits may queue the next one
+            return saved;
+        }
+
+        // Write the image for snapshot to a temporary file and rename it over filename.
+        // With chunks, the image is chunked and chunks gathers what its table holds.
+        bool writeImage(const string& filename, const Snapshot& snapshot, vector<ImagePlacement>& placed, ImageChunks* chunks) {
+            string tempName = filename + ".tmp";
+            ImageFile file;
+            if (!file.open(tempName)) return false;
+            ostream fout(&file);
+            ImageWriter writer(fout);
+            writer.header(generation + 1, chunks ? IMAGE_CHUNKED : 0);
+            saveDir(writer, snapshot, root, 0, 0, placed, chunks);
+            if (chunks) {
+                uint64_t offset = uint64_t(fout.tellp());
+                writer.u64(chunks->entries.size());
+                offset += 8;
+                for (const ImageChunks::Entry& entry : chunks->entries) {
+                    size_t header = CHUNK_REF_SIZE;
+                    if (entry.compressed) {
+                        writer.chunkRef(entry.id, entry.storedLength | CHUNK_COMPRESSED);
+                        writer.u32(entry.length);
+                        header += 4;
+                    } else {
+                        writer.chunkRef(entry.id, entry.length);
+                    }
+                    fout.write(entry.bytes, entry.storedLength); // Compressed chunks go out as they are
+                    chunks->table.add(entry.id, {offset + header, entry.length, entry.storedLength, entry.compressed});
+                    offset += header + entry.storedLength;
+                }
             }
-            for (auto& d : dir.subdirectories) {
-                saveDir(fout, d.second); // Recursively save subdirectories
+            // On disk before the rename, so a crash leaves either image whole
+            bool written = fout.good() && file.commit();
+            error_code error;
+            if (written) filesystem::rename(tempName, filename, error);
+            if (!written || error) {
+                file.close();
+                remove(tempName.c_str());
+                return false;
             }
-            fout << "ENDDIR\n"; // Mark the end of the directory
+            syncDirectoryOf(filename);
+            return true;
+        }
+
+        // Write dir's record as of snapshot and add where it went to placed, after its
+        // subdirectories. oldParent and newParent are where the parent's record starts
+        // in savedImage and in the new image. Locks one directory at a time, so commands
+        // keep running; saveLock keeps every directory in place meanwhile. With chunks,
+        // contents are written as chunk lists and their chunks added to chunks.
+        void saveDir(ImageWriter& writer, const Snapshot& snapshot, Directory& dir, uint64_t oldParent, uint64_t newParent,
+                     vector<ImagePlacement>& placed, ImageChunks* chunks) {
+            uint64_t oldStart = oldParent + dir.imageOffset;
+            uint64_t start = uint64_t(writer.stream().tellp());
+            // Clean now means unchanged since savedImage, and so since the snapshot as well.
+            // Records only carry over into an image that stores contents the same way.
+            bool unchanged = savedImage && !dir.dirty && dir.imageLength > 0 &&
+                             oldStart + dir.imageLength <= savedImage->size() && savedChunked == (chunks != nullptr);
+            if (unchanged) {
+                writer.stream().write(savedImage->data() + oldStart, dir.imageLength); // Copy the whole subtree
+                if (chunks) {
+                    ImageReader reader(savedImage->data(), savedImage->size());
+                    reader.seek(oldStart);
+                    collectChunks(reader, *chunks);
+                }
+            } else {
+                DirectoryVersion entries;
+                {
+                    shared_lock<shared_mutex> guard(dir.lock);
+                    entries = snapshot.entries(dir);
+                }
+                writer.beginDirectory(dir.name(), uint32_t(entries.files.size()), uint32_t(entries.subdirectories.size()));
+                for (auto& f : entries.files) {
+                    writer.fileHeader(f.first, f.second.size()); // Write file name and content
+                    if (chunks) writeChunkList(writer, f.second, *chunks);
+                    else f.second.writeTo(writer.stream());
+                }
+                for (auto& d : entries.subdirectories) {
+                    saveDir(writer, snapshot, *d.second, oldStart, start, placed, chunks); // Recursively save subdirectories
+                }
+                writer.endDirectory(streampos(start)); // Record the length of the whole subtree
+            }
+            placed.push_back({&dir, start - newParent, uint64_t(writer.stream().tellp()) - start, !unchanged});
+        }
+
+        // Write version's content as a chunk list. Content still in an unchunked image is
+        // cut into blocks the way a Rope would hold it. Blocks of files that should be
+        // compressed and are not yet go into the image compressed, except the last one,
+        // as Rope::pack would leave them.
+        void writeChunkList(ImageWriter& writer, const FileVersion& version, ImageChunks& chunks) {
+            vector<pair<ChunkId, uint32_t>> list;
+            bool compress = packing.compress && version.size() >= packing.minFileSize;
+            auto addBlock = [&](const ChunkRef& chunk, bool last) {
+                ChunkRef stored = chunk;
+                if (compress && !last && !chunk->compressed) {
+                    if (Chunk* packed = chunk->compress(packing.minSavingPercent)) stored = ChunkRef(packed);
+                }
+                // Hashed chunks know their id; others can still change, so it is not kept
+                ChunkId id = stored->hash();
+                list.emplace_back(id, uint32_t(stored->size()));
+                chunks.add(id, stored);
+            };
+            if (version.image) {
+                for (uint64_t done = 0; done < version.imageLength; done += Rope::BLOCK_SIZE) {
+                    uint32_t length = uint32_t(min<uint64_t>(Rope::BLOCK_SIZE, version.imageLength - done));
+                    addBlock(ChunkRef(new Chunk(version.image, version.image->data() + version.imageOffset + done, length)),
+                             done + length == version.imageLength);
+                }
+            } else {
+                size_t done = 0;
+                version.content.forEachChunk([&](const ChunkRef& chunk) {
+                    done += chunk->size();
+                    addBlock(chunk, done == version.size());
+                });
+            }
+            writer.u32(uint32_t(list.size()));
+            for (auto& entry : list) writer.chunkRef(entry.first, entry.second);
+            chunks.contentBytes += version.size();
+        }
+
+        // Add the chunks of the savedImage directory record at the reader's position,
+        // subdirectories included, to chunks
+        void collectChunks(ImageReader& reader, ImageChunks& chunks) {
+            reader.u64();
+            uint32_t nameLength = reader.u32();
+            uint32_t fileCount = reader.u32();
+            uint32_t subdirCount = reader.u32();
+            reader.bytes(nameLength);
+            for (uint32_t i = 0; i < fileCount && reader.ok(); i++) {
+                nameLength = reader.u32();
+                chunks.contentBytes += reader.u64();
+                reader.bytes(nameLength);
+                uint32_t chunkCount = reader.u32();
+                for (uint32_t c = 0; c < chunkCount && reader.ok(); c++) {
+                    ChunkId id = reader.chunkId();
+                    uint32_t length = reader.u32();
+                    if (const ChunkTable::Entry* entry = savedChunks.find(id, length)) {
+                        chunks.add(id, ChunkRef(), savedImage, savedImage->data() + entry->offset, length, entry->storedLength,
+                                   entry->compressed);
+                    }
+                }
+            }
+            for (uint32_t i = 0; i < subdirCount && reader.ok(); i++) collectChunks(reader, chunks);
         }
     
-        // Load the file system
-        void loadFromFile(const string& filename) {
-            ifstream fin(filename);
-            if (!fin) {
-                cout << "No save file found. Starting new filesystem.\n"; // Handle missing save file
-                return;
+        // Load the file system; call before any Session is created, since it rebuilds the tree.
+        // Binary images are memory-mapped and decoded in place. In LoadMode::Lazy only the
+        // tree is built up front and each file keeps pointing into the image until first
+        // used; files of a chunked image are built from chunks that stay in the image. A
+        // legacy text save is parsed, kept as <filename>.legacy and rewritten in the binary
+        // format. What happened (a new file system, a conversion, replayed commands) is
+        // reported to messages.
+        void loadFromFile(const string& filename, LoadMode mode = LoadMode::Eager, ostream& messages = cout) {
+            shared_ptr<const MappedImage> image = MappedImage::open(filename);
+            clearTree();
+            generation = 0;
+            savedImage.reset();
+            savedChunked = false;
+            savedChunks.clear();
+            imageContentBytes = imageChunkBytes = 0;
+            if (!image) {
+                messages << "No save file found. Starting new filesystem.\n"; // Handle missing save file
+            } else if (isBinaryImage(image->data(), image->size())) {
+                ImageReader reader(image->data(), image->size());
+                bool valid = reader.header();
+                root.imageOffset = reader.position(); // The root record follows the header, which is shorter in version 1
+                ChunkLoader chunks{image, mode == LoadMode::Lazy, {}};
+                if (valid && reader.chunked()) valid = loadChunkTable(image, reader.position());
+                if (!valid || !loadDir(reader, &root, mode == LoadMode::Lazy ? image : nullptr, reader.chunked() ? &chunks : nullptr)) {
+                    messages << "Save file is corrupt or from a newer version. Starting new filesystem.\n";
+                    clearTree();
+                    savedChunks.clear();
+                    imageContentBytes = imageChunkBytes = 0;
+                } else {
+                    savedImage = image; // Later saves copy unchanged subtrees from here
+                    savedChunked = reader.chunked();
+                }
+                generation = reader.generation();
+            } else {
+                istringstream legacy(string(image->data(), image->size()));
+                image.reset(); // Release the mapping before the file is renamed
+                loadLegacyDir(legacy, &root);
+                string backup = filename + ".legacy";
+                remove(backup.c_str());
+                if (rename(filename.c_str(), backup.c_str()) == 0) {
+                    if (saveToFile(filename)) messages << "Converted " << filename << " to the binary format (original kept as " << backup << ").\n";
+                    else messages << "Failed to save " << filename << " in the binary format (original kept as " << backup << ").\n";
+                }
+            }
+
+            // Bring the tree up to date with commands journaled after the image was written
+            int replayed = 0;
+            auto apply = [&](const JournalRecord& entry) {
+                applyRecord(entry);
+                replayed++;
+            };
+            journalValidLength = Journal::replay(filename + ".journal", generation, apply);
+            // A checkpoint that did not finish leaves the records journaled while it ran in
+            // a second log, written for the image it was saving. That image is either
+            // already in place or follows the journal just replayed.
+            uint64_t nextGeneration = journalValidLength > 0 ? generation + 1 : generation;
+            bool unfinishedCheckpoint = Journal::replay(filename + ".journal.next", nextGeneration, apply) > 0;
+            if (replayed > 0) messages << "Replayed " << replayed << " journaled commands.\n";
+            // Fold both logs into the image; the journal then starts empty
+            if (unfinishedCheckpoint && !saveToFile(filename)) messages << "Failed to save " << filename << " after replaying its journal.\n";
+        }
+
+        // Re-apply a journaled command during replay, before any Session exists
+        void applyRecord(const JournalRecord& entry) {
+            Directory* dir = replayDirectory(entry.dir);
+            if (!dir) return;
+            dir->markDirty();
+            auto it = dir->files.find(entry.name);
+            File* file = it != dir->files.end() ? &it->second : nullptr;
+            string target;
+            Directory* to = nullptr; // Where a move lands
+            if (entry.op == JournalOp::Move || entry.op == JournalOp::MoveDir) {
+                if (entry.target.find('/') == string::npos) {
+                    target = entry.target;
+                    to = dir;
+                } else {
+                    to = replayDirectory(parentPath({""}, entry.target, target));
+                }
+                if (!to) return;
+            }
+            switch (entry.op) {
+                case JournalOp::Create: dir->addFile(entry.name); break;
+                case JournalOp::Delete: dir->files.erase(entry.name); break;
+                case JournalOp::Mkdir: dir->addSubdirectory(entry.name); break;
+                case JournalOp::Move:
+                    relinkFile(dir, entry.name, to, target);
+                    to->markDirty();
+                    break;
+                case JournalOp::MoveDir:
+                    if (dir->subdirectories.count(entry.name) && !to->subdirectories.count(target)) relinkDirectory(dir, entry.name, to, target);
+                    break;
+                case JournalOp::Write: if (file) file->write_to_file(entry.text); break;
+                case JournalOp::WriteAt: if (file) file->write_at(int(entry.a), entry.text); break;
+                case JournalOp::MoveWithin: if (file) file->move_within_file(int(entry.a), int(entry.b), int(entry.c)); break;
+                case JournalOp::Truncate: if (file) file->truncate_file(int(entry.a)); break;
+            }
+        }
+
+        // Directory at path during replay, when nothing else runs, or nullptr
+        Directory* replayDirectory(const vector<string>& path) {
+            Directory* dir = &root;
+            for (size_t i = 1; i < path.size() && dir; i++) {
+                auto it = dir->subdirectories.find(path[i]);
+                dir = it != dir->subdirectories.end() ? &it->second : nullptr;
+            }
+            return dir;
+        }
+
+        // Move a file from one directory to another (or within one) by relinking its map
+        // node; both must be locked exclusively. A file already called target is replaced,
+        // and handed to the caller through replaced.
+        static bool relinkFile(Directory* from, const string& source, Directory* to, const string& target, FileNode* replaced = nullptr) {
+            auto node = from->files.extract(source); // Detach the source file without copying it
+            if (node.empty()) return false;
+            node.key() = target; // Rename the file; its name() is this key
+            FileNode old = to->files.extract(target); // Moving over an existing file replaces it
+            if (replaced) *replaced = move(old);
+            to->files.insert(move(node)); // Add the moved file to the map
+            return true;
+        }
+
+        // Move a subdirectory of from into to as target by relinking its map node. The
+        // subtree stays where it is in memory, so only its parent pointer changes. Call
+        // with checkpointLock and layoutLock held exclusively (or during replay).
+        void relinkDirectory(Directory* from, const string& source, Directory* to, const string& target) {
+            auto node = from->subdirectories.extract(source);
+            Directory* moved = &node.mapped();
+            pathCache.erase(pathKey(moved));
+            // The subtree can still be copied from the saved image on the next save if its
+            // offset is re-based on the new parent, which must itself be in the image
+            uint64_t oldStart, parentStart;
+            bool inImage = savedImage && imageStart(moved, oldStart) && imageStart(to, parentStart);
+            node.key() = target;
+            moved->parent = to;
+            to->subdirectories.insert(move(node));
+            if (inImage) moved->imageOffset = oldStart - parentStart; // May wrap; saveDir adds it back
+            else forgetImage(*moved);
+            moved->markDirty(); // Its own record holds its name
+            from->markDirty();
+            to->markDirty(); // markDirty stops at dirty directories, and moved may have been one
+        }
+
+        // Where dir's record starts in savedImage, if dir and every ancestor are in it
+        static bool imageStart(const Directory* dir, uint64_t& start) {
+            start = 0;
+            for (; dir; dir = dir->parent) {
+                if (dir->imageLength == 0) return false;
+                start += dir->imageOffset;
+            }
+            return true;
+        }
+
+        // Take a subtree out of the saved image, so the next save encodes all of it
+        static void forgetImage(Directory& dir) {
+            dir.imageLength = 0;
+            dir.dirty = true;
+            for (auto& d : dir.subdirectories) forgetImage(d.second);
+        }
+    
+        // Index the chunk table of a chunked image, which follows the root record at rootStart
+        bool loadChunkTable(const shared_ptr<const MappedImage>& image, size_t rootStart) {
+            ImageReader reader(image->data(), image->size());
+            reader.header(); // The table's layout depends on the version
+            reader.seek(rootStart);
+            reader.seek(rootStart + reader.u64());
+            if (!reader.ok() || !savedChunks.read(reader)) return false;
+            imageChunkBytes = savedChunks.bytes();
+            return true;
+        }
+
+        // Chunk id of the image chunks is loading, or an empty reference if the image has no such chunk
+        ChunkRef loadChunk(ChunkLoader& chunks, const ChunkId& id, uint32_t length) {
+            auto it = chunks.loaded.find(id);
+            if (it != chunks.loaded.end()) return it->second;
+            const ChunkTable::Entry* entry = savedChunks.find(id, length);
+            if (!entry) return ChunkRef();
+            shared_ptr<const MappedImage> view = chunks.view ? chunks.image : nullptr;
+            ChunkRef chunk(new Chunk(view, chunks.image->data() + entry->offset, entry->storedLength));
+            chunk->compressed = entry->compressed; // Kept packed, as the image holds it
+            chunk->rawLength = entry->compressed ? length : 0;
+            chunk->id = id;
+            chunk->hashed = true;
+            if (dedup) chunkStore.intern(chunk);
+            chunks.loaded.emplace(id, chunk);
+            return chunk;
+        }
+
+        // Decode one directory record into dir, which must be empty. File contents are
+        // copied, or left in lazyImage when one is given. Chunked images are decoded
+        // through chunks instead.
+        bool loadDir(ImageReader& reader, Directory* dir, const shared_ptr<const MappedImage>& lazyImage, ChunkLoader* chunks) {
+            size_t start = reader.position();
+            uint64_t segmentLength = reader.u64();
+            uint32_t nameLength = reader.u32();
+            uint32_t fileCount = reader.u32();
+            uint32_t subdirCount = reader.u32();
+            reader.bytes(nameLength); // The caller already created dir under this name
+            for (uint32_t i = 0; i < fileCount && reader.ok(); i++) {
+                nameLength = reader.u32();
+                uint64_t contentLength = reader.u64();
+                string name = reader.str(nameLength);
+                if (chunks) {
+                    File* file = reader.ok() ? dir->addFile(name) : nullptr;
+                    if (!file) return false; // Duplicate name
+                    uint32_t chunkCount = reader.u32();
+                    for (uint32_t c = 0; c < chunkCount && reader.ok(); c++) {
+                        ChunkId id = reader.chunkId();
+                        ChunkRef chunk = loadChunk(*chunks, id, reader.u32());
+                        if (!chunk) return false; // Not in the chunk table
+                        file->content.appendChunk(move(chunk));
+                    }
+                    imageContentBytes += contentLength;
+                    if (!reader.ok() || file->content.size() != contentLength) return false;
+                    if (packing.compress && !lazyImage) file->content.pack(packing, true);
+                    continue;
+                }
+                size_t contentOffset = reader.position();
+                const char* content = reader.bytes(contentLength);
+                if (!reader.ok()) return false;
+                // Records are saved in map order, so with ordered maps each insert lands at the end
+                File* file = dir->addFile(name);
+                if (!file) return false; // Duplicate name
+                if (lazyImage && contentLength > 0) {
+                    file->setLazyContent(lazyImage, contentOffset, contentLength);
+                } else {
+                    file->content.append(content, contentLength);
+                    if (packing.compress) file->content.pack(packing, true);
+                }
+            }
+            for (uint32_t i = 0; i < subdirCount && reader.ok(); i++) {
+                string name = peekDirName(reader);
+                Directory* child = dir->addSubdirectory(name);
+                if (!child) return false; // Duplicate name
+                size_t childStart = reader.position();
+                if (!loadDir(reader, child, lazyImage, chunks)) return false; // Recursively load subdirectories
+                child->imageOffset = childStart - start;
             }
-            root = Directory("root", nullptr); // Reset the root directory
-            currentDir = &root; // Reset the current directory
-            loadDir(fin, &root); // Load the root directory and its contents
-            fin.close();
+            dir->imageLength = segmentLength;
+            dir->dirty = false; // Matches its record until something changes it
+            return reader.ok() && reader.position() - start == segmentLength;
         }
     
-        void loadDir(ifstream& fin, Directory* dir) {
+        // Name of the directory record at the reader's position, without consuming it
+        static string peekDirName(ImageReader reader) {
+            reader.u64();
+            uint32_t nameLength = reader.u32();
+            reader.u32();
+            reader.u32();
+            return reader.str(nameLength);
+        }
+    
+        // Parser for the original text format (FILE name content / DIR name / ENDDIR)
+        void loadLegacyDir(istream& fin, Directory* dir) {
             string type, name, content;
             while (fin >> type) {
                 if (type == "DIR") {
                     fin >> name;
-                    dir->subdirectories[name] = Directory(name, dir); // Create a new subdirectory
-                    loadDir(fin, &dir->subdirectories[name]); // Recursively load subdirectories
+                    Directory* child = dir->addSubdirectory(name); // Create a new subdirectory
+                    if (!child) child = &dir->subdirectories.find(name)->second; // Repeated names are merged
+                    loadLegacyDir(fin, child); // Recursively load subdirectories
                 } else if (type == "FILE") {
                     fin >> name;
                     getline(fin, content);
                     if (!content.empty() && content[0] == ' ') content = content.substr(1); // Remove leading space
-                    dir->files[name] = File(name); // Create a new file
-                    dir->files[name].content = content; // Set file content
+                    File* file = dir->addFile(name); // Create a new file
+                    if (!file) file = &dir->files.find(name)->second;
+                    file->content = content; // Set file content
                 } else if (type == "ENDDIR") {
                     break; // End of the current directory
                 }
             }
         }
+    
+        void clearTree() {
+            unique_lock<shared_mutex> guard(root.lock);
+            root.files.clear(); // Reset the root directory
+            root.subdirectories.clear();
+            pathCache.clear(); // Every cached directory is gone
+            root.imageLength = 0;
+            root.dirty = true;
+        }
+
+    private:
+        // Walk for lookupDir, with layoutLock held. A cached path costs one hash lookup;
+        // otherwise the walk starts from the deepest cached ancestor and caches every
+        // directory it passes. See subdirectory for busy.
+        Directory* findDir(const Session& session, const vector<string>& path, bool* busy) {
+            if (path.size() <= 1) return &root;
+            string key;
+            vector<size_t> ends(path.size(), 1); // Length of the key for each prefix of path
+            for (size_t i = 1; i < path.size(); i++) {
+                key += '/';
+                key += path[i];
+                ends[i] = key.size();
+            }
+            Directory* dir = pathCache.find(key);
+            if (dir) return dir;
+            size_t known = path.size() - 1; // path[1..known) is resolved
+            for (; known > 1; known--) {
+                dir = pathCache.find(key.substr(0, ends[known - 1]));
+                if (dir) break;
+            }
+            if (!dir) dir = &root;
+            for (size_t i = known; i < path.size() && dir; i++) {
+                dir = subdirectory(session, dir, path[i], busy);
+                // A transaction may still roll back the directories it creates, so only
+                // sessions outside one add to the cache
+                if (dir && !session.transaction) pathCache.insert(key.substr(0, ends[i]), dir);
+            }
+            return dir;
+        }
+
+        // Add up the files below dir for showDedupStats, counting each chunk's stored bytes
+        // once in unique however many blocks share it. Keeps each directory read-locked
+        // while it walks below it.
+        void countChunks(Directory* dir, unordered_map<const Chunk*, ChunkRef>& seen, uint64_t& files, uint64_t& logical,
+                         uint64_t& unique, uint64_t& notLoaded, uint64_t& compressed) {
+            shared_lock<shared_mutex> guard(dir->lock);
+            for (auto& f : dir->files) {
+                FileVersion version;
+                {
+                    shared_lock<shared_mutex> fileGuard(f.second.lock);
+                    version = f.second.version(); // O(1); the blocks are walked without the lock
+                }
+                files++;
+                if (version.image) {
+                    notLoaded += version.size();
+                    continue;
+                }
+                version.content.forEachChunk([&](const ChunkRef& chunk) {
+                    logical += chunk->size();
+                    if (!seen.emplace(chunk.get(), chunk).second) return;
+                    unique += chunk->storedSize();
+                    if (chunk->compressed) compressed++;
+                });
+            }
+            for (auto& d : dir->subdirectories) countChunks(&d.second, seen, files, logical, unique, notLoaded, compressed);
+        }
+
+        // What find collects in one directory
+        struct Matches {
+            string lines;
+            size_t count = 0;
+        };
+
+        // What du collects in one directory, or in a whole subtree once added up
+        struct Usage {
+            uint64_t dirs = 1;
+            uint64_t files = 0;
+            uint64_t bytes = 0;
+            uint64_t largest = 0;
+
+            void add(const Usage& other) {
+                dirs += other.dirs;
+                files += other.files;
+                bytes += other.bytes;
+                largest = max(largest, other.largest);
+            }
+        };
+
+        static void printMap(ostream& out, const WalkNode<string>& node) {
+            for (auto& child : node.children) {
+                out << string(2 * node.depth, ' ') << "[DIR] " << child.name << "\n";
+                printMap(out, child);
+            }
+            out << node.output;
+        }
+
+        // A file grep searches, and what it found
+        struct GrepTarget {
+            string path;
+            FileVersion version;
+            vector<size_t> offsets; // The first GREP_MAX_OFFSETS
+            size_t count = 0;
+        };
+
+        static const size_t GREP_MAX_OFFSETS = 16; // Offsets listed per file
+        static const size_t GREP_BATCH_BYTES = 256 << 10; // Content searched per task
+
+        static void collectTargets(WalkNode<vector<GrepTarget>>& node, vector<GrepTarget*>& targets) {
+            for (GrepTarget& target : node.output) targets.push_back(&target);
+            for (auto& child : node.children) collectTargets(child, targets);
+        }
+
+        static void searchTarget(GrepTarget& target, const string& pattern) {
+            SubstringSearch search(pattern);
+            target.version.stream([&](string_view piece) {
+                search.feed(piece, [&](size_t offset) {
+                    if (target.offsets.size() < GREP_MAX_OFFSETS) target.offsets.push_back(offset);
+                    target.count++;
+                    return true;
+                });
+            });
+        }
+
+        static size_t printMatches(ostream& out, const WalkNode<Matches>& node) {
+            out << node.output.lines;
+            size_t count = node.output.count;
+            for (auto& child : node.children) count += printMatches(out, child);
+            return count;
+        }
+
+        // File count and length of every directory from dir down, each file locked just
+        // long enough to read its length
+        WalkNode<Usage> usage(const Session& session, Directory* dir) {
+            WalkNode<Usage> tree;
+            {
+                shared_lock<shared_mutex> layout = lockLayout(session);
+                tree.path = pathKey(dir);
+            }
+            walkTree(walkPool, dir, tree, [](const Directory& dir, WalkNode<Usage>& node) {
+                for (auto& f : dir.files) {
+                    shared_lock<shared_mutex> fileGuard = Stats::acquire<shared_lock<shared_mutex>>(f.second.lock, LockKind::File);
+                    uint64_t size = f.second.size();
+                    node.output.files++;
+                    node.output.bytes += size;
+                    node.output.largest = max(node.output.largest, size);
+                }
+            });
+            return tree;
+        }
+
+        // Totals of the subtree under node
+        static Usage addUsage(const WalkNode<Usage>& node) {
+            Usage total = node.output;
+            for (auto& child : node.children) total.add(addUsage(child));
+            return total;
+        }
+
+        static Usage printUsage(ostream& out, const WalkNode<Usage>& node) {
+            Usage total = node.output;
+            for (auto& child : node.children) total.add(printUsage(out, child));
+            out << total.bytes << "\t" << total.files << " files\t" << (node.path.empty() ? "/" : node.path) << "\n";
+            return total;
+        }
+
+        // Lock helpers that skip locks held by the session's transaction
+        shared_lock<shared_mutex> lockCheckpoint(const Session& session) {
+            if (session.transaction) return shared_lock<shared_mutex>();
+            return Stats::acquire<shared_lock<shared_mutex>>(checkpointLock, LockKind::Checkpoint);
+        }
+
+        // Apply a batch of queued appends under one hold of file's lock and journal them as
+        // one frame; returns the frame's sequence number. Every appender in the batch holds
+        // checkpointLock and dir's lock shared until it is done.
+        uint64_t applyAppends(Directory* dir, File* file, const vector<AppendQueue::Request*>& batch) {
+            unique_lock<shared_mutex> writing = Stats::acquire<unique_lock<shared_mutex>>(file->lock, LockKind::File);
+            size_t oldSize = file->size();
+            preserve(file);
+            file->unpublish();
+            dir->markDirty();
+            if (batch.size() > 1 && !file->appendOptimized()) file->optimizeForAppends(); // Appended to from several sessions, like a log
+            for (AppendQueue::Request* request : batch) file->write_to_file(*request->text);
+            uint64_t seq = 0;
+            if (journaling) {
+                vector<string> path = pathOf(dir);
+                vector<JournalRecord> records;
+                records.reserve(batch.size());
+                for (AppendQueue::Request* request : batch) {
+                    records.emplace_back(JournalOp::Write, file->name(), *request->text);
+                    records.back().dir = path;
+                }
+                seq = journal.append(records);
+            }
+            packAppended(file, oldSize);
+            return seq;
+        }
+
+        // What a write handle does with the blocks an append changed (see ~FileRef)
+        void packAppended(File* file, size_t oldSize) {
+            if (!packing.store && !packing.compress) return;
+            file->content.pack(packing, packing.compress && oldSize < packing.minFileSize, file->appendOptimized());
+        }
+
+        // Keep the old version of dir's entries or file's content for a save in progress.
+        // Call before changing them, with them locked exclusively and checkpointLock held.
+        void preserve(const Directory* dir) {
+            if (snapshot) snapshot->preserve(*dir);
+        }
+
+        void preserve(const File* file) {
+            if (snapshot) snapshot->preserve(*file);
+        }
+
+        // A transaction's checkpoint lock already keeps directories from moving, and
+        // taking layoutLock after its directory locks would invert the lock order
+        shared_lock<shared_mutex> lockLayout(const Session& session) const {
+            if (session.transaction) return shared_lock<shared_mutex>();
+            return Stats::acquire<shared_lock<shared_mutex>>(layoutLock, LockKind::Layout);
+        }
+
+        static shared_lock<shared_mutex> lockShared(const Session& session, Directory* dir) {
+            if (session.transaction && session.transaction->holds(dir)) return shared_lock<shared_mutex>();
+            return Stats::acquire<shared_lock<shared_mutex>>(dir->lock, LockKind::Directory);
+        }
+
+        static unique_lock<shared_mutex> lockExclusive(const Session& session, Directory* dir) {
+            if (session.transaction && session.transaction->holds(dir)) return unique_lock<shared_mutex>();
+            return Stats::acquire<unique_lock<shared_mutex>>(dir->lock, LockKind::Directory);
+        }
+
+        // Both directories, in Transaction's lock order; a directory passed twice is
+        // locked once. Call with the checkpoint lock held, which keeps depths stable.
+        static pair<unique_lock<shared_mutex>, unique_lock<shared_mutex>> lockExclusive(const Session& session, Directory* a, Directory* b) {
+            if (a == b) return {lockExclusive(session, a), unique_lock<shared_mutex>()};
+            if (Transaction::lockOrder(b, a)) swap(a, b);
+            unique_lock<shared_mutex> first = lockExclusive(session, a);
+            return {move(first), lockExclusive(session, b)};
+        }
     };
\ No newline at end of file
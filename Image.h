@@ -0,0 +1,457 @@
+#pragma once
+
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <cstdint>
+#include <cstring>
+#include <cerrno>
+#include <vector>
+#include <streambuf>
+#include <algorithm>
+#include "Chunk.h"
+using namespace std;
+
+#ifdef _WIN32
+#include <io.h>
+#include <fcntl.h>
+#else
+#include <fcntl.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#endif
+
+
+// Binary save image written to dil.dat. All integers are little-endian.
+//
+//   header     "FSIMAGE\0" | u32 version | u32 flags | u64 generation
+//   directory  u64 segmentLength | u32 nameLength | u32 fileCount | u32 subdirCount | name
+//              fileCount   x (u32 nameLength | u64 contentLength | name | content)
+//              subdirCount x directory
+//
+// segmentLength counts the whole directory record, nested subdirectories included,
+// so a reader can skip a subtree without parsing it. The root directory follows
+// the header directly. generation counts checkpoints and ties the image to the
+// journal written on top of it; version 1 images have no generation field and
+// are read as generation 0.
+//
+// With IMAGE_CHUNKED in flags (version 3 and up), a file record's content is a list
+// of chunks and the chunk bytes follow the root directory, each distinct chunk once:
+//
+//   content    u32 chunkCount | chunkCount x (u64 idLow | u64 idHigh | u32 length)
+//   chunks     u64 chunkCount | chunkCount x (u64 idLow | u64 idHigh | u32 length | bytes)
+//
+// contentLength is still the length of the file. Chunks are referred to by id (see
+// ChunkId), not by position, so directory records stay valid when they are copied
+// into a later image.
+//
+// In version 4 and up, a table entry whose length has CHUNK_COMPRESSED set holds the
+// chunk packed by lzCompress (see Compress.h); the rest of the length counts the
+// packed bytes, and the chunk's own length comes first:
+//
+//   packed     u64 idLow | u64 idHigh | u32 (packedLength | CHUNK_COMPRESSED) | u32 length | bytes
+//
+// Chunk lists always give the unpacked length.
+const char IMAGE_MAGIC[8] = {'F', 'S', 'I', 'M', 'A', 'G', 'E', '\0'};
+const uint32_t IMAGE_VERSION = 4;
+const uint32_t IMAGE_CHUNKED = 1; // Header flag: file contents are chunk lists
+const uint32_t CHUNK_COMPRESSED = 0x80000000u; // Chunk table length flag: the bytes are packed
+const size_t IMAGE_HEADER_SIZE = 24;
+const size_t DIR_RECORD_SIZE = 20; // Fixed part of a directory record
+const size_t FILE_RECORD_SIZE = 12; // Fixed part of a file record
+const size_t CHUNK_REF_SIZE = 20; // One entry of a chunk list
+
+// Returns true if the buffer starts with the binary image magic
+inline bool isBinaryImage(const char* data, size_t size) {
+    return size >= sizeof(IMAGE_MAGIC) && memcmp(data, IMAGE_MAGIC, sizeof(IMAGE_MAGIC)) == 0;
+}
+
+// Output buffer an image is written through. Bytes collect in one large block that
+// goes out in a single write once it fills up; a piece at least as large as the block
+// (an unchanged subtree copied from the previous image, a big chunk) goes out in the
+// same call as the block ahead of it instead of being copied through it. Seeking back
+// into the block, as ImageWriter::endDirectory does to patch a record's length, only
+// moves within memory; a seek to before the block writes the block out first.
+const size_t IMAGE_BUFFER_SIZE = 1 << 20;
+
+class ImageFile : public streambuf {
+    public:
+        ImageFile() : buffer(IMAGE_BUFFER_SIZE), fd(-1), base(0), high(0), failed(false) {
+            setp(buffer.data(), buffer.data() + buffer.size());
+        }
+        ~ImageFile() { close(); }
+
+        ImageFile(const ImageFile&) = delete;
+        ImageFile& operator=(const ImageFile&) = delete;
+
+        // Create or empty filename and write to it from the start
+        bool open(const string& filename) {
+            close();
+#ifdef _WIN32
+            fd = _open(filename.c_str(), _O_WRONLY | _O_CREAT | _O_TRUNC | _O_BINARY, 0644);
+#else
+            fd = ::open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+#endif
+            base = 0;
+            high = 0;
+            failed = fd < 0;
+            setp(buffer.data(), buffer.data() + buffer.size());
+            return !failed;
+        }
+
+        // Write out what is buffered, wait until the file is on disk and close it.
+        // False if anything failed along the way.
+        bool commit() {
+            if (fd < 0) return false;
+            flush();
+#ifdef _WIN32
+            if (_commit(fd) != 0) failed = true;
+#else
+            if (fsync(fd) != 0) failed = true;
+#endif
+            close();
+            return !failed;
+        }
+
+        // Close without waiting for the disk; buffered bytes are written out first
+        void close() {
+            if (fd < 0) return;
+            flush();
+#ifdef _WIN32
+            _close(fd);
+#else
+            ::close(fd);
+#endif
+            fd = -1;
+        }
+
+    protected:
+        int_type overflow(int_type c) override {
+            flush();
+            if (traits_type::eq_int_type(c, traits_type::eof())) return traits_type::not_eof(c);
+            *pptr() = traits_type::to_char_type(c);
+            pbump(1);
+            return c;
+        }
+
+        streamsize xsputn(const char* s, streamsize n) override {
+            size_t length = size_t(n);
+            if (length >= buffer.size()) {
+                size_t used = size_t(pptr() - pbase());
+                uint64_t position = base + used;
+                if (used >= high) {
+                    // Appending: the block and the piece go out in one call
+                    if (!writeAt(base, buffer.data(), used, s, length)) failed = true;
+                } else {
+                    flush();
+                    if (!writeAt(position, s, length)) failed = true;
+                }
+                restart(position + length);
+                return n;
+            }
+            while (length > 0) {
+                size_t fit = min(length, size_t(epptr() - pptr()));
+                memcpy(pptr(), s, fit);
+                pbump(int(fit));
+                s += fit;
+                length -= fit;
+                if (length > 0) flush();
+            }
+            return n;
+        }
+
+        int sync() override { return flush() ? 0 : -1; }
+
+        pos_type seekoff(off_type offset, ios_base::seekdir dir, ios_base::openmode which) override {
+            uint64_t position = base + uint64_t(pptr() - pbase());
+            if (dir == ios_base::cur) return seekpos(pos_type(off_type(position) + offset), which);
+            if (dir == ios_base::beg) return seekpos(pos_type(offset), which);
+            return pos_type(off_type(-1)); // The end is wherever the writing stopped
+        }
+
+        pos_type seekpos(pos_type pos, ios_base::openmode which) override {
+            if (!(which & ios_base::out) || fd < 0 || off_type(pos) < 0) return pos_type(off_type(-1));
+            uint64_t position = uint64_t(off_type(pos));
+            high = max(high, size_t(pptr() - pbase()));
+            if (position >= base && position <= base + high) {
+                setp(buffer.data(), buffer.data() + buffer.size());
+                pbump(int(position - base));
+            } else {
+                flush();
+                restart(position);
+            }
+            return pos;
+        }
+
+    private:
+        vector<char> buffer;
+        int fd;
+        uint64_t base; // Where buffer[0] goes in the file
+        size_t high; // Bytes of buffer holding data, which may lie past pptr after a seek back
+        bool failed;
+
+        // Write out the block and start a new one at the current position
+        bool flush() {
+            size_t used = size_t(pptr() - pbase());
+            size_t length = max(high, used);
+            if (length > 0 && fd >= 0 && !writeAt(base, buffer.data(), length)) failed = true;
+            restart(base + used);
+            return !failed;
+        }
+
+        void restart(uint64_t position) {
+            base = position;
+            high = 0;
+            setp(buffer.data(), buffer.data() + buffer.size());
+        }
+
+        // Write first and then second at offset, retrying short writes
+        bool writeAt(uint64_t offset, const char* first, size_t firstLength, const char* second = nullptr, size_t secondLength = 0) {
+#ifdef _WIN32
+            const char* parts[2] = {first, second};
+            size_t lengths[2] = {firstLength, secondLength};
+            if (_lseeki64(fd, int64_t(offset), SEEK_SET) < 0) return false;
+            for (int i = 0; i < 2; i++) {
+                for (size_t done = 0; done < lengths[i];) {
+                    int written = _write(fd, parts[i] + done, unsigned(min(lengths[i] - done, size_t(1) << 30)));
+                    if (written <= 0) return false;
+                    done += size_t(written);
+                }
+            }
+            return true;
+#else
+            iovec parts[2] = {{const_cast<char*>(first), firstLength}, {const_cast<char*>(second), secondLength}};
+            iovec* next = parts;
+            int count = secondLength > 0 ? 2 : 1;
+            while (count > 0) {
+                ssize_t written = pwritev(fd, next, count, off_t(offset));
+                if (written < 0) {
+                    if (errno == EINTR) continue;
+                    return false;
+                }
+                offset += uint64_t(written);
+                // Skip what went out, which may end partway into a part
+                while (count > 0 && size_t(written) >= next->iov_len) {
+                    written -= ssize_t(next->iov_len);
+                    next++;
+                    count--;
+                }
+                if (count > 0) {
+                    next->iov_base = static_cast<char*>(next->iov_base) + written;
+                    next->iov_len -= size_t(written);
+                }
+            }
+            return true;
+#endif
+        }
+};
+
+// Make a rename into path's directory durable
+inline void syncDirectoryOf(const string& path) {
+#ifndef _WIN32
+    size_t slash = path.rfind('/');
+    string dir = slash == string::npos ? "." : slash == 0 ? "/" : path.substr(0, slash);
+    int fd = ::open(dir.c_str(), O_RDONLY);
+    if (fd < 0) return;
+    fsync(fd);
+    ::close(fd);
+#endif
+}
+
+// Sequential writer for the image format
+class ImageWriter {
+    public:
+        ImageWriter(ostream& out) : out(out) {}
+
+        void header(uint64_t generation, uint32_t flags = 0) {
+            out.write(IMAGE_MAGIC, sizeof(IMAGE_MAGIC));
+            u32(IMAGE_VERSION);
+            u32(flags);
+            u64(generation);
+        }
+
+        void u32(uint32_t value) {
+            char bytes[4];
+            for (int i = 0; i < 4; i++) bytes[i] = char(value >> (8 * i));
+            out.write(bytes, 4);
+        }
+
+        void u64(uint64_t value) {
+            char bytes[8];
+            for (int i = 0; i < 8; i++) bytes[i] = char(value >> (8 * i));
+            out.write(bytes, 8);
+        }
+
+        void bytes(const string& text) { out.write(text.data(), text.size()); }
+
+        // Start a directory record; returns the position to pass to endDirectory
+        streampos beginDirectory(const string& name, uint32_t fileCount, uint32_t subdirCount) {
+            streampos start = out.tellp();
+            u64(0); // Patched by endDirectory once the length is known
+            u32(uint32_t(name.size()));
+            u32(fileCount);
+            u32(subdirCount);
+            bytes(name);
+            return start;
+        }
+
+        void endDirectory(streampos start) {
+            streampos end = out.tellp();
+            out.seekp(start);
+            u64(uint64_t(end - start));
+            out.seekp(end);
+        }
+
+        // Write a file record header; the caller writes exactly contentLength bytes next
+        void fileHeader(const string& name, uint64_t contentLength) {
+            u32(uint32_t(name.size()));
+            u64(contentLength);
+            bytes(name);
+        }
+
+        // One entry of a chunk list, or the start of a chunk table entry
+        void chunkRef(const ChunkId& id, uint32_t length) {
+            u64(id.low);
+            u64(id.high);
+            u32(length);
+        }
+
+        ostream& stream() { return out; }
+
+    private:
+        ostream& out;
+};
+
+// Bounds-checked cursor over an image held in memory. Any read past the end
+// clears ok() and yields zeros, so callers check once after parsing a record.
+class ImageReader {
+    public:
+        ImageReader(const char* data, size_t size)
+            : data(data), size(size), pos(0), valid(true), imageVersion(0), imageGeneration(0), imageFlags(0) {}
+
+        bool ok() const { return valid; }
+        uint32_t version() const { return imageVersion; }
+        uint64_t generation() const { return imageGeneration; }
+        bool chunked() const { return imageFlags & IMAGE_CHUNKED; }
+        size_t position() const { return pos; }
+        size_t remaining() const { return size - pos; }
+
+        bool header() {
+            if (!isBinaryImage(data, size)) return fail();
+            pos = sizeof(IMAGE_MAGIC);
+            imageVersion = u32();
+            uint32_t flags = u32();
+            if (imageVersion >= 3) imageFlags = flags; // Earlier versions wrote no flags
+            if (imageVersion >= 2) imageGeneration = u64();
+            return (valid && imageVersion >= 1 && imageVersion <= IMAGE_VERSION) || fail();
+        }
+
+        uint32_t u32() {
+            if (!need(4)) return 0;
+            uint32_t value = 0;
+            for (int i = 3; i >= 0; i--) value = (value << 8) | (unsigned char)data[pos + i];
+            pos += 4;
+            return value;
+        }
+
+        uint64_t u64() {
+            if (!need(8)) return 0;
+            uint64_t value = 0;
+            for (int i = 7; i >= 0; i--) value = (value << 8) | (unsigned char)data[pos + i];
+            pos += 8;
+            return value;
+        }
+
+        // Pointer to the next len bytes, or nullptr if the image is too short
+        const char* bytes(uint64_t len) {
+            if (!need(len)) return nullptr;
+            const char* start = data + pos;
+            pos += len;
+            return start;
+        }
+
+        string str(uint64_t len) {
+            const char* start = bytes(len);
+            return start ? string(start, len) : string();
+        }
+
+        ChunkId chunkId() {
+            ChunkId id;
+            id.low = u64();
+            id.high = u64();
+            return id;
+        }
+
+        void seek(size_t position) {
+            if (position <= size) pos = position;
+            else fail();
+        }
+
+    private:
+        const char* data;
+        size_t size;
+        size_t pos;
+        bool valid;
+        uint32_t imageVersion;
+        uint64_t imageGeneration;
+        uint32_t imageFlags;
+
+        bool need(uint64_t len) {
+            if (valid && len <= size - pos) return true;
+            return fail();
+        }
+
+        bool fail() {
+            valid = false;
+            return false;
+        }
+};
+
+// Where each chunk of a chunked image keeps its bytes
+class ChunkTable {
+    public:
+        struct Entry {
+            uint64_t offset; // Of the stored bytes
+            uint32_t length; // Of the chunk
+            uint32_t storedLength; // Of the stored bytes, less than length if compressed
+            bool compressed;
+        };
+
+        // Index the table that starts at the reader's position
+        bool read(ImageReader& reader) {
+            clear();
+            uint64_t count = reader.u64();
+            for (uint64_t i = 0; i < count && reader.ok(); i++) {
+                ChunkId id = reader.chunkId();
+                uint32_t storedLength = reader.u32();
+                bool compressed = reader.version() >= 4 && (storedLength & CHUNK_COMPRESSED);
+                if (compressed) storedLength &= ~CHUNK_COMPRESSED;
+                uint32_t length = compressed ? reader.u32() : storedLength;
+                uint64_t offset = reader.position();
+                if (reader.bytes(storedLength)) add(id, {offset, length, storedLength, compressed});
+            }
+            return reader.ok();
+        }
+
+        void add(const ChunkId& id, const Entry& entry) {
+            if (entries.emplace(id, entry).second) byteCount += entry.storedLength;
+        }
+
+        void clear() {
+            entries.clear();
+            byteCount = 0;
+        }
+
+        size_t size() const { return entries.size(); }
+        uint64_t bytes() const { return byteCount; } // Total stored length of the chunks
+
+        // Chunk id, if it is in the image with this length
+        const Entry* find(const ChunkId& id, uint32_t length) const {
+            auto it = entries.find(id);
+            return it != entries.end() && it->second.length == length ? &it->second : nullptr;
+        }
+
+    private:
+        unordered_map<ChunkId, Entry, ChunkIdHash> entries;
+        uint64_t byteCount = 0;
+};
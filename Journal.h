@@ -0,0 +1,370 @@
+#pragma once
+
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <cstdint>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <iterator>
+#include "Image.h"
+using namespace std;
+
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+
+
+// Mutating commands recorded in the journal
+enum class JournalOp : uint8_t {
+    Create = 1,
+    Delete,
+    Mkdir,
+    Write,
+    WriteAt,
+    MoveWithin,
+    Truncate,
+    Move,
+    MoveDir
+};
+
+// One journaled command. dir is the path of the directory the command ran in
+// (path[0] is the root marker), and a/b/c hold the numeric arguments in command order.
+struct JournalRecord {
+    JournalOp op;
+    vector<string> dir;
+    string name; // File or directory the command names (source for Move and MoveDir)
+    string target; // Move target: a name in dir, or an absolute path for another directory
+    string text; // Text for Write and WriteAt
+    int64_t a, b, c;
+
+    JournalRecord(JournalOp op = JournalOp::Create, string name = "", string text = "", int64_t a = 0, int64_t b = 0, int64_t c = 0)
+        : op(op), name(move(name)), text(move(text)), a(a), b(b), c(c) {}
+};
+
+// Journal file layout, all integers little-endian:
+//
+//   header  "FSJOURNL" | u32 version | u32 flags | u64 generation
+//   frame   u32 payloadLength | u32 checksum | payload
+//   payload one or more records, back to back
+//   record  u8 op | u32 dirDepth | dirDepth x (u32 length | name)
+//           u32 length | name | u32 length | target | u32 length | text | u64 a | u64 b | u64 c
+//
+// generation matches the image generation the records apply on top of. A frame
+// is checksummed as a whole, so the records of a transaction are replayed all
+// together or not at all. Replay stops at the first truncated or corrupt frame,
+// which is where a crash cut the log short.
+//
+// While a checkpoint writes a new image, new records go to <log>.next, a second log
+// for the new image's generation. Once the image is in place <log>.next is renamed
+// over the log, so after a crash there may be both: the log for the old image and
+// <log>.next to apply after it (or on its own, if the new image made it to disk).
+const char JOURNAL_MAGIC[8] = {'F', 'S', 'J', 'O', 'U', 'R', 'N', 'L'};
+const uint32_t JOURNAL_VERSION = 1;
+const size_t JOURNAL_HEADER_SIZE = 24;
+
+// FNV-1a, enough to catch torn writes at the end of the log
+inline uint32_t journalChecksum(const char* data, size_t len) {
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < len; i++) {
+        hash ^= (unsigned char)data[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+inline void appendU32(string& out, uint32_t value) {
+    for (int i = 0; i < 4; i++) out.push_back(char(value >> (8 * i)));
+}
+
+inline void appendU64(string& out, uint64_t value) {
+    for (int i = 0; i < 8; i++) out.push_back(char(value >> (8 * i)));
+}
+
+inline void appendString(string& out, const string& text) {
+    appendU32(out, uint32_t(text.size()));
+    out += text;
+}
+
+// Append-only log of mutating commands with group commit: callers append records
+// to an in-memory batch and a background thread writes each batch with a single
+// fsync, so threads committing at the same time share one disk flush.
+class Journal {
+    public:
+        Journal() : file(nullptr), appended(0), durable(0), bytes(0), stopping(false), rotated(false), nextGeneration(0) {}
+        ~Journal() { close(); }
+
+        Journal(const Journal&) = delete;
+        Journal& operator=(const Journal&) = delete;
+
+        // Open filename for appending. If it already holds a valid log for generation,
+        // it is cut back to validLength (the end of its last intact record);
+        // otherwise it is started afresh.
+        bool open(const string& filename, uint64_t generation, uint64_t validLength) {
+            close();
+            path = filename;
+            remove(nextPath().c_str()); // Replayed and folded into the image already, or stale
+            bool keep = validLength > JOURNAL_HEADER_SIZE && fileGeneration(filename) == generation;
+            if (keep) {
+                error_code error;
+                filesystem::resize_file(filename, validLength, error);
+                keep = !error;
+            }
+            if (keep) {
+                file = fopen(filename.c_str(), "ab");
+                bytes = validLength;
+            } else if (!startFile(path, generation)) {
+                return false;
+            }
+            stopping = false;
+            flusher = thread(&Journal::flushLoop, this);
+            return file != nullptr;
+        }
+
+        bool isOpen() const { return file != nullptr; }
+
+        // Queue a record; returns its sequence number for waitDurable
+        uint64_t append(const JournalRecord& record) {
+            string payload;
+            encode(record, payload);
+            return appendFrame(payload);
+        }
+
+        // Queue several records as one frame, so replay applies all of them or none
+        uint64_t append(const vector<JournalRecord>& records) {
+            string payload;
+            for (const JournalRecord& record : records) encode(record, payload);
+            return appendFrame(payload);
+        }
+
+        // Block until the record with this sequence number is on disk
+        void waitDurable(uint64_t seq) {
+            unique_lock<mutex> guard(lock);
+            flushed.wait(guard, [&] { return durable >= seq || !file; });
+        }
+
+        // Block until every queued record is on disk
+        void sync() {
+            unique_lock<mutex> guard(lock);
+            flushed.wait(guard, [&] { return durable >= appended || !file; });
+        }
+
+        // Bytes in the log file, including records still being written
+        uint64_t size() {
+            lock_guard<mutex> guard(lock);
+            return bytes + pending.size();
+        }
+
+        // Start a checkpoint: send later records to <log>.next, for the image of generation
+        // being saved. Everything queued so far is on disk in the log first.
+        void rotate(uint64_t generation) {
+            unique_lock<mutex> guard(lock);
+            flushed.wait(guard, [&] { return durable >= appended || !file; });
+            if (!file) return;
+            fclose(file);
+            if (!startFile(nextPath(), generation)) {
+                file = fopen(path.c_str(), "ab"); // Keep logging to the old file
+                return;
+            }
+            rotated = true;
+            nextGeneration = generation;
+        }
+
+        // End a checkpoint. If its image was saved, <log>.next becomes the log; otherwise its
+        // records are appended to the log, which still applies to the image on disk.
+        void finishRotate(bool imageSaved) {
+            unique_lock<mutex> guard(lock);
+            flushed.wait(guard, [&] { return durable >= appended || !file; });
+            if (!file || !rotated) return;
+            rotated = false;
+            error_code error;
+            if (imageSaved) {
+                filesystem::rename(nextPath(), path, error); // The open file keeps its place
+                if (!error) return;
+            }
+            // Copy the records into the log: a fresh one for the new image if it was saved,
+            // otherwise after the records for the image still on disk
+            fclose(file);
+            string next = nextPath();
+            ifstream fin(next, ios::binary);
+            string frames((istreambuf_iterator<char>(fin)), istreambuf_iterator<char>());
+            fin.close();
+            frames.erase(0, min(frames.size(), JOURNAL_HEADER_SIZE));
+            if (imageSaved) startFile(path, nextGeneration);
+            else file = fopen(path.c_str(), "ab");
+            if (!file) return;
+            fwrite(frames.data(), 1, frames.size(), file);
+            syncFile(file);
+            remove(next.c_str());
+            bytes = uint64_t(filesystem::file_size(path, error));
+        }
+
+        // Flush everything and stop the writer thread
+        void close() {
+            if (flusher.joinable()) {
+                {
+                    lock_guard<mutex> guard(lock);
+                    stopping = true;
+                    workReady.notify_one();
+                }
+                flusher.join();
+            }
+            lock_guard<mutex> guard(lock);
+            if (file) fclose(file);
+            file = nullptr;
+            flushed.notify_all();
+        }
+
+        // Decode every record in the intact frames of a log written for generation, in order. Returns the
+        // byte length of the intact prefix (0 if the log is missing or for another generation).
+        template <typename Apply>
+        static uint64_t replay(const string& filename, uint64_t generation, Apply apply) {
+            ifstream fin(filename, ios::binary | ios::ate);
+            if (!fin) return 0;
+            string log(size_t(fin.tellg()), '\0');
+            fin.seekg(0);
+            fin.read(&log[0], log.size());
+
+            ImageReader reader(log.data(), log.size());
+            uint64_t logGeneration;
+            if (!readHeader(reader, logGeneration) || logGeneration != generation) return 0;
+            size_t valid = reader.position();
+            while (reader.remaining() > 0) {
+                uint32_t length = reader.u32();
+                uint32_t checksum = reader.u32();
+                const char* payload = reader.bytes(length);
+                if (!reader.ok() || journalChecksum(payload, length) != checksum) break;
+
+                ImageReader fields(payload, length);
+                vector<JournalRecord> records;
+                while (fields.ok() && fields.remaining() > 0) {
+                    records.emplace_back();
+                    JournalRecord& record = records.back();
+                    const char* op = fields.bytes(1);
+                    if (!op) break;
+                    record.op = JournalOp(*op);
+                    uint32_t depth = fields.u32();
+                    for (uint32_t i = 0; i < depth && fields.ok(); i++) record.dir.push_back(fields.str(fields.u32()));
+                    record.name = fields.str(fields.u32());
+                    record.target = fields.str(fields.u32());
+                    record.text = fields.str(fields.u32());
+                    record.a = int64_t(fields.u64());
+                    record.b = int64_t(fields.u64());
+                    record.c = int64_t(fields.u64());
+                }
+                if (!fields.ok() || records.empty()) break;
+
+                for (const JournalRecord& record : records) apply(record);
+                valid = reader.position();
+            }
+            return valid;
+        }
+
+    private:
+        string path;
+        FILE* file;
+        mutex lock; // Guards everything below
+        condition_variable workReady; // Signals the flusher that pending has data
+        condition_variable flushed; // Signals waiters that durable advanced
+        string pending; // Encoded records not yet handed to the flusher
+        uint64_t appended; // Sequence number of the last queued record
+        uint64_t durable; // Sequence number of the last record known to be on disk
+        uint64_t bytes; // Size of the log file on disk
+        bool stopping;
+        bool rotated; // Writing to <log>.next during a checkpoint
+        uint64_t nextGeneration; // Generation <log>.next was started for
+        thread flusher;
+
+        string nextPath() const { return path + ".next"; }
+
+        // Queue one checksummed frame; called without lock held
+        uint64_t appendFrame(const string& payload) {
+            lock_guard<mutex> guard(lock);
+            appendU32(pending, uint32_t(payload.size()));
+            appendU32(pending, journalChecksum(payload.data(), payload.size()));
+            pending += payload;
+            workReady.notify_one();
+            return ++appended;
+        }
+
+        static void encode(const JournalRecord& record, string& payload) {
+            payload.push_back(char(record.op));
+            appendU32(payload, uint32_t(record.dir.size()));
+            for (const string& name : record.dir) appendString(payload, name);
+            appendString(payload, record.name);
+            appendString(payload, record.target);
+            appendString(payload, record.text);
+            appendU64(payload, uint64_t(record.a));
+            appendU64(payload, uint64_t(record.b));
+            appendU64(payload, uint64_t(record.c));
+        }
+
+        static bool readHeader(ImageReader& reader, uint64_t& generation) {
+            const char* magic = reader.bytes(sizeof(JOURNAL_MAGIC));
+            if (!magic || memcmp(magic, JOURNAL_MAGIC, sizeof(JOURNAL_MAGIC)) != 0) return false;
+            uint32_t version = reader.u32();
+            reader.u32(); // Flags, unused in version 1
+            generation = reader.u64();
+            return reader.ok() && version == JOURNAL_VERSION;
+        }
+
+        // Generation in the header of an existing log, or UINT64_MAX if there is no valid one
+        static uint64_t fileGeneration(const string& filename) {
+            char header[JOURNAL_HEADER_SIZE];
+            ifstream fin(filename, ios::binary);
+            if (!fin.read(header, sizeof(header))) return UINT64_MAX;
+            ImageReader reader(header, sizeof(header));
+            uint64_t generation;
+            return readHeader(reader, generation) ? generation : UINT64_MAX;
+        }
+
+        // Create an empty log for generation; called with lock held or before the flusher runs
+        bool startFile(const string& filename, uint64_t generation) {
+            file = fopen(filename.c_str(), "wb");
+            if (!file) return false;
+            string header(JOURNAL_MAGIC, sizeof(JOURNAL_MAGIC));
+            appendU32(header, JOURNAL_VERSION);
+            appendU32(header, 0);
+            appendU64(header, generation);
+            fwrite(header.data(), 1, header.size(), file);
+            syncFile(file);
+            bytes = header.size();
+            return true;
+        }
+
+        static void syncFile(FILE* target) {
+            fflush(target);
+#ifdef _WIN32
+            _commit(_fileno(target));
+#else
+            fsync(fileno(target));
+#endif
+        }
+
+        // Writer thread: take whatever has accumulated, write it with one fsync, repeat
+        void flushLoop() {
+            unique_lock<mutex> guard(lock);
+            while (true) {
+                workReady.wait(guard, [&] { return stopping || !pending.empty(); });
+                if (pending.empty()) break; // Stopping with nothing left to write
+                string batch;
+                batch.swap(pending);
+                uint64_t batchEnd = appended;
+                FILE* target = file;
+                guard.unlock();
+                fwrite(batch.data(), 1, batch.size(), target);
+                syncFile(target);
+                guard.lock();
+                bytes += batch.size();
+                durable = batchEnd;
+                flushed.notify_all();
+            }
+        }
+};
@@ -0,0 +1,76 @@
+#pragma once
+
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <memory>
+using namespace std;
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+
+// Read-only view of a whole file. On POSIX systems the file is memory-mapped, so
+// pages are only read from disk when something touches them, and the mapping
+// stays valid after the file is replaced by rename. Elsewhere the file is read
+// into memory with one bulk read.
+class MappedImage {
+    public:
+        // Returns nullptr if the file cannot be opened
+        static shared_ptr<const MappedImage> open(const string& filename) {
+            shared_ptr<MappedImage> image(new MappedImage());
+            if (!image->map(filename)) return nullptr;
+            return image;
+        }
+
+        ~MappedImage() {
+#ifndef _WIN32
+            if (mapped) munmap(mapped, length);
+#endif
+        }
+
+        MappedImage(const MappedImage&) = delete;
+        MappedImage& operator=(const MappedImage&) = delete;
+
+        const char* data() const { return begin; }
+        size_t size() const { return length; }
+
+    private:
+        const char* begin;
+        size_t length;
+        void* mapped; // Address returned by mmap, if the file was mapped
+        string buffer; // File contents when the file could not be mapped
+
+        MappedImage() : begin(""), length(0), mapped(nullptr) {}
+
+        bool map(const string& filename) {
+#ifndef _WIN32
+            int fd = ::open(filename.c_str(), O_RDONLY);
+            if (fd < 0) return false;
+            struct stat info;
+            if (fstat(fd, &info) == 0 && info.st_size > 0) {
+                void* address = mmap(nullptr, size_t(info.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+                if (address != MAP_FAILED) {
+                    mapped = address;
+                    begin = static_cast<const char*>(address);
+                    length = size_t(info.st_size);
+                }
+            }
+            close(fd);
+            if (mapped) return true;
+#endif
+            // Empty files cannot be mapped, and there is no mmap on Windows: read the file instead
+            ifstream fin(filename, ios::binary | ios::ate);
+            if (!fin) return false;
+            buffer.resize(size_t(fin.tellg()));
+            fin.seekg(0);
+            fin.read(&buffer[0], buffer.size());
+            begin = buffer.data();
+            length = buffer.size();
+            return true;
+        }
+};
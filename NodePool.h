@@ -0,0 +1,176 @@
+#pragma once
+
+#include <iostream>
+#include <cstddef>
+#include <cstdint>
+#include <new>
+#include <mutex>
+#include <atomic>
+#include <vector>
+#include <memory>
+using namespace std;
+
+
+// Usage counters shared by every SlabPool, for memory reports
+class NodePoolStats {
+    public:
+        virtual size_t blockSize() const = 0;
+        virtual size_t liveBlocks() const = 0;
+        virtual size_t reservedBytes() const = 0;
+
+        // Every pool created so far
+        static vector<const NodePoolStats*> all() {
+            lock_guard<mutex> guard(registryLock());
+            return registry();
+        }
+
+    protected:
+        NodePoolStats() {
+            lock_guard<mutex> guard(registryLock());
+            registry().push_back(this);
+        }
+        ~NodePoolStats() = default;
+
+    private:
+        static vector<const NodePoolStats*>& registry() {
+            static vector<const NodePoolStats*>* pools = new vector<const NodePoolStats*>();
+            return *pools;
+        }
+        static mutex& registryLock() {
+            static mutex* lock = new mutex();
+            return *lock;
+        }
+};
+
+// Fixed-size blocks carved from 64 KiB slabs, one pool per block size. Every thread
+// keeps a short list of free blocks, so most allocations and frees are a pointer
+// pop or push without a lock or a trip through malloc. The lists refill from and
+// spill to a shared free list in batches. Freed blocks are reused, but slabs are
+// never returned to the system, which suits a tree that mostly grows.
+template <size_t Size, size_t Align>
+class SlabPool : public NodePoolStats {
+    public:
+        // Never destroyed: nodes can still be freed while static objects are torn down
+        static SlabPool& instance() {
+            static SlabPool* pool = new SlabPool();
+            return *pool;
+        }
+
+        void* allocate() {
+            Cache& local = cache;
+            if (!local.head) refill(local);
+            Block* block = local.head;
+            local.head = block->next;
+            local.count--;
+            live.fetch_add(1, memory_order_relaxed);
+            return block;
+        }
+
+        void deallocate(void* pointer) {
+            Cache& local = cache;
+            Block* block = static_cast<Block*>(pointer);
+            block->next = local.head;
+            local.head = block;
+            live.fetch_sub(1, memory_order_relaxed);
+            if (++local.count > CACHE_LIMIT) spill(local, BATCH);
+        }
+
+        size_t blockSize() const override { return BLOCK_SIZE; }
+        size_t liveBlocks() const override { return live.load(memory_order_relaxed); }
+        size_t reservedBytes() const override { return slabCount.load(memory_order_relaxed) * SLAB_SIZE; }
+
+    private:
+        struct Block {
+            Block* next; // Link in a free list while the block is unused
+        };
+
+        // A thread's free blocks; handed back to the pool when the thread exits
+        struct Cache {
+            Block* head = nullptr;
+            size_t count = 0;
+            ~Cache() { instance().spill(*this, count); }
+        };
+
+        static constexpr size_t ALIGN = Align > alignof(Block) ? Align : alignof(Block);
+        static constexpr size_t BLOCK_SIZE = ((Size > sizeof(Block) ? Size : sizeof(Block)) + ALIGN - 1) / ALIGN * ALIGN;
+        static constexpr size_t SLAB_SIZE = 64 * 1024;
+        static constexpr size_t BATCH = 32; // Blocks moved between a thread and the pool at a time
+        static constexpr size_t CACHE_LIMIT = 2 * BATCH;
+
+        static_assert(BLOCK_SIZE <= SLAB_SIZE, "node too large for a slab");
+
+        inline static thread_local Cache cache;
+
+        mutex lock; // Guards everything below
+        Block* shared = nullptr; // Blocks spilled by threads
+        vector<unique_ptr<char[]>> slabs;
+        char* next = nullptr; // Uncarved part of the newest slab
+        char* end = nullptr;
+        atomic<size_t> slabCount{0};
+        atomic<size_t> live{0};
+
+        SlabPool() = default;
+
+        // Give local up to BATCH blocks, reusing spilled ones before carving new ones
+        void refill(Cache& local) {
+            lock_guard<mutex> guard(lock);
+            while (local.count < BATCH && shared) {
+                Block* block = shared;
+                shared = block->next;
+                block->next = local.head;
+                local.head = block;
+                local.count++;
+            }
+            while (local.count < BATCH) {
+                if (next + BLOCK_SIZE > end) {
+                    slabs.emplace_back(new char[SLAB_SIZE + ALIGN]);
+                    uintptr_t start = reinterpret_cast<uintptr_t>(slabs.back().get());
+                    next = reinterpret_cast<char*>((start + ALIGN - 1) / ALIGN * ALIGN);
+                    end = next + SLAB_SIZE;
+                    slabCount++;
+                }
+                Block* block = reinterpret_cast<Block*>(next);
+                next += BLOCK_SIZE;
+                block->next = local.head;
+                local.head = block;
+                local.count++;
+            }
+        }
+
+        // Move count blocks from local to the shared list
+        void spill(Cache& local, size_t count) {
+            if (count == 0) return;
+            Block* first = local.head;
+            Block* last = first;
+            for (size_t i = 1; i < count; i++) last = last->next;
+            local.head = last->next;
+            local.count -= count;
+            lock_guard<mutex> guard(lock);
+            last->next = shared;
+            shared = first;
+        }
+};
+
+// Allocator that takes single nodes from the SlabPool for their size. Arrays, such
+// as the bucket table of an unordered_map, still come from operator new.
+template <typename T>
+class PoolAllocator {
+    public:
+        using value_type = T;
+
+        PoolAllocator() noexcept {}
+        template <typename U> PoolAllocator(const PoolAllocator<U>&) noexcept {}
+
+        T* allocate(size_t n) {
+            if (n == 1) return static_cast<T*>(SlabPool<sizeof(T), alignof(T)>::instance().allocate());
+            return static_cast<T*>(::operator new(n * sizeof(T)));
+        }
+
+        void deallocate(T* pointer, size_t n) noexcept {
+            if (n == 1) SlabPool<sizeof(T), alignof(T)>::instance().deallocate(pointer);
+            else ::operator delete(pointer);
+        }
+
+        template <typename U> bool operator==(const PoolAllocator<U>&) const noexcept { return true; }
+        template <typename U> bool operator!=(const PoolAllocator<U>&) const noexcept { return false; }
+};
@@ -0,0 +1,69 @@
+#pragma once
+
+#include <iostream>
+#include <string>
+#include <unordered_map>
+#include <functional>
+#include <mutex>
+#include <shared_mutex>
+#include "Directory.h"
+using namespace std;
+
+
+// Concurrent map from absolute directory paths ("/Backup/Data", "" for the root, as pathKey builds them) to
+// directories, so resolving a deep path costs one hash lookup instead of one map
+// lookup and one lock per level. Split into shards with their own reader/writer
+// lock, so threads resolving different paths rarely touch the same lock.
+//
+// Only directories are cached, so file commands need no invalidation. Moving a
+// directory erases the entries under its old path. A directory can also disappear
+// when a transaction that created it rolls back, which is why sessions inside a
+// transaction read the cache but never add to it.
+class PathCache {
+    public:
+        Directory* find(const string& path) const {
+            const Shard& shard = shardFor(path);
+            shared_lock<shared_mutex> guard(shard.lock);
+            auto it = shard.entries.find(path);
+            return it != shard.entries.end() ? it->second : nullptr;
+        }
+
+        void insert(const string& path, Directory* dir) {
+            Shard& shard = shardFor(path);
+            unique_lock<shared_mutex> guard(shard.lock);
+            shard.entries.emplace(path, dir);
+        }
+
+        // Drop path and every path below it. Visits every entry, which is fine for
+        // directory moves but would not be for anything frequent.
+        void erase(const string& path) {
+            string prefix = path + "/";
+            for (Shard& shard : shards) {
+                unique_lock<shared_mutex> guard(shard.lock);
+                for (auto it = shard.entries.begin(); it != shard.entries.end();) {
+                    if (it->first == path || it->first.compare(0, prefix.size(), prefix) == 0) it = shard.entries.erase(it);
+                    else ++it;
+                }
+            }
+        }
+
+        void clear() {
+            for (Shard& shard : shards) {
+                unique_lock<shared_mutex> guard(shard.lock);
+                shard.entries.clear();
+            }
+        }
+
+    private:
+        static const size_t SHARD_COUNT = 16;
+
+        struct Shard {
+            mutable shared_mutex lock;
+            unordered_map<string, Directory*> entries;
+        };
+
+        Shard shards[SHARD_COUNT];
+
+        Shard& shardFor(const string& path) { return shards[hash<string>()(path) % SHARD_COUNT]; }
+        const Shard& shardFor(const string& path) const { return shards[hash<string>()(path) % SHARD_COUNT]; }
+};
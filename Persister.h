@@ -0,0 +1,100 @@
+#pragma once
+
+#include <string>
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <functional>
+#include <cstdint>
+using namespace std;
+
+
+// Background thread that saves images on request, so the thread asking for a save
+// (a command, or one that crossed the checkpoint threshold) goes on at once. A
+// request returns a ticket, and wait(ticket) blocks until that save is over, for the
+// callers that need it on disk. A request for a file whose save is still waiting its
+// turn joins that save: it starts later and so holds the newer changes too, and a
+// burst of requests costs one save.
+class Persister {
+    public:
+        using Save = function<bool(const string&)>; // Writes filename, returns whether it worked
+
+        Persister(Save save) : save(move(save)), requested(0), completed(0), succeeded(true), stopping(false) {}
+        ~Persister() { stop(); }
+
+        Persister(const Persister&) = delete;
+        Persister& operator=(const Persister&) = delete;
+
+        // Queue a save of filename; the thread starts with the first request
+        uint64_t request(const string& filename) {
+            lock_guard<mutex> guard(lock);
+            for (const Pending& pending : queue) {
+                if (pending.filename == filename) return pending.ticket;
+            }
+            if (!worker.joinable()) {
+                stopping = false;
+                worker = thread(&Persister::saveLoop, this);
+            }
+            queue.push_back({filename, ++requested});
+            workReady.notify_one();
+            return requested;
+        }
+
+        // Ticket of the latest request, to wait for everything asked for so far
+        uint64_t latest() {
+            lock_guard<mutex> guard(lock);
+            return requested;
+        }
+
+        // Block until the save with this ticket is over. False if the last save to
+        // finish failed; a later save holds the ticket's changes as well.
+        bool wait(uint64_t ticket) {
+            unique_lock<mutex> guard(lock);
+            saved.wait(guard, [&] { return completed >= ticket; });
+            return succeeded;
+        }
+
+        // Run the queued saves and end the thread. Call once nothing requests saves any more.
+        void stop() {
+            {
+                lock_guard<mutex> guard(lock);
+                stopping = true;
+            }
+            workReady.notify_all();
+            if (worker.joinable()) worker.join();
+        }
+
+    private:
+        struct Pending {
+            string filename;
+            uint64_t ticket;
+        };
+
+        Save save;
+        mutex lock;
+        condition_variable workReady;
+        condition_variable saved;
+        deque<Pending> queue; // Requests not started yet, in ticket order
+        uint64_t requested; // Last ticket handed out
+        uint64_t completed; // Last ticket saved (or failed)
+        bool succeeded; // Result of the last save
+        bool stopping;
+        thread worker;
+
+        void saveLoop() {
+            unique_lock<mutex> guard(lock);
+            while (true) {
+                workReady.wait(guard, [&] { return stopping || !queue.empty(); });
+                if (queue.empty()) break; // Stopping with nothing left to save
+                Pending next = move(queue.front());
+                queue.pop_front();
+                guard.unlock();
+                bool ok = save(next.filename);
+                guard.lock();
+                completed = next.ticket;
+                succeeded = ok;
+                saved.notify_all();
+            }
+        }
+};
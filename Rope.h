@@ -0,0 +1,415 @@
+#pragma once
+
+#include <iostream>
+#include <string>
+#include <string_view>
+#include <cstdint>
+#include <utility>
+#include <atomic>
+#include "Chunk.h"
+using namespace std;
+
+
+// Byte sequence stored as a list of blocks of at most BLOCK_SIZE bytes, kept in
+// an implicit treap ordered by position. Each node caches the byte count of its
+// subtree, so locating an offset, splitting and concatenating cost O(log n),
+// and edits only touch the blocks they land in instead of rewriting the whole
+// sequence the way std::string does.
+//
+// Blocks are reference counted and shared between copies, so copying a rope is
+// O(1). Before a rope changes a shared block it copies it, along with the nodes on
+// the path to it, and the other copies keep seeing the old content. Snapshots rely
+// on this to hold a file's content as of a point in time. A block's bytes live in a
+// Chunk, which can also be shared between unrelated ropes through a ChunkStore, or
+// kept compressed. Reads unpack only the compressed blocks they touch.
+class Rope {
+    public:
+        static constexpr size_t BLOCK_SIZE = 4096; // Largest block the rope creates
+
+        Rope() {}
+        Rope(const string& text) { append(text.data(), text.size()); }
+        Rope(Rope&&) = default;
+        Rope& operator=(Rope&&) = default;
+        Rope(const Rope&) = default; // Shares every block
+        Rope& operator=(const Rope&) = default;
+        Rope& operator=(const string& text) {
+            assign(text);
+            return *this;
+        }
+
+        size_t size() const { return total(root.get()); }
+        bool empty() const { return !root; }
+
+        void clear() { root.reset(); }
+
+        void assign(const string& text) {
+            root.reset();
+            append(text.data(), text.size());
+        }
+
+        void append(const string& text) { append(text.data(), text.size()); }
+
+        // Append len bytes, filling the last block before starting new ones. With
+        // fullBlocks, the last block gets room for a whole block, so the appends after
+        // this one fill it without reallocating.
+        void append(const char* text, size_t len, bool fullBlocks = false) {
+            size_t done = 0;
+            if (root && len > 0) {
+                Node* last = root.get();
+                while (last->right) last = last->right.get();
+                size_t room = last->size() < BLOCK_SIZE ? BLOCK_SIZE - last->size() : 0;
+                done = min(room, len);
+                if (done > 0) {
+                    size_t offset = 0;
+                    string& bytes = growPath(size() - 1, done, offset)->edit();
+                    if (fullBlocks) bytes.reserve(BLOCK_SIZE);
+                    bytes.append(text, done);
+                }
+            }
+            if (done < len) root = merge(move(root), build(text + done, len - done, fullBlocks));
+        }
+
+        // Give the last block room for a whole block, as append does with fullBlocks
+        void reserveLast() {
+            if (!root) return;
+            size_t offset = 0;
+            growPath(size() - 1, 0, offset)->edit().reserve(BLOCK_SIZE);
+        }
+
+        // Insert text before position pos (pos <= size())
+        void insert(size_t pos, const string& text) {
+            if (text.empty()) return;
+            if (pos >= size()) {
+                append(text);
+                return;
+            }
+            size_t offset = 0;
+            if (locate(pos, offset)->size() + text.size() <= BLOCK_SIZE) {
+                growPath(pos, text.size(), offset)->edit().insert(offset, text); // Small inserts stay inside one block
+                return;
+            }
+            NodeRef left, right;
+            split(move(root), pos, left, right);
+            root = merge(merge(move(left), build(text.data(), text.size())), move(right));
+        }
+
+        // Overwrite bytes starting at pos; the part of text past the end is appended
+        void overwrite(size_t pos, const string& text) {
+            size_t inside = pos < size() ? min(text.size(), size() - pos) : 0;
+            size_t done = 0;
+            while (done < inside) {
+                size_t offset = 0;
+                Node* block = growPath(pos + done, 0, offset);
+                size_t n = min(inside - done, block->size() - offset);
+                block->edit().replace(offset, n, text, done, n); // Same length, so no subtree sizes change
+                done += n;
+            }
+            if (inside < text.size()) append(text.data() + inside, text.size() - inside);
+        }
+
+        // Remove len bytes starting at pos and return them as a rope
+        Rope extract(size_t pos, size_t len) {
+            NodeRef left, middle, right;
+            split(move(root), pos, left, right);
+            split(move(right), len, middle, right);
+            root = merge(move(left), move(right));
+            Rope piece;
+            piece.root = move(middle);
+            return piece;
+        }
+
+        // Insert another rope before position pos, taking ownership of its blocks
+        void splice(size_t pos, Rope&& piece) {
+            NodeRef left, right;
+            split(move(root), pos, left, right);
+            root = merge(merge(move(left), move(piece.root)), move(right));
+        }
+
+        // Cut everything from position len onwards
+        void truncate(size_t len) {
+            if (len >= size()) return;
+            NodeRef left, right;
+            split(move(root), len, left, right);
+            root = move(left);
+        }
+
+        string substr(size_t pos, size_t len) const {
+            string result;
+            if (pos >= size()) return result;
+            len = min(len, size() - pos);
+            result.reserve(len);
+            read(pos, len, [&result](string_view piece) { result.append(piece.data(), piece.size()); });
+            return result;
+        }
+
+        string str() const { return substr(0, size()); }
+
+        void writeTo(ostream& out) const {
+            read(0, size(), [&out](string_view piece) { out.write(piece.data(), piece.size()); });
+        }
+
+        // Call visit(string_view) for each piece of [pos, pos + len), in order, without
+        // copying: pieces point into the blocks. A compressed block is unpacked into one
+        // scratch buffer that every block reuses, so a view is only valid until visit returns.
+        template <typename Visit>
+        void read(size_t pos, size_t len, Visit visit) const {
+            if (pos >= size()) return;
+            string scratch;
+            visitRange(root.get(), pos, min(len, size() - pos), visit, scratch);
+        }
+
+        // Append chunk as a block of its own, sharing it instead of copying its bytes
+        void appendChunk(ChunkRef chunk) {
+            if (chunk && chunk->size() > 0) root = merge(move(root), NodeRef(new Node(move(chunk), randomPriority())));
+        }
+
+        // Call visit(const ChunkRef&) for every block, in order
+        template <typename Visit>
+        void forEachChunk(Visit visit) const { visitChunks(root.get(), visit); }
+
+        // Apply policy to the blocks changed since the last call: compress them if the
+        // rope is long enough, then swap each for the stored chunk with the same content.
+        // The last block, where appends land, is only compressed once it stops being last.
+        // With all, blocks packed before are looked at again, for a rope that just grew
+        // past policy.minFileSize. With keepLast, the last block is not stored either, so
+        // appends keep writing into it instead of copying it out of the store each time.
+        void pack(const PackPolicy& policy, bool all = false, bool keepLast = false) {
+            pack(root, policy, policy.compress && size() >= policy.minFileSize, all, true, keepLast);
+        }
+
+    private:
+        struct Node;
+
+        // Counted reference to a node, released when the last rope or parent node
+        // referring to it lets go
+        class NodeRef {
+            public:
+                NodeRef() : node(nullptr) {}
+                explicit NodeRef(Node* node) : node(node) {} // Adopts a new node
+                NodeRef(const NodeRef& other) : node(other.node) {
+                    if (node) node->refs.fetch_add(1, memory_order_relaxed);
+                }
+                NodeRef(NodeRef&& other) noexcept : node(other.node) { other.node = nullptr; }
+                NodeRef& operator=(NodeRef other) noexcept {
+                    swap(node, other.node);
+                    return *this;
+                }
+                ~NodeRef() {
+                    if (node && node->refs.fetch_sub(1, memory_order_acq_rel) == 1) delete node;
+                }
+
+                Node* get() const { return node; }
+                Node* operator->() const { return node; }
+                explicit operator bool() const { return node != nullptr; }
+                void reset() { *this = NodeRef(); }
+
+            private:
+                Node* node;
+        };
+
+        struct Node {
+            ChunkRef data; // Between 1 and BLOCK_SIZE bytes
+            size_t total; // Bytes in this subtree
+            uint32_t priority; // Heap order that keeps the treap balanced
+            atomic<uint32_t> refs; // Ropes and parent nodes referring to this one; fits in padding
+            bool packed; // Every block in this subtree went through pack and has not changed since
+            NodeRef left, right;
+
+            Node(string bytes, uint32_t priority) : Node(ChunkRef(new Chunk(move(bytes))), priority) {}
+            Node(ChunkRef data, uint32_t priority) : data(move(data)), total(0), priority(priority), refs(1), packed(false) { update(); }
+            Node(const Node& other)
+                : data(other.data), total(other.total), priority(other.priority), refs(1), packed(other.packed),
+                  left(other.left), right(other.right) {}
+
+            size_t size() const { return data->size(); }
+
+            // The block's bytes to change, copied into a chunk of this node's own first
+            // if the current one is shared
+            string& edit() {
+                if (data->shared()) {
+                    string scratch;
+                    data = ChunkRef(new Chunk(string(data->raw(scratch), data->size())));
+                }
+                packed = false;
+                return data->bytes;
+            }
+
+            void update() {
+                total = size() + Rope::total(left.get()) + Rope::total(right.get());
+                packed = false;
+            }
+        };
+
+        NodeRef root;
+
+        static size_t total(const Node* node) { return node ? node->total : 0; }
+
+        static uint32_t randomPriority() {
+            static thread_local uint32_t state = 2463534242u; // xorshift32
+            state ^= state << 13;
+            state ^= state >> 17;
+            state ^= state << 5;
+            return state;
+        }
+
+        // The node ref points to, copied first if anything else refers to it, so that
+        // changing it cannot show through another rope. The children become shared.
+        static Node* own(NodeRef& ref) {
+            if (ref && ref->refs.load(memory_order_acquire) > 1) ref = NodeRef(new Node(*ref.get()));
+            return ref.get();
+        }
+
+        // Split into [0, pos) and [pos, size), cutting a block in two if pos falls inside it
+        static void split(NodeRef node, size_t pos, NodeRef& left, NodeRef& right) {
+            if (!node) {
+                left.reset();
+                right.reset();
+                return;
+            }
+            own(node);
+            size_t leftSize = total(node->left.get());
+            size_t blockEnd = leftSize + node->size();
+            if (pos <= leftSize) {
+                split(move(node->left), pos, left, node->left);
+                node->update();
+                right = move(node);
+            } else if (pos >= blockEnd) {
+                split(move(node->right), pos - blockEnd, node->right, right);
+                node->update();
+                left = move(node);
+            } else {
+                // The tail keeps this node's priority, which already dominates the right subtree
+                size_t cut = pos - leftSize;
+                string scratch;
+                NodeRef tail(new Node(string(node->data->raw(scratch) + cut, node->size() - cut), node->priority));
+                node->edit().resize(cut);
+                tail->right = move(node->right);
+                tail->update();
+                node->update();
+                left = move(node);
+                right = move(tail);
+            }
+        }
+
+        static NodeRef merge(NodeRef left, NodeRef right) {
+            if (!left) return right;
+            if (!right) return left;
+            if (left->priority >= right->priority) {
+                own(left);
+                left->right = merge(move(left->right), move(right));
+                left->update();
+                return left;
+            }
+            own(right);
+            right->left = merge(move(left), move(right->left));
+            right->update();
+            return right;
+        }
+
+        // Build a treap holding text[0, len) in BLOCK_SIZE pieces; with fullBlocks the last
+        // one has room for a whole block
+        static NodeRef build(const char* text, size_t len, bool fullBlocks = false) {
+            NodeRef result;
+            for (size_t done = 0; done < len; done += BLOCK_SIZE) {
+                size_t n = min(BLOCK_SIZE, len - done);
+                string bytes;
+                if (fullBlocks) bytes.reserve(BLOCK_SIZE);
+                bytes.append(text + done, n);
+                result = merge(move(result), NodeRef(new Node(move(bytes), randomPriority())));
+            }
+            return result;
+        }
+
+        // Find the block holding byte pos and the offset of pos inside it
+        Node* locate(size_t pos, size_t& offset) const {
+            Node* node = root.get();
+            while (node) {
+                size_t leftSize = total(node->left.get());
+                if (pos < leftSize) {
+                    node = node->left.get();
+                } else if (pos < leftSize + node->size()) {
+                    offset = pos - leftSize;
+                    return node;
+                } else {
+                    pos -= leftSize + node->size();
+                    node = node->right.get();
+                }
+            }
+            return nullptr;
+        }
+
+        // Add len to the subtree sizes on the way down to the block holding byte pos,
+        // copying shared nodes on the way. Returns that block, which the caller may
+        // then change but must grow by exactly len bytes.
+        Node* growPath(size_t pos, size_t len, size_t& offset) {
+            NodeRef* link = &root;
+            while (*link) {
+                Node* node = own(*link);
+                node->total += len;
+                node->packed = false;
+                size_t leftSize = total(node->left.get());
+                if (pos < leftSize) {
+                    link = &node->left;
+                } else if (pos < leftSize + node->size()) {
+                    offset = pos - leftSize;
+                    return node;
+                } else {
+                    pos -= leftSize + node->size();
+                    link = &node->right;
+                }
+            }
+            return nullptr;
+        }
+
+        template <typename Visit>
+        static void visitRange(const Node* node, size_t pos, size_t len, Visit& visit, string& scratch) {
+            while (node && len > 0) {
+                size_t leftSize = total(node->left.get());
+                if (pos < leftSize) {
+                    size_t fromLeft = min(len, leftSize - pos);
+                    visitRange(node->left.get(), pos, fromLeft, visit, scratch);
+                    len -= fromLeft;
+                    pos = leftSize;
+                    continue;
+                }
+                pos -= leftSize;
+                if (pos < node->size()) {
+                    size_t n = min(len, node->size() - pos);
+                    visit(string_view(node->data->raw(scratch) + pos, n));
+                    len -= n;
+                    pos = node->size();
+                }
+                pos -= node->size();
+                node = node->right.get();
+            }
+        }
+
+        template <typename Visit>
+        static void visitChunks(const Node* node, Visit& visit) {
+            while (node) {
+                visitChunks(node->left.get(), visit);
+                visit(node->data);
+                node = node->right.get();
+            }
+        }
+
+        // last is set on the right spine of the whole rope
+        static void pack(NodeRef& ref, const PackPolicy& policy, bool compress, bool all, bool last, bool keepLast) {
+            if (!ref || (ref->packed && !all)) return;
+            Node* node = own(ref); // Its chunk is about to be swapped
+            pack(node->left, policy, compress, all, false, keepLast);
+            pack(node->right, policy, compress, all, last, keepLast);
+            bool done = true;
+            bool lastBlock = last && !node->right;
+            if (lastBlock && keepLast) {
+                done = false; // Packed once appends have moved on to a later block
+            } else {
+                if (compress && !node->data->compressed) {
+                    if (lastBlock) done = false;
+                    else if (Chunk* packed = node->data->compress(policy.minSavingPercent)) node->data = ChunkRef(packed);
+                }
+                if (policy.store) policy.store->intern(node->data);
+            }
+            node->packed = done && (!node->left || node->left->packed) && (!node->right || node->right->packed);
+        }
+};
@@ -0,0 +1,152 @@
+#pragma once
+
+#include <string>
+#include <string_view>
+#include <cstdint>
+#include <cstring>
+#include <algorithm>
+#if !defined(FS_NO_SIMD) && defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define FS_X86_SEARCH
+#include <immintrin.h>
+#endif
+using namespace std;
+
+
+// Substring search for grep. The vector kernels compare the pattern's first and last
+// byte against 16 (SSE2) or 32 (AVX2) positions at once and check the rest with
+// memcmp only where both match, which on text skips almost every position without
+// a branch. The best kernel the CPU supports is picked at run time; builds for other
+// architectures, or with -DFS_NO_SIMD, use the scalar kernel, which steps through
+// candidates for the first byte with memchr.
+enum class SearchKernel {
+    Scalar,
+    Sse2,
+    Avx2
+};
+
+// Position of the first occurrence of needle[0, m) in text[0, n), or n if there is
+// none; m must be at least 1
+inline size_t searchScalar(const char* text, size_t n, const char* needle, size_t m) {
+    if (m > n) return n;
+    const char* end = text + n - m + 1; // One past the last possible start
+    for (const char* p = text; p < end; p++) {
+        p = static_cast<const char*>(memchr(p, needle[0], end - p));
+        if (!p) break;
+        if (memcmp(p + 1, needle + 1, m - 1) == 0) return p - text;
+    }
+    return n;
+}
+
+#ifdef FS_X86_SEARCH
+inline size_t searchSse2(const char* text, size_t n, const char* needle, size_t m) {
+    if (m > n) return n;
+    if (m == 1) return searchScalar(text, n, needle, m); // memchr is vectorized already
+    const __m128i first = _mm_set1_epi8(needle[0]);
+    const __m128i last = _mm_set1_epi8(needle[m - 1]);
+    size_t i = 0;
+    for (; i + m - 1 + 16 <= n; i += 16) {
+        __m128i atFirst = _mm_loadu_si128(reinterpret_cast<const __m128i*>(text + i));
+        __m128i atLast = _mm_loadu_si128(reinterpret_cast<const __m128i*>(text + i + m - 1));
+        unsigned mask = unsigned(_mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(first, atFirst), _mm_cmpeq_epi8(last, atLast))));
+        for (; mask; mask &= mask - 1) {
+            size_t candidate = i + __builtin_ctz(mask);
+            if (memcmp(text + candidate + 1, needle + 1, m - 2) == 0) return candidate;
+        }
+    }
+    size_t rest = searchScalar(text + i, n - i, needle, m); // Fewer than 16 starts left
+    return rest == n - i ? n : i + rest;
+}
+
+__attribute__((target("avx2"))) inline size_t searchAvx2(const char* text, size_t n, const char* needle, size_t m) {
+    if (m > n) return n;
+    if (m == 1) return searchScalar(text, n, needle, m);
+    const __m256i first = _mm256_set1_epi8(needle[0]);
+    const __m256i last = _mm256_set1_epi8(needle[m - 1]);
+    size_t i = 0;
+    for (; i + m - 1 + 32 <= n; i += 32) {
+        __m256i atFirst = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(text + i));
+        __m256i atLast = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(text + i + m - 1));
+        unsigned mask = unsigned(_mm256_movemask_epi8(_mm256_and_si256(_mm256_cmpeq_epi8(first, atFirst), _mm256_cmpeq_epi8(last, atLast))));
+        for (; mask; mask &= mask - 1) {
+            size_t candidate = i + __builtin_ctz(mask);
+            if (memcmp(text + candidate + 1, needle + 1, m - 2) == 0) return candidate;
+        }
+    }
+    size_t rest = searchSse2(text + i, n - i, needle, m);
+    return rest == n - i ? n : i + rest;
+}
+#endif
+
+// Fastest kernel this CPU runs
+inline SearchKernel bestSearchKernel() {
+#ifdef FS_X86_SEARCH
+    static const SearchKernel best = __builtin_cpu_supports("avx2") ? SearchKernel::Avx2 : SearchKernel::Sse2;
+    return best;
+#else
+    return SearchKernel::Scalar;
+#endif
+}
+
+inline bool searchKernelSupported(SearchKernel kernel) {
+#ifdef FS_X86_SEARCH
+    return kernel != SearchKernel::Avx2 || bestSearchKernel() == SearchKernel::Avx2;
+#else
+    return kernel == SearchKernel::Scalar;
+#endif
+}
+
+inline size_t searchWith(SearchKernel kernel, const char* text, size_t n, const char* needle, size_t m) {
+#ifdef FS_X86_SEARCH
+    if (kernel == SearchKernel::Avx2) return searchAvx2(text, n, needle, m);
+    if (kernel == SearchKernel::Sse2) return searchSse2(text, n, needle, m);
+#endif
+    return searchScalar(text, n, needle, m);
+}
+
+// Every occurrence of a pattern in text that arrives in pieces, such as the blocks
+// of a Rope. Occurrences may overlap and may span pieces: the last m - 1 bytes of
+// the text so far are kept to check the seams.
+class SubstringSearch {
+    public:
+        SubstringSearch(const string& pattern, SearchKernel kernel = bestSearchKernel())
+            : pattern(pattern), kernel(searchKernelSupported(kernel) ? kernel : SearchKernel::Scalar), consumed(0) {}
+
+        // Call found(offset) for every occurrence that ends in piece, in order, offsets
+        // counting from the start of the first piece. Returns false as soon as found does.
+        template <typename Found>
+        bool feed(string_view piece, Found found) {
+            size_t m = pattern.size();
+            if (m == 0) return true;
+            if (!carry.empty()) {
+                // Occurrences that start in the carried tail end in this piece
+                string seam = carry;
+                seam.append(piece.data(), min(piece.size(), m - 1));
+                size_t base = consumed - carry.size();
+                for (size_t at = 0; ; at++) {
+                    at += searchWith(kernel, seam.data() + at, seam.size() - at, pattern.data(), m);
+                    if (at >= carry.size() || at + m > seam.size()) break; // The rest lie within the piece
+                    if (!found(base + at)) return false;
+                }
+            }
+            for (size_t at = 0; at + m <= piece.size(); at++) {
+                at += searchWith(kernel, piece.data() + at, piece.size() - at, pattern.data(), m);
+                if (at + m > piece.size()) break;
+                if (!found(consumed + at)) return false;
+            }
+            // Keep the last m - 1 bytes for the next seam
+            if (piece.size() >= m - 1) {
+                carry.assign(piece.data() + piece.size() - (m - 1), m - 1);
+            } else {
+                carry.append(piece.data(), piece.size());
+                if (carry.size() > m - 1) carry.erase(0, carry.size() - (m - 1));
+            }
+            consumed += piece.size();
+            return true;
+        }
+
+    private:
+        string pattern;
+        SearchKernel kernel;
+        string carry; // Tail of the text fed so far, shorter than the pattern
+        size_t consumed; // Length of the text fed so far
+};
@@ -0,0 +1,26 @@
+#pragma once
+
+#include <iostream>
+#include <vector>
+#include <cstdint>
+#include "Directory.h"
+#include "Transaction.h"
+using namespace std;
+
+
+// Working-directory state of one command stream. Every CommandHandler owns its
+// own Session, so a chdir in one thread never changes where another thread's
+// commands land; the directory tree is the only state threads share.
+class Session {
+    public:
+        // Directory that relative names are resolved against. Its path is not kept here:
+        // another session may move the directory or one of its ancestors.
+        Directory* currentDir;
+        uint64_t journalSeq; // Last journal record of the current command, 0 if none
+        Transaction* transaction; // Open transaction whose locks this session holds, if any
+        ostream* output; // Where commands report what they did; cout unless the stream buffers it
+
+        Session(Directory* start = nullptr) : currentDir(start), journalSeq(0), transaction(nullptr), output(&cout) {}
+
+        ostream& messages() const { return *output; }
+};
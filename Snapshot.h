@@ -0,0 +1,95 @@
+#pragma once
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <mutex>
+#include <shared_mutex>
+#include "Directory.h"
+using namespace std;
+
+
+// A directory's entries at one point in time
+struct DirectoryVersion {
+    vector<pair<string, FileVersion>> files;
+    vector<pair<string, Directory*>> subdirectories; // Directories stay in place while a snapshot is open
+};
+
+// Point-in-time view of the tree, so a save can run while commands keep changing it.
+// Taking one costs nothing up front. Afterwards, the first change to a directory's
+// entries or to a file's content preserves the old version here (copy on write), and
+// the saver reads preserved versions where there are any and the live tree elsewhere.
+// Preserving a file shares its blocks (see Rope), so it is O(1); preserving a
+// directory copies its list of entries, not their contents.
+//
+// Versions are keyed by address. A file deleted after the snapshot is preserved
+// through its directory first, so a new file reusing the address cannot be mistaken
+// for it.
+class Snapshot {
+    public:
+        // Keep dir's entries before they change. Call with dir locked exclusively.
+        void preserve(const Directory& dir) {
+            {
+                shared_lock<shared_mutex> guard(lock);
+                if (dirs.count(&dir)) return;
+            }
+            DirectoryVersion version = capture(dir);
+            unique_lock<shared_mutex> guard(lock);
+            dirs.emplace(&dir, move(version));
+        }
+
+        // Keep file's content before it changes. Call with the file locked exclusively.
+        void preserve(const File& file) {
+            {
+                shared_lock<shared_mutex> guard(lock);
+                if (files.count(&file)) return;
+            }
+            FileVersion version = file.version();
+            unique_lock<shared_mutex> guard(lock);
+            files.emplace(&file, move(version));
+        }
+
+        // dir's entries when the snapshot was taken. Call with dir locked at least shared.
+        DirectoryVersion entries(const Directory& dir) const {
+            {
+                shared_lock<shared_mutex> guard(lock);
+                auto it = dirs.find(&dir);
+                if (it != dirs.end()) return it->second;
+            }
+            return capture(dir);
+        }
+
+        // True if dir's entries or the content of one of its files changed after the
+        // snapshot was taken. Call while nothing can change dir.
+        bool changed(const Directory& dir) const {
+            shared_lock<shared_mutex> guard(lock);
+            if (dirs.count(&dir)) return true;
+            for (const auto& f : dir.files) {
+                if (files.count(&f.second)) return true;
+            }
+            return false;
+        }
+
+    private:
+        mutable shared_mutex lock; // Guards both maps; taken after any directory or file lock
+        unordered_map<const Directory*, DirectoryVersion> dirs;
+        unordered_map<const File*, FileVersion> files;
+
+        // dir's live entries, with preserved versions of files changed since the snapshot
+        DirectoryVersion capture(const Directory& dir) const {
+            DirectoryVersion version;
+            version.files.reserve(dir.files.size());
+            for (const auto& f : dir.files) {
+                shared_lock<shared_mutex> fileGuard(f.second.lock); // A handle may be writing it
+                shared_lock<shared_mutex> guard(lock);
+                auto it = files.find(&f.second);
+                version.files.emplace_back(f.first, it != files.end() ? it->second : f.second.version());
+            }
+            version.subdirectories.reserve(dir.subdirectories.size());
+            for (const auto& d : dir.subdirectories) {
+                version.subdirectories.emplace_back(d.first, const_cast<Directory*>(&d.second));
+            }
+            return version;
+        }
+};
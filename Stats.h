@@ -0,0 +1,286 @@
+#pragma once
+
+#include <iostream>
+#include <iomanip>
+#include <vector>
+#include <iterator>
+#include <algorithm>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include "Command.h"
+using namespace std;
+
+
+// Lock families whose acquisitions Stats times
+enum class LockKind : uint8_t {
+    Global,     // fs_mutex in LockMode::Global
+    Checkpoint, // FileSystem::checkpointLock, taken shared by every mutation
+    Layout,     // FileSystem::layoutLock, taken shared while paths are resolved
+    Directory,  // Directory::lock
+    File,       // File::lock
+    Count
+};
+
+const char* const LOCK_KIND_NAMES[] = {"global", "checkpoint", "layout", "directory", "file"};
+
+const size_t OPCODE_COUNT = size_t(Opcode::Unknown) + 1;
+const size_t LOCK_KIND_COUNT = size_t(LockKind::Count);
+
+// Durations in nanoseconds, bucketed by powers of two: bucket 0 holds 0, bucket i
+// holds [2^(i-1), 2^i). Percentiles are reported as the upper end of their bucket,
+// so they are at most twice the true value; the maximum is exact.
+const size_t HISTOGRAM_BUCKETS = 48; // Bucket 47 starts at about 39 hours
+
+inline size_t histogramBucket(uint64_t value) {
+    size_t bucket = 0;
+    for (size_t shift = 32; shift > 0; shift /= 2) {
+        if (value >> shift) {
+            value >>= shift;
+            bucket += shift;
+        }
+    }
+    return min(bucket + (value ? 1 : 0), HISTOGRAM_BUCKETS - 1);
+}
+
+// Merged view of any number of histograms
+struct HistogramTotals {
+    uint64_t buckets[HISTOGRAM_BUCKETS] = {};
+    uint64_t count = 0;
+    uint64_t sum = 0;
+    uint64_t max = 0;
+
+    // Smallest bucket bound at or below which fraction q of the values lie
+    uint64_t percentile(double q) const {
+        if (count == 0) return 0;
+        uint64_t rank = uint64_t(q * double(count - 1)) + 1, seen = 0;
+        for (size_t i = 0; i < HISTOGRAM_BUCKETS; i++) {
+            seen += buckets[i];
+            if (seen >= rank) return i == 0 ? 0 : min(max, (uint64_t(1) << i) - 1);
+        }
+        return max;
+    }
+
+    uint64_t mean() const { return count ? sum / count : 0; }
+
+    void merge(const HistogramTotals& other) {
+        for (size_t i = 0; i < HISTOGRAM_BUCKETS; i++) buckets[i] += other.buckets[i];
+        count += other.count;
+        sum += other.sum;
+        max = std::max(max, other.max);
+    }
+};
+
+// A counter written by one thread and read by any. Updates are a plain load and
+// store, with no locked instruction, because the owning thread is the only writer.
+class LocalCounter {
+    public:
+        LocalCounter() : value(0) {}
+
+        void add(uint64_t amount) { value.store(value.load(memory_order_relaxed) + amount, memory_order_relaxed); }
+        void raise(uint64_t candidate) {
+            if (candidate > value.load(memory_order_relaxed)) value.store(candidate, memory_order_relaxed);
+        }
+        uint64_t get() const { return value.load(memory_order_relaxed); }
+        void clear() { value.store(0, memory_order_relaxed); }
+
+    private:
+        atomic<uint64_t> value;
+};
+
+class LocalHistogram {
+    public:
+        void record(uint64_t value) {
+            buckets[histogramBucket(value)].add(1);
+            count.add(1);
+            sum.add(value);
+            max.raise(value);
+        }
+
+        void addTo(HistogramTotals& totals) const {
+            for (size_t i = 0; i < HISTOGRAM_BUCKETS; i++) totals.buckets[i] += buckets[i].get();
+            totals.count += count.get();
+            totals.sum += sum.get();
+            totals.max = std::max(totals.max, max.get());
+        }
+
+        void clear() {
+            for (LocalCounter& bucket : buckets) bucket.clear();
+            count.clear();
+            sum.clear();
+            max.clear();
+        }
+
+    private:
+        LocalCounter buckets[HISTOGRAM_BUCKETS];
+        LocalCounter count, sum, max;
+};
+
+// Everything Stats reports, merged over all threads
+struct StatsTotals {
+    HistogramTotals commands[OPCODE_COUNT]; // processCommand latency per opcode
+    HistogramTotals lockWaits[LOCK_KIND_COUNT]; // Time spent blocked, for contended acquisitions only
+    uint64_t lockAcquisitions[LOCK_KIND_COUNT] = {}; // Contended or not
+    uint64_t bytesRead = 0; // File content read and read_from returned
+    uint64_t bytesWritten = 0; // Text write and write_at stored
+
+    void merge(const StatsTotals& other) {
+        for (size_t i = 0; i < OPCODE_COUNT; i++) commands[i].merge(other.commands[i]);
+        for (size_t i = 0; i < LOCK_KIND_COUNT; i++) {
+            lockWaits[i].merge(other.lockWaits[i]);
+            lockAcquisitions[i] += other.lockAcquisitions[i];
+        }
+        bytesRead += other.bytesRead;
+        bytesWritten += other.bytesWritten;
+    }
+};
+
+// Process-wide command and lock metrics. Every thread records into a shard of its
+// own, so recording costs a few uncontended stores and never a shared cache line;
+// snapshot() adds the shards up when someone asks. A thread's shard is folded into
+// the retired totals when the thread exits, so short-lived threads leave their
+// counts behind without leaving their shards.
+class Stats {
+    public:
+        using Clock = chrono::steady_clock;
+
+        static void command(Opcode op, uint64_t nanos) { local().commands[size_t(op)].record(nanos); }
+        static void read(uint64_t bytes) { local().bytesRead.add(bytes); }
+        static void written(uint64_t bytes) { local().bytesWritten.add(bytes); }
+
+        static uint64_t since(Clock::time_point start) {
+            return uint64_t(chrono::duration_cast<chrono::nanoseconds>(Clock::now() - start).count());
+        }
+
+        // Lock guard on mutex, acquired the way Guard(mutex) would. An uncontended
+        // acquisition is only counted; the clock is read only when the lock is busy.
+        template <class Guard, class Mutex>
+        static Guard acquire(Mutex& mutex, LockKind kind) {
+            Shard& shard = local();
+            shard.lockAcquisitions[size_t(kind)].add(1);
+            Guard guard(mutex, try_to_lock);
+            if (guard.owns_lock()) return guard;
+            Clock::time_point start = Clock::now();
+            guard.lock();
+            shard.lockWaits[size_t(kind)].record(since(start));
+            return guard;
+        }
+
+        // Lock guard on mutex if it is free right now, counted like acquire; otherwise an
+        // empty guard, and nothing is counted
+        template <class Guard, class Mutex>
+        static Guard tryAcquire(Mutex& mutex, LockKind kind) {
+            Guard guard(mutex, try_to_lock);
+            if (guard.owns_lock()) local().lockAcquisitions[size_t(kind)].add(1);
+            return guard;
+        }
+
+        static StatsTotals snapshot() {
+            Registry& registry = instance();
+            lock_guard<mutex> guard(registry.lock);
+            StatsTotals totals = registry.retired;
+            for (Shard* shard : registry.shards) shard->addTo(totals);
+            return totals;
+        }
+
+        static void print(ostream& out, const StatsTotals& totals) {
+            auto micros = [](uint64_t nanos) { return double(nanos) / 1000; };
+            out << fixed << setprecision(1);
+            out << "Commands (latency in microseconds):\n";
+            out << "  " << left << setw(12) << "command" << right << setw(10) << "count" << setw(10) << "mean"
+                << setw(10) << "p50" << setw(10) << "p99" << setw(12) << "max" << "\n";
+            for (size_t i = 0; i < OPCODE_COUNT; i++) {
+                const HistogramTotals& h = totals.commands[i];
+                if (h.count == 0) continue;
+                const char* name = i < size(COMMAND_TABLE) ? COMMAND_TABLE[i].name : "unknown";
+                out << "  " << left << setw(12) << name << right << setw(10) << h.count << setw(10) << micros(h.mean())
+                    << setw(10) << micros(h.percentile(0.5)) << setw(10) << micros(h.percentile(0.99))
+                    << setw(12) << micros(h.max) << "\n";
+            }
+            out << "Lock waits (microseconds, contended acquisitions only):\n";
+            out << "  " << left << setw(12) << "lock" << right << setw(12) << "acquired" << setw(10) << "waited"
+                << setw(10) << "p50" << setw(10) << "p99" << setw(12) << "max" << setw(14) << "total" << "\n";
+            for (size_t i = 0; i < LOCK_KIND_COUNT; i++) {
+                const HistogramTotals& h = totals.lockWaits[i];
+                if (totals.lockAcquisitions[i] == 0) continue;
+                out << "  " << left << setw(12) << LOCK_KIND_NAMES[i] << right << setw(12) << totals.lockAcquisitions[i]
+                    << setw(10) << h.count << setw(10) << micros(h.percentile(0.5)) << setw(10) << micros(h.percentile(0.99))
+                    << setw(12) << micros(h.max) << setw(14) << micros(h.sum) << "\n";
+            }
+            out << "Bytes read: " << totals.bytesRead << ", written: " << totals.bytesWritten << "\n";
+            out << defaultfloat;
+        }
+
+        // Forget everything recorded so far, for benchmarks that measure phases separately
+        static void reset() {
+            Registry& registry = instance();
+            lock_guard<mutex> guard(registry.lock);
+            registry.retired = StatsTotals();
+            for (Shard* shard : registry.shards) shard->clear();
+        }
+
+    private:
+        struct Shard {
+            LocalHistogram commands[OPCODE_COUNT];
+            LocalHistogram lockWaits[LOCK_KIND_COUNT];
+            LocalCounter lockAcquisitions[LOCK_KIND_COUNT];
+            LocalCounter bytesRead, bytesWritten;
+
+            void addTo(StatsTotals& totals) const {
+                for (size_t i = 0; i < OPCODE_COUNT; i++) commands[i].addTo(totals.commands[i]);
+                for (size_t i = 0; i < LOCK_KIND_COUNT; i++) {
+                    lockWaits[i].addTo(totals.lockWaits[i]);
+                    totals.lockAcquisitions[i] += lockAcquisitions[i].get();
+                }
+                totals.bytesRead += bytesRead.get();
+                totals.bytesWritten += bytesWritten.get();
+            }
+
+            // The owner may be recording at the same moment, so an update can survive the reset
+            void clear() {
+                for (LocalHistogram& h : commands) h.clear();
+                for (LocalHistogram& h : lockWaits) h.clear();
+                for (LocalCounter& c : lockAcquisitions) c.clear();
+                bytesRead.clear();
+                bytesWritten.clear();
+            }
+        };
+
+        struct Registry {
+            mutex lock;
+            vector<Shard*> shards; // One per live thread that has recorded anything
+            StatsTotals retired; // Shards of threads that have exited
+        };
+
+        // Registers the calling thread's shard on first use and retires it at thread exit
+        struct Owner {
+            Shard* shard;
+
+            Owner() : shard(new Shard()) {
+                Registry& registry = instance();
+                lock_guard<mutex> guard(registry.lock);
+                registry.shards.push_back(shard);
+            }
+
+            ~Owner() {
+                Registry& registry = instance();
+                lock_guard<mutex> guard(registry.lock);
+                shard->addTo(registry.retired);
+                registry.shards.erase(find(registry.shards.begin(), registry.shards.end(), shard));
+                delete shard;
+            }
+        };
+
+        // Outlives every thread's Owner, including the main thread's
+        static Registry& instance() {
+            static Registry* registry = new Registry();
+            return *registry;
+        }
+
+        static Shard& local() {
+            static thread_local Owner owner;
+            return *owner.shard;
+        }
+};
@@ -0,0 +1,88 @@
+#pragma once
+
+#include <iostream>
+#include <vector>
+#include <algorithm>
+#include <functional>
+#include <mutex>
+#include <shared_mutex>
+#include "Directory.h"
+#include "Journal.h"
+#include "Stats.h"
+using namespace std;
+
+
+// Locks held by a group of commands that must apply as one. The checkpoint lock is
+// taken shared, then every directory the group works in exclusively, shallowest
+// first and by address among equals: the same parent-before-child order that
+// tree walks such as saveDir use, so neither can deadlock with a transaction.
+// FileSystem skips taking locks the session's transaction holds.
+//
+// While the locks are held no other session can reach the files in those
+// directories, so undo steps and journal records simply collect here until the
+// transaction commits or rolls back.
+class Transaction {
+    public:
+        Transaction(shared_mutex& checkpointLock, vector<Directory*> dirs)
+            : checkpoint(Stats::acquire<shared_lock<shared_mutex>>(checkpointLock, LockKind::Checkpoint)), dirs(move(dirs)) {
+            sort(this->dirs.begin(), this->dirs.end(), lockOrder);
+            this->dirs.erase(unique(this->dirs.begin(), this->dirs.end()), this->dirs.end());
+            for (Directory* dir : this->dirs) locks.push_back(Stats::acquire<unique_lock<shared_mutex>>(dir->lock, LockKind::Directory));
+        }
+
+        Transaction(const Transaction&) = delete;
+        Transaction& operator=(const Transaction&) = delete;
+
+        bool holds(const Directory* dir) const {
+            return find(dirs.begin(), dirs.end(), dir) != dirs.end() || find(created.begin(), created.end(), dir) != created.end();
+        }
+
+        // Count a directory the transaction just created as held. Its parent is locked, so
+        // nobody else can reach it before the transaction ends.
+        void adopt(Directory* dir) {
+            created.push_back(dir);
+        }
+
+        // True if dirs names exactly the directories this transaction locked. A nullptr
+        // stands for a directory that could not be looked up, and never matches.
+        bool covers(vector<Directory*> other) const {
+            if (find(other.begin(), other.end(), nullptr) != other.end()) return false;
+            sort(other.begin(), other.end(), lockOrder);
+            other.erase(unique(other.begin(), other.end()), other.end());
+            return other == dirs;
+        }
+
+        // Register the inverse of a change just made; rollback runs them newest first
+        void onRollback(function<void()> step) {
+            undo.push_back(move(step));
+        }
+
+        void rollback() {
+            for (auto it = undo.rbegin(); it != undo.rend(); ++it) (*it)();
+            undo.clear();
+            records.clear();
+        }
+
+        vector<JournalRecord> records; // Journaled as one frame when the transaction commits
+
+        // Shallowest first, by address among equals. Depths are only stable while the
+        // checkpoint lock is held, since directory moves take it exclusively.
+        static bool lockOrder(const Directory* a, const Directory* b) {
+            size_t depthA = depth(a), depthB = depth(b);
+            return depthA != depthB ? depthA < depthB : less<const Directory*>()(a, b);
+        }
+
+    private:
+        shared_lock<shared_mutex> checkpoint;
+        vector<Directory*> dirs; // In lock order
+        vector<unique_lock<shared_mutex>> locks;
+        vector<Directory*> created; // Directories the transaction created, not locked
+        vector<function<void()>> undo;
+
+        static size_t depth(const Directory* dir) {
+            size_t levels = 0;
+            for (; dir->parent; dir = dir->parent) levels++;
+            return levels;
+        }
+
+};
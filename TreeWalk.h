@@ -0,0 +1,90 @@
+#pragma once
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <mutex>
+#include <shared_mutex>
+#include "Directory.h"
+#include "Executor.h"
+#include "Stats.h"
+using namespace std;
+
+
+// One directory reached by walkTree, with what the visitor collected there. The
+// nodes form a copy of the tree's shape, so results can be merged in tree order
+// once the walk is over, however the directories were spread over the workers.
+template <class Output>
+struct WalkNode {
+    string name; // As listed in the parent
+    string path; // Absolute, "" for the root
+    size_t depth = 0; // Levels below the directory the walk started from
+    Output output;
+    vector<WalkNode> children; // Subdirectories, in listing order
+};
+
+template <class Output, class Visit>
+void walkDirectory(TaskGroup& group, Directory* dir, WalkNode<Output>& node, const Visit& visit) {
+    vector<Directory*> subdirectories;
+    {
+        shared_lock<shared_mutex> guard = Stats::acquire<shared_lock<shared_mutex>>(dir->lock, LockKind::Directory);
+        visit(*dir, node);
+        node.children.resize(dir->subdirectories.size());
+        subdirectories.reserve(dir->subdirectories.size());
+        size_t i = 0;
+        for (auto& d : dir->subdirectories) {
+            WalkNode<Output>& child = node.children[i++];
+            child.name = d.first;
+            child.path = node.path + "/" + d.first;
+            child.depth = node.depth + 1;
+            subdirectories.push_back(&d.second);
+        }
+    }
+    // Hand every subdirectory but the last to the group and walk that one here
+    for (size_t i = 0; i + 1 < subdirectories.size(); i++) {
+        Directory* child = subdirectories[i];
+        WalkNode<Output>* childNode = &node.children[i];
+        group.run([&group, child, childNode, &visit] { walkDirectory(group, child, *childNode, visit); });
+    }
+    if (!subdirectories.empty()) walkDirectory(group, subdirectories.back(), node.children.back(), visit);
+}
+
+// Call visit(directory, node) for start and every directory below it, fork-join
+// style on executor's workers (on the calling thread alone without one). Each
+// directory is read-locked only while it is visited and its subdirectories are
+// listed, never while the walk goes on below it, so a walk of a large tree holds
+// up a writer for one directory's worth of work at most. The visitor must only
+// write to node.output.
+//
+// Directories are never freed while the tree is in use: a transaction that rolls
+// back a directory it created holds the parent locked exclusively throughout, so
+// no walk can have listed it. A directory moved while the walk runs may be seen
+// at both places or at neither.
+template <class Output, class Visit>
+void walkTree(Executor* executor, Directory* start, WalkNode<Output>& root, const Visit& visit) {
+    TaskGroup group(executor);
+    walkDirectory(group, start, root, visit);
+    group.wait();
+}
+
+// Shell-style wildcard match of the whole name: '*' matches any run of characters,
+// '?' any single one. Backtracks to the last '*' only, so it runs in O(n * m).
+inline bool globMatch(const string& pattern, const string& name) {
+    size_t p = 0, n = 0, star = string::npos, resume = 0;
+    while (n < name.size()) {
+        if (p < pattern.size() && pattern[p] == '*') {
+            star = p++;
+            resume = n;
+        } else if (p < pattern.size() && (pattern[p] == '?' || pattern[p] == name[n])) {
+            p++;
+            n++;
+        } else if (star != string::npos) {
+            p = star + 1;
+            n = ++resume;
+        } else {
+            return false;
+        }
+    }
+    while (p < pattern.size() && pattern[p] == '*') p++;
+    return p == pattern.size();
+}
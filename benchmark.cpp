@@ -0,0 +1,1252 @@
+#include "FileSystem.h"
+#include "CommandUtils.h"
+#include "CommandHandler.h"
+#include "Executor.h"
+#include <iostream>
+#include <sstream>
+#include <thread>
+#include <vector>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <random>
+#include <cmath>
+#include <iomanip>
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
+
+using namespace std;
+
+// Discards everything written to it; used to keep command output off the console
+class NullBuffer : public streambuf {
+    protected:
+        int overflow(int c) override { return c; }
+        streamsize xsputn(const char*, streamsize n) override { return n; }
+};
+
+// Runs opsPerThread command pairs on each thread, every thread working on its own file
+double runScaling(int threadCount, int opsPerThread, LockMode mode, size_t fileSize) {
+    FileSystem fs;
+    Session setup = fs.newSession();
+    for (int t = 0; t < threadCount; t++) {
+        string fname = "bench" + to_string(t) + ".txt";
+        fs.createFile(setup, fname);
+        {
+            FileRef file = fs.openFile(setup, fname);
+            file->write_to_file(string(fileSize, 'a' + t % 26));
+        } // Release the handle's locks before closing
+        fs.closeFile(setup, fname);
+    }
+
+    mutex globalLock;
+    auto worker = [&](int t) {
+        CommandHandler handler(fs);
+        string fname = "bench" + to_string(t) + ".txt";
+        vector<string> script = {
+            "read_from " + fname + " 0 4096",
+            "close " + fname,
+            "move_within " + fname + " 0 1024 " + to_string(fileSize / 2),
+            "close " + fname
+        };
+        for (int i = 0; i < opsPerThread; i++) {
+            for (const string& line : script) {
+                unique_lock<mutex> lock(globalLock, defer_lock);
+                if (mode == LockMode::Global) lock.lock();
+                handler.processCommand(line);
+            }
+        }
+    };
+
+    auto start = chrono::steady_clock::now();
+    vector<thread> threads;
+    for (int t = 0; t < threadCount; t++) threads.emplace_back(worker, t);
+    for (auto& th : threads) th.join();
+    chrono::duration<double> elapsed = chrono::steady_clock::now() - start;
+
+    return threadCount * opsPerThread * 4 / elapsed.count(); // Commands per second
+}
+
+void scalingBenchmark(ostream& report, int maxThreads, int opsPerThread, size_t fileSize) {
+    report << "Lock scaling: " << opsPerThread << " iterations of 4 commands per thread, "
+         << fileSize << "-byte files\n";
+    report << "threads   global (cmd/s)   fine (cmd/s)   speedup\n";
+    for (int t = 1; t <= maxThreads; t++) {
+        double global = runScaling(t, opsPerThread, LockMode::Global, fileSize);
+        double fine = runScaling(t, opsPerThread, LockMode::FineGrained, fileSize);
+        report << t << "\t  " << (long long)global << "\t\t   " << (long long)fine
+             << "\t  " << fine / global << "x\n";
+    }
+}
+
+// Fill fs with fileCount files of fileSize bytes, 100 files per directory
+void buildTree(FileSystem& fs, int fileCount, size_t fileSize) {
+    Session session = fs.newSession();
+    string content(fileSize, 'x');
+    for (int i = 0; i < fileCount; i++) {
+        if (i % 100 == 0) {
+            if (i > 0) fs.chDir(session, "..");
+            string dname = "dir" + to_string(i / 100);
+            fs.mkdir(session, dname);
+            fs.chDir(session, dname);
+        }
+        string fname = "file" + to_string(i) + ".txt";
+        fs.createFile(session, fname);
+        {
+            FileRef file = fs.openFile(session, fname);
+            file->write_to_file(content);
+        }
+        fs.closeFile(session, fname);
+    }
+}
+
+// Time loadFromFile on an image holding fileCount files of fileSize bytes
+void loadBenchmark(ostream& report, int fileCount, size_t fileSize) {
+    const string imageName = "bench_image.dat";
+    {
+        FileSystem fs;
+        buildTree(fs, fileCount, fileSize);
+        fs.saveToFile(imageName);
+    }
+    ifstream image(imageName, ios::binary | ios::ate);
+    double megabytes = double(image.tellg()) / (1024 * 1024);
+    image.close();
+
+    report << "Startup load: " << fileCount << " files of " << fileSize << " bytes, "
+           << megabytes << " MiB image\n";
+    for (LoadMode mode : {LoadMode::Eager, LoadMode::Lazy}) {
+        for (int run = 1; run <= 3; run++) {
+            FileSystem fs;
+            auto start = chrono::steady_clock::now();
+            fs.loadFromFile(imageName, mode);
+            chrono::duration<double> elapsed = chrono::steady_clock::now() - start;
+            report << (mode == LoadMode::Eager ? "eager" : "lazy ") << " run " << run << ": "
+                   << elapsed.count() * 1000 << " ms (" << megabytes / elapsed.count() << " MiB/s)\n";
+        }
+    }
+    remove(imageName.c_str());
+}
+
+// Time a full save against saves after a single-file change, which only re-encode the changed directory
+void saveBenchmark(ostream& report, int fileCount, size_t fileSize) {
+    const string imageName = "bench_image.dat";
+    FileSystem fs;
+    buildTree(fs, fileCount, fileSize);
+
+    auto start = chrono::steady_clock::now();
+    fs.saveToFile(imageName);
+    chrono::duration<double> full = chrono::steady_clock::now() - start;
+    report << "Checkpoint: " << fileCount << " files of " << fileSize << " bytes\n";
+    report << "full save:        " << full.count() * 1000 << " ms\n";
+
+    Session session = fs.newSession();
+    for (int run = 1; run <= 3; run++) {
+        int i = (run * 7919) % fileCount; // Any file; the others stay untouched
+        fs.chDir(session, "dir" + to_string(i / 100));
+        {
+            FileRef file = fs.openFile(session, "file" + to_string(i) + ".txt");
+            file->write_at(0, "changed");
+        }
+        fs.closeFile(session, "file" + to_string(i) + ".txt");
+        fs.chDir(session, "..");
+
+        start = chrono::steady_clock::now();
+        fs.saveToFile(imageName);
+        chrono::duration<double> elapsed = chrono::steady_clock::now() - start;
+        report << "incremental run " << run << ": " << elapsed.count() * 1000 << " ms\n";
+    }
+    remove(imageName.c_str());
+}
+
+// Writers keep changing files while the tree is saved from a snapshot; reports how
+// long each save took and the longest any single write waited meanwhile
+void snapshotBenchmark(ostream& report, int fileCount, size_t fileSize, int writerCount) {
+    const string imageName = "bench_image.dat";
+    FileSystem fs;
+    buildTree(fs, fileCount, fileSize);
+
+    atomic<bool> stop(false);
+    atomic<long long> writes(0);
+    atomic<long long> longestWrite(0); // Microseconds
+    auto writer = [&](int t) {
+        Session session = fs.newSession();
+        long long count = 0, longest = 0;
+        for (int i = t; !stop.load(memory_order_relaxed); i = i + writerCount < fileCount ? i + writerCount : t) { // Files of its own
+            string path = "/dir" + to_string(i / 100) + "/file" + to_string(i) + ".txt";
+            auto start = chrono::steady_clock::now();
+            {
+                FileRef file = fs.openFile(session, path);
+                file->write_at(i % fileSize, "changed");
+            }
+            fs.closeFile(session, path);
+            long long waited = chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - start).count();
+            longest = max(longest, waited);
+            count++;
+        }
+        writes += count;
+        long long seen = longestWrite.load();
+        while (seen < longest && !longestWrite.compare_exchange_weak(seen, longest)) {}
+    };
+
+    report << "Save while writing: " << fileCount << " files of " << fileSize << " bytes, "
+           << writerCount << " writer threads\n";
+    vector<thread> threads;
+    for (int t = 0; t < writerCount; t++) threads.emplace_back(writer, t);
+    auto begin = chrono::steady_clock::now();
+    for (int run = 1; run <= 3; run++) {
+        auto start = chrono::steady_clock::now();
+        fs.saveToFile(imageName);
+        chrono::duration<double> elapsed = chrono::steady_clock::now() - start;
+        report << "save " << run << ": " << elapsed.count() * 1000 << " ms\n";
+    }
+    stop = true;
+    for (auto& th : threads) th.join();
+    chrono::duration<double> total = chrono::steady_clock::now() - begin;
+    report << "writes during saves: " << (long long)(writes / total.count()) << " per second, longest "
+           << longestWrite / 1000.0 << " ms\n";
+    remove(imageName.c_str());
+}
+
+// Commands/sec for the input_thread<N>.txt scripts: parsing alone, then parsing and
+// running them against an in-memory file system with a fresh handler per pass
+void commandBenchmark(ostream& report, int iterations) {
+    vector<string> lines;
+    for (int i = 1; ; i++) {
+        ifstream script("input_thread" + to_string(i) + ".txt");
+        if (!script) break;
+        string line;
+        while (getline(script, line)) {
+            if (!line.empty()) lines.push_back(line);
+        }
+    }
+    if (lines.empty()) {
+        report << "No input_thread<N>.txt scripts found in the current directory\n";
+        return;
+    }
+    double total = double(lines.size()) * iterations;
+    report << "Command dispatch: " << lines.size() << " script lines x " << iterations << " passes\n";
+
+    auto start = chrono::steady_clock::now();
+    size_t checksum = 0; // Keeps the parse loop from being optimized away
+    for (int i = 0; i < iterations; i++) {
+        for (const string& line : lines) checksum += size_t(parseCommand(line).op);
+    }
+    chrono::duration<double> elapsed = chrono::steady_clock::now() - start;
+    report << "parse only:  " << (long long)(total / elapsed.count()) << " cmd/s (" << checksum % 2 << ")\n";
+
+    FileSystem fs;
+    start = chrono::steady_clock::now();
+    for (int i = 0; i < iterations; i++) {
+        CommandHandler handler(fs);
+        for (const string& line : lines) handler.processCommand(line);
+    }
+    elapsed = chrono::steady_clock::now() - start;
+    report << "parse + run: " << (long long)(total / elapsed.count()) << " cmd/s\n";
+}
+
+// Opens and closes a file at the bottom of a deep, wide tree: once by walking down with
+// chdir and back up, once by its absolute path, which after the first lookup comes
+// from the path cache
+void pathBenchmark(ostream& report, int depth, int width, int lookups) {
+    FileSystem fs;
+    Session setup = fs.newSession();
+    vector<string> names; // Directory names along the path to the file
+    string path;
+    for (int level = 0; level < depth; level++) {
+        for (int i = 0; i < width; i++) fs.mkdir(setup, "dir" + to_string(i)); // Siblings make every level wide
+        names.push_back("dir" + to_string(width / 2));
+        path += "/" + names.back();
+        fs.chDir(setup, names.back());
+    }
+    fs.createFile(setup, "leaf.txt");
+    path += "/leaf.txt";
+    report << "Path resolution: depth " << depth << ", " << width << " directories per level, " << lookups << " lookups\n";
+
+    Session session = fs.newSession();
+    auto start = chrono::steady_clock::now();
+    for (int i = 0; i < lookups; i++) {
+        for (const string& name : names) fs.chDir(session, name);
+        fs.openFile(session, "leaf.txt", Access::Read);
+        fs.closeFile(session, "leaf.txt");
+        for (size_t level = 0; level < names.size(); level++) fs.chDir(session, "..");
+    }
+    chrono::duration<double> elapsed = chrono::steady_clock::now() - start;
+    report << "chdir walk: " << (long long)(lookups / elapsed.count()) << " lookups/s\n";
+
+    start = chrono::steady_clock::now();
+    for (int i = 0; i < lookups; i++) {
+        fs.openFile(session, path, Access::Read);
+        fs.closeFile(session, path);
+    }
+    elapsed = chrono::steady_clock::now() - start;
+    report << "full path:  " << (long long)(lookups / elapsed.count()) << " lookups/s\n";
+}
+
+// Bytes currently allocated from the heap, or 0 where the C library cannot tell
+size_t heapInUse() {
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 33))
+    return mallinfo2().uordblks;
+#else
+    return 0;
+#endif
+}
+
+// Heap bytes per file for a tree of empty files, 1000 to a directory, and how full the
+// node pools are. Build with -DFS_NO_NODE_POOL to compare with std::allocator nodes.
+void memoryBenchmark(ostream& report, int fileCount) {
+    const int filesPerDir = 1000;
+    size_t before = heapInUse();
+    auto start = chrono::steady_clock::now();
+    FileSystem fs;
+    Session session = fs.newSession();
+    for (int d = 0; d * filesPerDir < fileCount; d++) {
+        string dname = "dir" + to_string(d);
+        fs.mkdir(session, dname);
+        fs.chDir(session, dname);
+        for (int i = 0; i < filesPerDir && d * filesPerDir + i < fileCount; i++) fs.createFile(session, "file" + to_string(i) + ".txt");
+        fs.chDir(session, "..");
+    }
+    chrono::duration<double> elapsed = chrono::steady_clock::now() - start;
+    size_t used = heapInUse() - before;
+
+    report << "Memory: " << fileCount << " empty files, " << filesPerDir << " per directory\n";
+    report << "sizeof(File) " << sizeof(File) << ", sizeof(Directory) " << sizeof(Directory) << "\n";
+    if (used > 0) report << "heap: " << double(used) / fileCount << " bytes per file\n";
+    else report << "heap: not measurable with this C library\n";
+    report << "build: " << elapsed.count() * 1000 << " ms\n";
+    for (const NodePoolStats* pool : NodePoolStats::all()) {
+        report << "pool of " << pool->blockSize() << "-byte nodes: " << pool->liveBlocks() << " live, "
+               << pool->reservedBytes() / 1024 << " KiB reserved\n";
+    }
+}
+
+// Heap, save and load cost of a tree where every file has a copy under Backup, with
+// and without content-addressed chunks
+void dedupBenchmark(ostream& report, int fileCount, size_t fileSize) {
+    const string imageName = "bench_image.dat";
+    report << "Dedup: " << fileCount << " files of " << fileSize << " bytes, each with a backup copy\n";
+    report << "mode   heap (MiB)   save (ms)   image (MiB)   load (ms)\n";
+    for (bool dedup : {false, true}) {
+        size_t before = heapInUse();
+        double saveTime, loadTime, megabytes;
+        {
+            FileSystem fs;
+            if (dedup) fs.enableDedup();
+            Session session = fs.newSession();
+            fs.mkdir(session, "Projects");
+            fs.mkdir(session, "Backup");
+            uint32_t state = 12345; // Same content for a file and its copy, different between files
+            string content(fileSize, ' ');
+            for (int i = 0; i < fileCount; i++) {
+                for (char& c : content) {
+                    state = state * 1103515245u + 12345u;
+                    c = char('a' + (state >> 16) % 26);
+                }
+                for (const char* dir : {"/Projects/", "/Backup/"}) {
+                    string path = dir + ("file" + to_string(i) + ".txt");
+                    fs.createFile(session, path);
+                    {
+                        FileRef file = fs.openFile(session, path);
+                        file->write_to_file(content);
+                    }
+                    fs.closeFile(session, path);
+                }
+            }
+            size_t used = heapInUse() - before;
+
+            auto start = chrono::steady_clock::now();
+            fs.saveToFile(imageName);
+            saveTime = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+            ifstream image(imageName, ios::binary | ios::ate);
+            megabytes = double(image.tellg()) / (1024 * 1024);
+
+            FileSystem loaded;
+            if (dedup) loaded.enableDedup();
+            start = chrono::steady_clock::now();
+            loaded.loadFromFile(imageName, LoadMode::Eager);
+            loadTime = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+            report << (dedup ? "on " : "off") << "    " << double(used) / (1024 * 1024) << "\t\t" << saveTime * 1000
+                   << "\t   " << megabytes << "\t " << loadTime * 1000 << "\n";
+        }
+    }
+    remove(imageName.c_str());
+}
+
+// Log-like files written in appends, with compression off and on: memory held, save
+// and load time, image size, and the cost of small reads that unpack blocks
+void compressBenchmark(ostream& report, int fileCount, size_t fileSize) {
+    const string imageName = "bench_image.dat";
+    const int readCount = 100000;
+    report << "Compression: " << fileCount << " log files of " << fileSize << " bytes, " << readCount << " reads of 100 bytes\n";
+    report << "mode   heap (MiB)   save (ms)   image (MiB)   load (ms)   read (us)\n";
+    for (bool compress : {false, true}) {
+        size_t before = heapInUse();
+        double saveTime, loadTime, readTime, megabytes;
+        {
+            FileSystem fs;
+            if (compress) fs.enableCompression(64 << 10);
+            Session session = fs.newSession();
+            fs.mkdir(session, "Logs");
+            uint32_t state = 12345;
+            const char* levels[] = {"INFO", "WARN", "DEBUG", "ERROR"};
+            for (int i = 0; i < fileCount; i++) {
+                string path = "/Logs/service" + to_string(i) + ".log";
+                fs.createFile(session, path);
+                size_t written = 0;
+                for (int line = 0; written < fileSize; line++) {
+                    state = state * 1103515245u + 12345u;
+                    string entry = "2024-05-" + to_string(10 + state % 20) + " " + levels[(state >> 8) % 4] + " request " +
+                                   to_string(state >> 12) + " served in " + to_string((state >> 4) % 500) + " ms\n";
+                    entry = entry.substr(0, fileSize - written);
+                    {
+                        FileRef file = fs.openFile(session, path); // Open and close for every append, like a logger
+                        file->write_to_file(entry);
+                    }
+                    fs.closeFile(session, path);
+                    written += entry.size();
+                }
+            }
+            size_t used = heapInUse() - before;
+
+            auto start = chrono::steady_clock::now();
+            for (int i = 0; i < readCount; i++) {
+                state = state * 1103515245u + 12345u;
+                string path = "/Logs/service" + to_string(state % fileCount) + ".log";
+                {
+                    FileRef file = fs.openFile(session, path, Access::Read);
+                    file->read_from(int((state >> 8) % (fileSize - 100)), 100);
+                }
+                fs.closeFile(session, path);
+            }
+            readTime = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+            start = chrono::steady_clock::now();
+            fs.saveToFile(imageName);
+            saveTime = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+            ifstream image(imageName, ios::binary | ios::ate);
+            megabytes = double(image.tellg()) / (1024 * 1024);
+
+            FileSystem loaded;
+            if (compress) loaded.enableCompression(64 << 10);
+            start = chrono::steady_clock::now();
+            loaded.loadFromFile(imageName, LoadMode::Eager);
+            loadTime = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+            report << (compress ? "on " : "off") << "    " << double(used) / (1024 * 1024) << "\t\t" << saveTime * 1000
+                   << "\t   " << megabytes << "\t " << loadTime * 1000 << "\t     " << readTime * 1e6 / readCount << "\n";
+        }
+    }
+    remove(imageName.c_str());
+}
+
+// Commands per second with console output written the old way (every line flushed to
+// cout under one mutex, messages printed as they happen), collected per thread and
+// written in batches, and not echoed at all. cout goes to /dev/null, so each flush
+// is a real write.
+void outputBenchmark(ostream& report, int threadCount, int commandsPerThread) {
+    const size_t batchSize = 64 << 10;
+    report << "Console output: " << threadCount << " threads, " << commandsPerThread << " commands each\n";
+    report << "mode       cmd/s\n";
+    ofstream devNull("/dev/null");
+    streambuf* console = cout.rdbuf(devNull.rdbuf());
+    for (const char* mode : {"flushed", "batched", "noecho"}) {
+        FileSystem fs;
+        mutex ioLock;
+        auto worker = [&](int t) {
+            string fname = "out" + to_string(t) + ".txt";
+            ofstream outFile("/dev/null");
+            ostringstream buffer;
+            ostream muted(nullptr);
+            bool flushed = mode == string("flushed"), echo = mode != string("noecho");
+            ostream& messages = flushed ? cout : echo ? static_cast<ostream&>(buffer) : muted;
+            CommandHandler handler(fs, outFile, messages);
+            handler.processCommand("create " + fname);
+            handler.processCommand("close " + fname);
+            vector<string> script = {"write " + fname + " some text", "close " + fname, "read_from " + fname + " 0 64",
+                                     "close " + fname, "truncate " + fname + " 4096", "close " + fname};
+            for (int i = 0; i < commandsPerThread; i++) {
+                string result = handler.processCommand(script[i % script.size()]);
+                if (flushed) {
+                    outFile << "Thread " << t << ": " << result << endl;
+                    lock_guard<mutex> lock(ioLock);
+                    cout << "Thread " << t << ": " << result << endl;
+                    continue;
+                }
+                outFile << "Thread " << t << ": " << result << '\n';
+                if (!echo) continue;
+                buffer << "Thread " << t << ": " << result << '\n';
+                if (size_t(buffer.tellp()) >= batchSize) {
+                    string text = buffer.str();
+                    buffer.str("");
+                    lock_guard<mutex> lock(ioLock);
+                    cout << text << flush;
+                }
+            }
+            lock_guard<mutex> lock(ioLock);
+            cout << buffer.str() << flush;
+        };
+        auto start = chrono::steady_clock::now();
+        vector<thread> threads;
+        for (int t = 0; t < threadCount; t++) threads.emplace_back(worker, t);
+        for (auto& th : threads) th.join();
+        chrono::duration<double> elapsed = chrono::steady_clock::now() - start;
+        report << mode << "\t   " << (long long)(threadCount * commandsPerThread / elapsed.count()) << "\n";
+    }
+    cout.rdbuf(console);
+}
+
+// Whole-tree commands (memory_map, find, du) on a tree of dirCount directories, ten
+// subdirectories to a directory and filesPerDir files in each, walked by 1 worker
+// and then by more, up to maxWorkers
+void walkBenchmark(ostream& report, int dirCount, int filesPerDir, int maxWorkers) {
+    FileSystem fs;
+    Session setup = fs.newSession();
+    vector<string> dirs = {""};
+    for (size_t parent = 0; int(dirs.size()) < dirCount; parent++) {
+        for (int i = 0; i < 10 && int(dirs.size()) < dirCount; i++) {
+            dirs.push_back(dirs[parent] + "/d" + to_string(i));
+            fs.mkdir(setup, dirs.back());
+        }
+    }
+    for (const string& dir : dirs) {
+        for (int i = 0; i < filesPerDir; i++) fs.createFile(setup, dir + "/file" + to_string(i) + ".txt");
+    }
+    report << "Tree walks: " << dirs.size() << " directories, " << dirs.size() * filesPerDir << " files\n";
+    report << "workers   memory_map (ms)   find (ms)   du (ms)\n";
+    for (int workers = 1; workers <= maxWorkers; workers *= 2) {
+        Executor executor(workers);
+        fs.useExecutor(&executor);
+        NullBuffer discard;
+        ostream messages(&discard);
+        CommandHandler handler(fs, messages, messages);
+        report << workers;
+        for (const char* command : {"memory_map", "find *7.txt", "du"}) {
+            auto start = chrono::steady_clock::now();
+            for (int run = 0; run < 3; run++) handler.processCommand(command);
+            chrono::duration<double> elapsed = chrono::steady_clock::now() - start;
+            report << "\t  " << elapsed.count() * 1000 / 3;
+        }
+        report << "\n";
+        fs.useExecutor(nullptr);
+    }
+}
+
+// Content search over fileCount files of fileSize bytes of text, a few holding the
+// pattern: the naive way (copy each file out, then std::string::find), each search
+// kernel on one thread, and the grep command on every worker
+void grepBenchmark(ostream& report, int fileCount, size_t fileSize) {
+    const string pattern = "needle_in_haystack";
+    const char* words[] = {"lorem", "ipsum", "dolor", "sit", "amet", "needle", "in", "haystack", "consectetur", "elit"};
+    mt19937 random(1);
+    FileSystem fs;
+    Session setup = fs.newSession();
+    vector<string> paths;
+    for (int i = 0; i < fileCount; i++) {
+        if (i % 100 == 0) fs.mkdir(setup, "/dir" + to_string(i / 100));
+        paths.push_back("/dir" + to_string(i / 100) + "/file" + to_string(i) + ".txt");
+        string text;
+        while (text.size() < fileSize) {
+            text += words[random() % 10];
+            text += random() % 1000 == 0 ? "_in_" : " "; // Near misses for the pattern
+        }
+        text.resize(fileSize);
+        if (i % 50 == 0) text.replace(random() % (fileSize - pattern.size()), pattern.size(), pattern);
+        fs.createFile(setup, paths.back());
+        {
+            FileRef file = fs.openFile(setup, paths.back());
+            file->write_to_file(text);
+        }
+        fs.closeFile(setup, paths.back());
+    }
+    double megabytes = double(fileCount) * fileSize / (1024 * 1024);
+    report << "Content search: " << fileCount << " files of " << fileSize << " bytes (" << megabytes << " MiB), pattern '"
+           << pattern << "'\n";
+    report << "method                 ms       MiB/s   matches\n";
+    auto line = [&](const string& method, chrono::duration<double> elapsed, size_t matches) {
+        report << left << setw(20) << method << right << setw(8) << fixed << setprecision(1) << elapsed.count() * 1000
+               << setw(12) << megabytes / elapsed.count() << setw(10) << matches << defaultfloat << "\n";
+    };
+
+    size_t matches = 0;
+    auto start = chrono::steady_clock::now();
+    for (const string& path : paths) {
+        FileRef file = fs.openFile(setup, path, Access::Read);
+        string content = file->read_from_file();
+        for (size_t at = content.find(pattern); at != string::npos; at = content.find(pattern, at + 1)) matches++;
+        fs.closeFile(setup, path);
+    }
+    line("naive string::find", chrono::steady_clock::now() - start, matches);
+
+    for (SearchKernel kernel : {SearchKernel::Scalar, SearchKernel::Sse2, SearchKernel::Avx2}) {
+        if (!searchKernelSupported(kernel)) continue;
+        matches = 0;
+        start = chrono::steady_clock::now();
+        for (const string& path : paths) {
+            FileRef file = fs.openFile(setup, path, Access::Read);
+            SubstringSearch search(pattern, kernel);
+            file->stream_file([&](string_view piece) { search.feed(piece, [&](size_t) { return ++matches, true; }); });
+            fs.closeFile(setup, path);
+        }
+        const char* names[] = {"scalar kernel", "SSE2 kernel", "AVX2 kernel"};
+        line(names[size_t(kernel)], chrono::steady_clock::now() - start, matches);
+    }
+
+    Executor executor(max(1u, thread::hardware_concurrency()));
+    fs.useExecutor(&executor);
+    ostringstream messages;
+    CommandHandler handler(fs, messages, messages);
+    start = chrono::steady_clock::now();
+    handler.processCommand("grep " + pattern);
+    chrono::duration<double> elapsed = chrono::steady_clock::now() - start;
+    string summary = messages.str();
+    size_t lastLine = summary.rfind('\n', summary.size() - 2);
+    line("grep (" + to_string(executor.workerCount()) + " workers)", elapsed, stoul(summary.substr(lastLine + 1)));
+    fs.useExecutor(nullptr);
+}
+
+// Writes the records of a save (each directory's length patched once its files are
+// out) through an ofstream and through ImageFile, then times how long the caller of a
+// full save is held up when the save runs in the background and when it waits for it
+void persistBenchmark(ostream& report, int fileCount, size_t fileSize) {
+    const string imageName = "bench_image.dat";
+    string content(fileSize, 'x');
+    auto writeRecords = [&](ostream& out) {
+        ImageWriter writer(out);
+        writer.header(1);
+        int dirCount = (fileCount + 99) / 100;
+        streampos root = writer.beginDirectory("", 0, uint32_t(dirCount));
+        for (int d = 0; d < dirCount; d++) {
+            int files = min(100, fileCount - d * 100);
+            streampos start = writer.beginDirectory("dir" + to_string(d), uint32_t(files), 0);
+            for (int i = d * 100; i < d * 100 + files; i++) {
+                writer.fileHeader("file" + to_string(i) + ".txt", content.size());
+                out.write(content.data(), content.size());
+            }
+            writer.endDirectory(start);
+        }
+        writer.endDirectory(root);
+    };
+    double megabytes = double(fileCount) * double(fileSize) / (1 << 20);
+    report << "Image writer: " << fileCount << " files of " << fileSize << " bytes, 100 per directory\n";
+    for (int run = 1; run <= 3; run++) {
+        auto start = chrono::steady_clock::now();
+        {
+            ofstream fout(imageName, ios::binary | ios::trunc);
+            writeRecords(fout);
+        }
+        chrono::duration<double> stream = chrono::steady_clock::now() - start;
+        start = chrono::steady_clock::now();
+        {
+            ImageFile file;
+            file.open(imageName);
+            ostream out(&file);
+            writeRecords(out);
+        }
+        chrono::duration<double> buffered = chrono::steady_clock::now() - start;
+        report << "run " << run << ": ofstream " << stream.count() * 1000 << " ms (" << megabytes / stream.count() << " MiB/s), "
+               << "ImageFile " << buffered.count() * 1000 << " ms (" << megabytes / buffered.count() << " MiB/s)\n";
+    }
+
+    report << "Full save, time until the caller goes on:\n";
+    for (int run = 1; run <= 3; run++) {
+        double waited, background, done;
+        {
+            FileSystem fs;
+            buildTree(fs, fileCount, fileSize);
+            auto start = chrono::steady_clock::now();
+            fs.sync(imageName);
+            waited = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        }
+        {
+            FileSystem fs;
+            buildTree(fs, fileCount, fileSize);
+            auto start = chrono::steady_clock::now();
+            uint64_t ticket = fs.saveInBackground(imageName);
+            background = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+            fs.waitSaved(ticket);
+            done = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        }
+        report << "run " << run << ": sync " << waited * 1000 << " ms, background " << background * 1000
+               << " ms (on disk after " << done * 1000 << " ms)\n";
+    }
+    remove(imageName.c_str());
+}
+
+// Thread counts a scaling table has rows for: 1, 2, 4, ... below maxThreads, then
+// maxThreads itself
+vector<int> threadCounts(int maxThreads) {
+    vector<int> counts;
+    for (int t = 1; t < maxThreads; t *= 2) counts.push_back(t);
+    counts.push_back(max(1, maxThreads));
+    return counts;
+}
+
+// Readers all run read_from on one file, alone and with a writer changing the same
+// file, under fs_mutex (LockMode::Global) and with the lock-free read path. Returns
+// reads and writes per second.
+pair<double, double> runReads(int readerCount, bool withWriter, LockMode mode, size_t fileSize, int readsPerThread) {
+    FileSystem fs;
+    Session setup = fs.newSession();
+    fs.createFile(setup, "hot.txt");
+    {
+        FileRef file = fs.openFile(setup, "hot.txt");
+        file->write_to_file(string(fileSize, 'r'));
+    }
+    fs.closeFile(setup, "hot.txt");
+
+    mutex globalLock;
+    atomic<bool> readersDone(false);
+    atomic<long long> writes(0);
+    auto run = [&](CommandHandler& handler, const string& line) {
+        unique_lock<mutex> lock(globalLock, defer_lock);
+        if (mode == LockMode::Global) lock.lock();
+        handler.processCommand(line);
+    };
+    auto reader = [&](int t) {
+        NullBuffer sink;
+        ostream out(&sink);
+        CommandHandler handler(fs, out, out);
+        uint32_t state = 2654435761u * uint32_t(t + 1);
+        for (int i = 0; i < readsPerThread; i++) {
+            state = state * 1664525u + 1013904223u;
+            run(handler, "read_from hot.txt " + to_string(state % (fileSize - 256)) + " 256");
+        }
+    };
+    auto writer = [&] {
+        NullBuffer sink;
+        ostream out(&sink);
+        CommandHandler handler(fs, out, out);
+        for (long long i = 0; !readersDone; i++) {
+            run(handler, "write_at hot.txt " + to_string((i * 4099) % (fileSize - 16)) + " written");
+            run(handler, "close hot.txt");
+            writes++;
+        }
+    };
+
+    thread writerThread;
+    if (withWriter) writerThread = thread(writer);
+    auto start = chrono::steady_clock::now();
+    vector<thread> threads;
+    for (int t = 0; t < readerCount; t++) threads.emplace_back(reader, t);
+    for (auto& th : threads) th.join();
+    chrono::duration<double> elapsed = chrono::steady_clock::now() - start;
+    readersDone = true;
+    if (writerThread.joinable()) writerThread.join();
+    return {readerCount * double(readsPerThread) / elapsed.count(), writes / elapsed.count()};
+}
+
+void readBenchmark(ostream& report, int maxThreads, size_t fileSize, int readsPerThread) {
+    report << "Read scaling: " << readsPerThread << " reads of 256 bytes per thread from one " << fileSize << "-byte file\n";
+    report << "threads   global (reads/s)   lock-free (reads/s)   speedup   | with a writer: global (reads/s, writes/s)   lock-free (reads/s, writes/s)\n";
+    for (int t : threadCounts(maxThreads)) {
+        pair<double, double> global = runReads(t, false, LockMode::Global, fileSize, readsPerThread);
+        pair<double, double> fine = runReads(t, false, LockMode::FineGrained, fileSize, readsPerThread);
+        pair<double, double> globalWriting = runReads(t, true, LockMode::Global, fileSize, readsPerThread);
+        pair<double, double> fineWriting = runReads(t, true, LockMode::FineGrained, fileSize, readsPerThread);
+        report << t << "\t  " << (long long)global.first << "\t\t     " << (long long)fine.first << "\t\t   "
+               << fine.first / global.first << "x\t| " << (long long)globalWriting.first << ", " << (long long)globalWriting.second
+               << "\t\t\t" << (long long)fineWriting.first << ", " << (long long)fineWriting.second << "\n";
+    }
+}
+
+// Appends per second from appenderCount threads writing to one log file, with every
+// command under one lock (mode Global) or through the file's append queue
+double runAppends(int appenderCount, LockMode mode, int appendsPerThread, size_t textSize) {
+    FileSystem fs;
+    Session setup = fs.newSession();
+    fs.createFile(setup, "app.log");
+
+    mutex globalLock;
+    auto appender = [&](int t) {
+        NullBuffer sink;
+        ostream out(&sink);
+        CommandHandler handler(fs, out, out);
+        string line = "write app.log " + string(textSize - 1, char('a' + t % 26)) + "\n";
+        for (int i = 0; i < appendsPerThread; i++) {
+            unique_lock<mutex> lock(globalLock, defer_lock);
+            if (mode == LockMode::Global) lock.lock();
+            handler.processCommand(line);
+        }
+    };
+
+    auto start = chrono::steady_clock::now();
+    vector<thread> threads;
+    for (int t = 0; t < appenderCount; t++) threads.emplace_back(appender, t);
+    for (auto& th : threads) th.join();
+    chrono::duration<double> elapsed = chrono::steady_clock::now() - start;
+    return appenderCount * double(appendsPerThread) / elapsed.count();
+}
+
+void appendBenchmark(ostream& report, int maxThreads, int appendsPerThread, size_t textSize) {
+    report << "Append scaling: " << appendsPerThread << " appends of " << textSize << " bytes per thread to one file\n";
+    report << "threads   global (appends/s)   append queue (appends/s)   speedup\n";
+    for (int t : threadCounts(maxThreads)) {
+        double global = runAppends(t, LockMode::Global, appendsPerThread, textSize);
+        double fine = runAppends(t, LockMode::FineGrained, appendsPerThread, textSize);
+        report << t << "\t  " << (long long)global << "\t\t       " << (long long)fine << "\t\t\t  " << fine / global << "x\n";
+    }
+}
+
+// Synthetic command streams: what workloadBenchmark generates and runs
+struct WorkloadConfig {
+    int threads = max(1, (int)thread::hardware_concurrency());
+    int opsPerThread = 20000;
+    int filesPerThread = 32; // Created before the run; create commands add more
+    int depth = 2; // Directory levels below the root
+    int fanout = 4; // Subdirectories per directory
+    size_t fileSize = 16384; // Mean starting size
+    string sizes = "lognormal"; // fixed, uniform (0 to twice the mean) or lognormal (long tail)
+    size_t writeSize = 64; // Bytes per write and write_at
+    size_t readSize = 4096; // Bytes per read_from, and the most move_within moves
+    vector<pair<Opcode, unsigned>> mix = {{Opcode::Create, 2}, {Opcode::Write, 25}, {Opcode::WriteAt, 20},
+                                          {Opcode::ReadFrom, 40}, {Opcode::MoveWithin, 5}, {Opcode::Truncate, 8}};
+    uint64_t seed = 1;
+    LockMode mode = LockMode::FineGrained;
+};
+
+// Read key=value options over the defaults; returns false after reporting a bad one
+bool parseWorkload(int argc, char* argv[], WorkloadConfig& config, ostream& report) {
+    for (int i = 0; i < argc; i++) {
+        string option = argv[i];
+        size_t equals = option.find('=');
+        string key = option.substr(0, equals), value = equals == string::npos ? "" : option.substr(equals + 1);
+        if (key == "threads") config.threads = max(1, stoi(value));
+        else if (key == "ops") config.opsPerThread = stoi(value);
+        else if (key == "files") config.filesPerThread = max(1, stoi(value));
+        else if (key == "depth") config.depth = stoi(value);
+        else if (key == "fanout") config.fanout = max(1, stoi(value));
+        else if (key == "size") config.fileSize = stoul(value);
+        else if (key == "write") config.writeSize = max<size_t>(1, stoul(value));
+        else if (key == "read") config.readSize = max<size_t>(1, stoul(value));
+        else if (key == "seed") config.seed = stoull(value);
+        else if (key == "sizes" && (value == "fixed" || value == "uniform" || value == "lognormal")) config.sizes = value;
+        else if (key == "lock" && (value == "fine" || value == "global")) {
+            config.mode = value == "fine" ? LockMode::FineGrained : LockMode::Global;
+        } else if (key == "mix") {
+            config.mix.clear();
+            stringstream entries(value);
+            string entry;
+            while (getline(entries, entry, ',')) {
+                size_t colon = entry.find(':');
+                string name = entry.substr(0, colon);
+                Opcode op = lookupOpcode(name.data(), name.size());
+                if (op != Opcode::Create && op != Opcode::Write && op != Opcode::WriteAt && op != Opcode::ReadFrom &&
+                    op != Opcode::MoveWithin && op != Opcode::Truncate) {
+                    report << "Unknown command in mix: " << name
+                           << " (expected create, write, write_at, read_from, move_within or truncate)\n";
+                    return false;
+                }
+                config.mix.push_back({op, colon == string::npos ? 1 : unsigned(stoul(entry.substr(colon + 1)))});
+            }
+        } else {
+            report << "Unknown workload option: " << option << " (expected threads=, ops=, files=, depth=, fanout=, "
+                   << "size=, sizes=fixed|uniform|lognormal, write=, read=, mix=<command>:<weight>,..., seed= or lock=fine|global)\n";
+            return false;
+        }
+    }
+    unsigned total = 0;
+    for (auto& entry : config.mix) total += entry.second;
+    if (total == 0) {
+        report << "The command mix is empty\n";
+        return false;
+    }
+    return true;
+}
+
+// One thread's command stream, generated ahead of the run from its own seed. The
+// generator tracks every file's length, so each command is valid when it runs: the
+// thread's files are its own, and every command is followed by a close.
+class WorkloadGenerator {
+    public:
+        WorkloadGenerator(const WorkloadConfig& config, const vector<string>& dirs, int thread)
+            : config(config), dirs(dirs), thread(thread), random(config.seed * 1000003 + thread) {
+            for (auto& entry : config.mix) totalWeight += entry.second;
+            for (int i = 0; i < 4096; i++) text += "lorem ipsum dolor sit amet consectetur adipiscing elit sed do "[random() % 62];
+        }
+
+        // Paths and starting sizes of the files the thread starts with
+        vector<pair<string, size_t>> initialFiles() {
+            vector<pair<string, size_t>> files;
+            for (int i = 0; i < config.filesPerThread; i++) {
+                files.push_back({newPath(), startingSize()});
+                sizes.push_back(files.back().second);
+            }
+            return files;
+        }
+
+        vector<pair<Opcode, string>> commands() {
+            vector<pair<Opcode, string>> lines;
+            lines.reserve(size_t(config.opsPerThread) * 2 + 1);
+            for (int i = 0; i < config.opsPerThread; i++) {
+                Opcode op = pick();
+                size_t file = random() % paths.size();
+                size_t& size = sizes[file];
+                if (size == 0 && op != Opcode::Create) op = Opcode::Write; // Nothing to read, move or cut yet
+                const string& path = op == Opcode::Create ? newPath() : paths[file];
+                string line = COMMAND_TABLE[size_t(op)].name + (" " + path);
+                switch (op) {
+                    case Opcode::Create:
+                        sizes.push_back(0);
+                        break;
+                    case Opcode::Write:
+                        line += " " + someText(config.writeSize);
+                        size += config.writeSize;
+                        break;
+                    case Opcode::WriteAt: {
+                        size_t pos = random() % (size + 1);
+                        line += " " + to_string(pos) + " " + someText(config.writeSize);
+                        size = max(size, pos + config.writeSize);
+                        break;
+                    }
+                    case Opcode::ReadFrom: {
+                        size_t start = random() % size;
+                        line += " " + to_string(start) + " " + to_string(min(config.readSize, size - start));
+                        break;
+                    }
+                    case Opcode::MoveWithin: {
+                        size_t length = 1 + random() % min(config.readSize, size);
+                        size_t start = random() % (size - length + 1);
+                        line += " " + to_string(start) + " " + to_string(length) + " " + to_string(random() % (size + 1));
+                        break;
+                    }
+                    case Opcode::Truncate:
+                        size -= 1 + random() % (size / 4 + 1); // Cut up to a quarter, so files do not drain away
+                        line += " " + to_string(size);
+                        break;
+                    default:
+                        break;
+                }
+                lines.push_back({op, line});
+                if (op != Opcode::Create) lines.push_back({Opcode::Close, "close " + path});
+            }
+            return lines;
+        }
+
+    private:
+        const WorkloadConfig& config;
+        const vector<string>& dirs;
+        int thread;
+        mt19937_64 random;
+        unsigned totalWeight = 0;
+        string text; // Written bytes are cut from this
+        vector<string> paths; // Absolute paths of the thread's files
+        vector<size_t> sizes; // Their lengths once the commands so far have run
+
+        Opcode pick() {
+            unsigned roll = unsigned(random() % totalWeight);
+            for (auto& entry : config.mix) {
+                if (roll < entry.second) return entry.first;
+                roll -= entry.second;
+            }
+            return config.mix.back().first;
+        }
+
+        const string& newPath() {
+            const string& dir = dirs[random() % dirs.size()];
+            paths.push_back(dir + "/t" + to_string(thread) + "_" + to_string(paths.size()) + ".txt");
+            return paths.back();
+        }
+
+        size_t startingSize() {
+            if (config.sizes == "fixed") return config.fileSize;
+            if (config.sizes == "uniform") return random() % (2 * config.fileSize + 1);
+            lognormal_distribution<double> lognormal(log(double(max<size_t>(config.fileSize, 1))) - 0.5, 1.0); // Mean fileSize
+            return min(size_t(lognormal(random)), 16 * config.fileSize);
+        }
+
+        string someText(size_t length) {
+            string result;
+            while (result.size() < length) {
+                size_t from = random() % text.size();
+                result.append(text, from, length - result.size());
+            }
+            if (result.front() == ' ') result.front() = '_'; // The command parser drops the first space
+            return result;
+        }
+};
+
+// Run generated command streams, one thread each, against a tree of depth levels
+// with fanout subdirectories per directory. Reports commands per second, exact
+// latency percentiles per command, lock waits and the peak heap. The same options
+// and seed give the same commands, so runs before and after a change compare.
+void workloadBenchmark(ostream& report, const WorkloadConfig& config) {
+    size_t baseline = heapInUse();
+    FileSystem fs;
+    Session setup = fs.newSession();
+    vector<string> dirs = {""}; // Absolute paths; "" is the root
+    for (size_t level = 0, first = 0; int(level) < config.depth; level++) {
+        size_t last = dirs.size();
+        for (size_t parent = first; parent < last; parent++) {
+            for (int i = 0; i < config.fanout; i++) {
+                dirs.push_back(dirs[parent] + "/d" + to_string(i));
+                fs.mkdir(setup, dirs.back());
+            }
+        }
+        first = last;
+    }
+
+    vector<unique_ptr<WorkloadGenerator>> generators;
+    vector<vector<pair<Opcode, string>>> scripts;
+    uint64_t startingBytes = 0;
+    string filler(4096, 'x');
+    for (int t = 0; t < config.threads; t++) {
+        generators.emplace_back(new WorkloadGenerator(config, dirs, t));
+        for (auto& file : generators.back()->initialFiles()) {
+            fs.createFile(setup, file.first);
+            {
+                FileRef ref = fs.openFile(setup, file.first);
+                for (size_t written = 0; written < file.second; written += filler.size()) {
+                    ref->write_to_file(filler.substr(0, min(filler.size(), file.second - written)));
+                }
+            }
+            fs.closeFile(setup, file.first);
+            startingBytes += file.second;
+        }
+        scripts.push_back(generators.back()->commands());
+    }
+    size_t commandCount = 0;
+    for (auto& script : scripts) commandCount += script.size();
+    size_t setupHeap = heapInUse();
+
+    report << "Workload: " << config.threads << " threads x " << config.opsPerThread << " operations ("
+           << commandCount << " commands with closes), seed " << config.seed << ", "
+           << (config.mode == LockMode::Global ? "global" : "fine") << " locking\n";
+    report << "tree: " << dirs.size() << " directories (depth " << config.depth << ", fanout " << config.fanout << "), "
+           << config.threads * config.filesPerThread << " files, " << config.sizes << " sizes averaging "
+           << startingBytes / max(1, config.threads * config.filesPerThread) << " bytes\n";
+    report << "mix:";
+    for (auto& entry : config.mix) report << " " << COMMAND_TABLE[size_t(entry.first)].name << ":" << entry.second;
+    report << "\n";
+
+    mutex globalLock;
+    vector<vector<uint64_t>> latencies(config.threads); // Nanoseconds, in script order
+    atomic<bool> done(false);
+    size_t peakHeap = setupHeap;
+    thread sampler([&] {
+        while (!done.load()) {
+            peakHeap = max(peakHeap, heapInUse());
+            this_thread::sleep_for(chrono::milliseconds(5));
+        }
+    });
+    auto worker = [&](int t) {
+        NullBuffer discard;
+        ostream out(&discard), messages(&discard);
+        CommandHandler handler(fs, out, messages);
+        vector<uint64_t>& times = latencies[t];
+        times.reserve(scripts[t].size());
+        for (auto& command : scripts[t]) {
+            auto start = chrono::steady_clock::now();
+            {
+                unique_lock<mutex> lock;
+                if (config.mode == LockMode::Global) lock = Stats::acquire<unique_lock<mutex>>(globalLock, LockKind::Global);
+                handler.processCommand(command.second);
+            }
+            times.push_back(uint64_t(chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start).count()));
+        }
+    };
+
+    Stats::reset();
+    auto start = chrono::steady_clock::now();
+    vector<thread> threads;
+    for (int t = 0; t < config.threads; t++) threads.emplace_back(worker, t);
+    for (auto& th : threads) th.join();
+    chrono::duration<double> elapsed = chrono::steady_clock::now() - start;
+    done = true;
+    sampler.join();
+    peakHeap = max(peakHeap, heapInUse());
+    StatsTotals totals = Stats::snapshot();
+
+    report << fixed << setprecision(1);
+    report << "throughput: " << (long long)(commandCount / elapsed.count()) << " cmd/s, "
+           << (long long)(double(config.threads) * config.opsPerThread / elapsed.count()) << " operations/s ("
+           << elapsed.count() * 1000 << " ms)\n";
+    report << "latency (us)       count       p50       p90       p99     p99.9         max\n";
+    for (size_t op = 0; op < OPCODE_COUNT; op++) {
+        vector<uint64_t> times;
+        for (int t = 0; t < config.threads; t++) {
+            for (size_t i = 0; i < scripts[t].size(); i++) {
+                if (size_t(scripts[t][i].first) == op) times.push_back(latencies[t][i]);
+            }
+        }
+        if (times.empty()) continue;
+        sort(times.begin(), times.end());
+        auto at = [&](double q) { return double(times[min(times.size() - 1, size_t(q * times.size()))]) / 1000; };
+        report << left << setw(13) << COMMAND_TABLE[op].name << right << setw(11) << times.size() << setw(10) << at(0.5)
+               << setw(10) << at(0.9) << setw(10) << at(0.99) << setw(10) << at(0.999) << setw(12) << at(1.0) << "\n";
+    }
+    uint64_t waits = 0, waited = 0;
+    for (size_t i = 0; i < LOCK_KIND_COUNT; i++) {
+        waits += totals.lockWaits[i].count;
+        waited += totals.lockWaits[i].sum;
+    }
+    report << "lock waits: " << waits << " contended acquisitions, " << double(waited) / 1e6 << " ms blocked in all\n";
+    report << "bytes: " << totals.bytesRead << " read, " << totals.bytesWritten << " written\n";
+    if (baseline || setupHeap) {
+        report << "heap: " << double(setupHeap - baseline) / (1024 * 1024) << " MiB after setup, peak "
+               << double(peakHeap - baseline) / (1024 * 1024) << " MiB (scripts included)\n";
+    }
+    report << defaultfloat;
+}
+
+int main(int argc, char* argv[]) {
+    if (argc < 2) {
+        cout << "Usage: " << argv[0] << " scaling [max_threads] [ops_per_thread] [file_size]\n"
+             << "       " << argv[0] << " load [files] [file_size]\n"
+             << "       " << argv[0] << " save [files] [file_size]\n"
+             << "       " << argv[0] << " snapshot [files] [file_size] [writers]\n"
+             << "       " << argv[0] << " commands [passes]\n"
+             << "       " << argv[0] << " paths [depth] [width] [lookups]\n"
+             << "       " << argv[0] << " memory [files]\n"
+             << "       " << argv[0] << " dedup [files] [file_size]\n"
+             << "       " << argv[0] << " compress [files] [file_size]\n"
+             << "       " << argv[0] << " output [threads] [commands_per_thread]\n"
+             << "       " << argv[0] << " walk [directories] [files_per_directory] [max_workers]\n"
+             << "       " << argv[0] << " grep [files] [file_size]\n"
+             << "       " << argv[0] << " persist [files] [file_size]\n"
+             << "       " << argv[0] << " reads [max_threads] [file_size] [reads_per_thread]\n"
+             << "       " << argv[0] << " appends [max_threads] [appends_per_thread] [text_size]\n"
+             << "       " << argv[0] << " workload [threads=<n>] [ops=<n>] [files=<n>] [depth=<n>] [fanout=<n>] [size=<bytes>]\n"
+             << "                  [sizes=fixed|uniform|lognormal] [write=<bytes>] [read=<bytes>]\n"
+             << "                  [mix=<command>:<weight>,...] [seed=<n>] [lock=fine|global]" << endl;
+        return 1;
+    }
+
+    string mode = argv[1];
+    NullBuffer nullBuffer;
+    streambuf* console = cout.rdbuf();
+    streambuf* errors = cerr.rdbuf();
+    ostream report(console);
+
+    if (mode == "scaling") {
+        int maxThreads = argc > 2 ? stoi(argv[2]) : (int)thread::hardware_concurrency();
+        int opsPerThread = argc > 3 ? stoi(argv[3]) : 20000;
+        size_t fileSize = argc > 4 ? stoul(argv[4]) : 65536;
+
+        cout.rdbuf(&nullBuffer); // Command chatter is dropped; results go to the real console
+        cerr.rdbuf(&nullBuffer);
+        scalingBenchmark(report, maxThreads, opsPerThread, fileSize);
+        cout.rdbuf(console);
+        cerr.rdbuf(errors);
+    } else if (mode == "load") {
+        int fileCount = argc > 2 ? stoi(argv[2]) : 100000;
+        size_t fileSize = argc > 3 ? stoul(argv[3]) : 1024;
+
+        cout.rdbuf(&nullBuffer);
+        loadBenchmark(report, fileCount, fileSize);
+        cout.rdbuf(console);
+    } else if (mode == "save") {
+        int fileCount = argc > 2 ? stoi(argv[2]) : 100000;
+        size_t fileSize = argc > 3 ? stoul(argv[3]) : 1024;
+
+        cout.rdbuf(&nullBuffer);
+        saveBenchmark(report, fileCount, fileSize);
+        cout.rdbuf(console);
+    } else if (mode == "snapshot") {
+        int fileCount = argc > 2 ? stoi(argv[2]) : 100000;
+        size_t fileSize = argc > 3 ? stoul(argv[3]) : 1024;
+        int writerCount = argc > 4 ? stoi(argv[4]) : 4;
+
+        cout.rdbuf(&nullBuffer);
+        snapshotBenchmark(report, fileCount, fileSize, writerCount);
+        cout.rdbuf(console);
+    } else if (mode == "commands") {
+        int iterations = argc > 2 ? stoi(argv[2]) : 20000;
+
+        cout.rdbuf(&nullBuffer);
+        cerr.rdbuf(&nullBuffer);
+        commandBenchmark(report, iterations);
+        cout.rdbuf(console);
+        cerr.rdbuf(errors);
+    } else if (mode == "paths") {
+        int depth = argc > 2 ? stoi(argv[2]) : 16;
+        int width = argc > 3 ? stoi(argv[3]) : 1000;
+        int lookups = argc > 4 ? stoi(argv[4]) : 200000;
+
+        cout.rdbuf(&nullBuffer);
+        pathBenchmark(report, depth, width, lookups);
+        cout.rdbuf(console);
+    } else if (mode == "memory") {
+        int fileCount = argc > 2 ? stoi(argv[2]) : 1000000;
+
+        cout.rdbuf(&nullBuffer);
+        memoryBenchmark(report, fileCount);
+        cout.rdbuf(console);
+    } else if (mode == "dedup") {
+        int fileCount = argc > 2 ? stoi(argv[2]) : 10000;
+        size_t fileSize = argc > 3 ? stoul(argv[3]) : 16384;
+
+        cout.rdbuf(&nullBuffer);
+        dedupBenchmark(report, fileCount, fileSize);
+        cout.rdbuf(console);
+    } else if (mode == "compress") {
+        int fileCount = argc > 2 ? stoi(argv[2]) : 500;
+        size_t fileSize = argc > 3 ? stoul(argv[3]) : 262144;
+
+        cout.rdbuf(&nullBuffer);
+        compressBenchmark(report, fileCount, fileSize);
+        cout.rdbuf(console);
+    } else if (mode == "output") {
+        int threadCount = argc > 2 ? stoi(argv[2]) : (int)thread::hardware_concurrency();
+        int commandsPerThread = argc > 3 ? stoi(argv[3]) : 200000;
+
+        cerr.rdbuf(&nullBuffer);
+        outputBenchmark(report, threadCount, commandsPerThread);
+        cerr.rdbuf(errors);
+    } else if (mode == "walk") {
+        int dirCount = argc > 2 ? stoi(argv[2]) : 100000;
+        int filesPerDir = argc > 3 ? stoi(argv[3]) : 10;
+        int maxWorkers = argc > 4 ? stoi(argv[4]) : (int)thread::hardware_concurrency();
+
+        cout.rdbuf(&nullBuffer);
+        walkBenchmark(report, dirCount, filesPerDir, maxWorkers);
+        cout.rdbuf(console);
+    } else if (mode == "grep") {
+        int fileCount = argc > 2 ? stoi(argv[2]) : 2000;
+        size_t fileSize = argc > 3 ? stoul(argv[3]) : 65536;
+
+        cout.rdbuf(&nullBuffer);
+        grepBenchmark(report, fileCount, fileSize);
+        cout.rdbuf(console);
+    } else if (mode == "persist") {
+        int fileCount = argc > 2 ? stoi(argv[2]) : 20000;
+        size_t fileSize = argc > 3 ? stoul(argv[3]) : 4096;
+
+        cout.rdbuf(&nullBuffer);
+        persistBenchmark(report, fileCount, fileSize);
+        cout.rdbuf(console);
+    } else if (mode == "reads") {
+        int maxThreads = argc > 2 ? stoi(argv[2]) : (int)thread::hardware_concurrency();
+        size_t fileSize = argc > 3 ? stoul(argv[3]) : 1 << 20;
+        int readsPerThread = argc > 4 ? stoi(argv[4]) : 200000;
+
+        cout.rdbuf(&nullBuffer);
+        cerr.rdbuf(&nullBuffer);
+        readBenchmark(report, maxThreads, fileSize, readsPerThread);
+        cout.rdbuf(console);
+        cerr.rdbuf(errors);
+    } else if (mode == "appends") {
+        int maxThreads = argc > 2 ? stoi(argv[2]) : (int)thread::hardware_concurrency();
+        int appendsPerThread = argc > 3 ? stoi(argv[3]) : 200000;
+        size_t textSize = argc > 4 ? max<size_t>(1, stoul(argv[4])) : 64;
+
+        cout.rdbuf(&nullBuffer);
+        cerr.rdbuf(&nullBuffer);
+        appendBenchmark(report, maxThreads, appendsPerThread, textSize);
+        cout.rdbuf(console);
+        cerr.rdbuf(errors);
+    } else if (mode == "workload") {
+        WorkloadConfig config;
+        if (!parseWorkload(argc - 2, argv + 2, config, report)) return 1;
+
+        cout.rdbuf(&nullBuffer);
+        cerr.rdbuf(&nullBuffer);
+        workloadBenchmark(report, config);
+        cout.rdbuf(console);
+        cerr.rdbuf(errors);
+    } else {
+        report << "Unknown benchmark: " << mode << endl;
+        return 1;
+    }
+    return 0;
+}
@@ -3,72 +3,164 @@
 #include "CommandHandler.h"
 #include <iostream>
 #include <fstream>
+#include <sstream>
 #include <thread>
 #include <vector>
 #include <mutex>
+#include <memory>
+#include "Executor.h"
 
 using namespace std;
 
-mutex fs_mutex;
+mutex fs_mutex;   // Serializes every command in LockMode::Global
+mutex io_mutex;   // Keeps each stream's batch of console output whole
+
+const size_t CONSOLE_BATCH = 64 << 10; // Console output a stream collects before writing it out
+
+// One input file's commands. Its Strand runs them in file order; streams share
+// the Executor's workers instead of owning a thread each. Console output is
+// collected per stream and written out in large batches, outside every file
+// system lock, so printing never holds up other streams' commands.
+struct CommandStream {
+    int id;
+    bool echo; // Copy results and messages to the console
+    ofstream outFile; // Command results, and the contents of files the stream reads
+    ostringstream console; // Console output not written out yet
+    ostream muted; // Swallows messages when echo is off
+    CommandHandler handler;
+    Strand strand;
+
+    CommandStream(int id, FileSystem& fs, Executor& executor, bool echo)
+        : id(id), echo(echo), muted(nullptr), handler(fs, outFile, echo ? static_cast<ostream&>(console) : muted), strand(executor) {}
+};
+
+// Write out the console output the stream has collected
+void flushConsole(CommandStream& stream) {
+    string text = stream.console.str();
+    if (text.empty()) return;
+    stream.console.str("");
+    lock_guard<mutex> lock(io_mutex);
+    cout << text << flush;
+}
+
+void runCommand(CommandStream& stream, const string& line, LockMode mode) {
+    string result;
+    {
+        unique_lock<mutex> lock;
+        if (mode == LockMode::Global) lock = Stats::acquire<unique_lock<mutex>>(fs_mutex, LockKind::Global);
+        result = stream.handler.processCommand(line);
+    }
+    if (result.empty()) return;
+    stream.outFile << "Thread " << stream.id << ": " << result << '\n';
+    if (!stream.echo) return;
+    stream.console << "Thread " << stream.id << ": " << result << '\n';
+    if (size_t(stream.console.tellp()) >= CONSOLE_BATCH) flushConsole(stream);
+}
+
+// Read input_thread<id>.txt and queue one task per command on the stream's Strand.
+// Runs on the Strand itself, so the commands are queued behind it in file order.
+void scheduleStream(CommandStream& stream, LockMode mode) {
+    string inputFile = "input_thread" + to_string(stream.id) + ".txt";
+    string outputFile = "output_thread" + to_string(stream.id) + ".txt";
 
-void threadFunction(int threadId, FileSystem& fs) {
-    string inputFile = "input_thread" + to_string(threadId) + ".txt";
-    string outputFile = "output_thread" + to_string(threadId) + ".txt";
-    
     ifstream inFile(inputFile);
     if (!inFile.is_open()) {
-        cout << "Thread " << threadId << ": Failed to open " << inputFile << endl;
+        lock_guard<mutex> lock(io_mutex);
+        cout << "Thread " << stream.id << ": Failed to open " << inputFile << endl;
         return;
     }
 
-    ofstream outFile(outputFile);
-    CommandHandler handler(fs);
+    stream.outFile.open(outputFile);
     string line;
-    
     while (getline(inFile, line)) {
         if (!line.empty()) {
-            lock_guard<mutex> lock(fs_mutex);
-            string result = handler.processCommand(line);
-            if (!result.empty()) {
-                outFile << "Thread " << threadId << ": " << result << endl;
-                cout << "Thread " << threadId << ": " << result << endl;
-            }
+            stream.strand.post([&stream, line, mode] { runCommand(stream, line, mode); });
         }
     }
-
-    inFile.close();
-    outFile.close();
+    stream.strand.post([&stream] {
+        flushConsole(stream);
+        stream.outFile.close();
+    });
 }
 
 int main(int argc, char* argv[]) {
-    if (argc != 2) {
-        cout << "Usage: " << argv[0] << " <number_of_threads>" << endl;
+    if (argc < 2) {
+        cout << "Usage: " << argv[0] << " <number_of_streams> [fine|global] [lazy|eager] [journal|nojournal] [dedup] [compress[=<min_bytes>[,<min_saving_percent>]]] [echo|noecho] [workers=<n>]" << endl;
         return 1;
     }
 
-    int threadCount = stoi(argv[1]);
+    int streamCount = stoi(argv[1]); // One command stream per input_thread<N>.txt
+    size_t workerCount = max(1u, thread::hardware_concurrency());
+    LockMode mode = LockMode::FineGrained;
+    LoadMode loadMode = LoadMode::Lazy;
+    bool journal = true;
+    bool dedup = false;
+    bool compress = false;
+    bool echo = true;
+    uint64_t compressMinSize = 64 << 10; // Files shorter than this stay uncompressed
+    uint32_t compressMinSaving = 25; // Percent a block must shrink by to be kept compressed
+    for (int i = 2; i < argc; i++) {
+        string option = argv[i];
+        if (option == "global") {
+            mode = LockMode::Global;
+        } else if (option == "fine") {
+            mode = LockMode::FineGrained;
+        } else if (option == "eager") {
+            loadMode = LoadMode::Eager;
+        } else if (option == "lazy") {
+            loadMode = LoadMode::Lazy;
+        } else if (option == "journal" || option == "nojournal") {
+            journal = option == "journal";
+        } else if (option == "dedup") {
+            dedup = true;
+        } else if (option == "compress" || option.rfind("compress=", 0) == 0) {
+            compress = true;
+            if (option.size() > 9) {
+                string thresholds = option.substr(9);
+                size_t comma = thresholds.find(',');
+                compressMinSize = stoull(thresholds.substr(0, comma));
+                if (comma != string::npos) compressMinSaving = uint32_t(stoul(thresholds.substr(comma + 1)));
+            }
+        } else if (option == "echo" || option == "noecho") {
+            echo = option == "echo";
+        } else if (option.rfind("workers=", 0) == 0) {
+            workerCount = stoul(option.substr(8));
+        } else {
+            cout << "Unknown option: " << option << " (expected 'fine', 'global', 'lazy', 'eager', 'journal', 'nojournal', 'dedup', 'compress[=<min_bytes>[,<min_saving_percent>]]', 'echo', 'noecho' or 'workers=<n>')" << endl;
+            return 1;
+        }
+    }
     FileSystem fs;
+    if (dedup) fs.enableDedup();
+    if (compress) fs.enableCompression(compressMinSize, compressMinSaving);
     
-    // Load initial file system state if needed
-    if (ifstream("dil.dat").good()) {
-        fs.loadFromFile("dil.dat");
-    }
+    // Load initial file system state and replay any journaled commands on top of it
+    fs.loadFromFile("dil.dat", loadMode, cout);
+    if (journal) fs.enableJournal("dil.dat", true, cout);
 
-    vector<thread> threads;
-    
-    // Launch threads
-    for (int i = 1; i <= threadCount; i++) {
-        threads.push_back(thread(threadFunction, i, ref(fs)));
+    // Every stream is a Strand on one fixed pool of workers
+    Executor executor(workerCount);
+    fs.useExecutor(&executor); // Whole-tree commands fork their walks onto the same workers
+    vector<unique_ptr<CommandStream>> streams;
+    for (int i = 1; i <= streamCount; i++) {
+        streams.emplace_back(new CommandStream(i, fs, executor, echo));
+        CommandStream& stream = *streams.back();
+        stream.strand.post([&stream, mode] { scheduleStream(stream, mode); });
     }
 
-    // Wait for all threads to complete
-    for (auto& t : threads) {
-        t.join();
-    }
+    // Wait for every stream to run out of commands
+    executor.wait();
+
+    // Where the time went, over every stream
+    cout << "Statistics:\n";
+    fs.showStats(cout);
 
-    // Save final state
-    fs.saveToFile("dil.dat");
-    cout << "All threads completed. File system saved." << endl;
+    // Save final state and wait for the disk; with the journal on, only the log still
+    // needs flushing, along with any checkpoint still running
+    bool saved = fs.sync("dil.dat");
+    fs.closeJournal();
+    if (saved) cout << "All threads completed. File system saved." << endl;
+    else cout << "All threads completed. Failed to save the file system." << endl;
 
     return 0;
 }
\ No newline at end of file